@@ -0,0 +1,135 @@
+############################################################
+#               :
+#   File        :   capture_dump.py
+#               :
+#   Description :   Receives a burst capture from the VCU on
+#               :   CAN S and writes it to a CSV file
+#               :   (capture in config.c)
+#               :
+#   Usage       :   python3 capture_dump.py can0 capture.csv
+#               :       [--trigger] [--can-id 0x6F8]
+#               :       [--command-id 0x6FA]
+#               :
+#   Requires    :   python-can
+#               :
+############################################################
+
+import argparse
+import csv
+
+import can
+
+############################################################
+# constants
+############################################################
+
+TRIGGER_NAMES = ['none', 'command', 'fault']
+
+# command frame byte 0 to trigger a capture
+CMD_TRIGGER = 0x01
+
+############################################################
+# decoding
+############################################################
+
+def to_signed(value, bits):
+    sign = 1 << (bits - 1)
+    return (value & (sign - 1)) - (value & sign)
+
+
+def decode_header(data):
+    """Header frame, sent at can_id before the samples
+    """
+    return {
+        'trigger': TRIGGER_NAMES[data[0]] if data[0] < len(TRIGGER_NAMES)
+                   else data[0],
+        'number': data[1],
+        'samples': int.from_bytes(data[2:4], 'little'),
+        'pre_samples': int.from_bytes(data[4:6], 'little'),
+        'time_ms': int.from_bytes(data[6:8], 'little'),
+    }
+
+
+def decode_sample(data):
+    """Sample frame, sent at can_id + 1 (12 bit fields, then 16 bit speed)
+    """
+    bits = int.from_bytes(data[0:8], 'little')
+    return {
+        'index': bits & 0xFFF,
+        'apps': (bits >> 12) & 0xFFF,
+        'bps': (bits >> 24) & 0xFFF,
+        'torque_request': (bits >> 36) & 0xFFF,
+        'motor_speed': to_signed(bits >> 48, 16),
+    }
+
+############################################################
+# main function
+############################################################
+
+def run():
+
+    parser = argparse.ArgumentParser(description='Receives a VCU burst capture')
+    parser.add_argument('channel', help='SocketCAN interface connected to CAN S')
+    parser.add_argument('output', help='CSV file to write')
+    parser.add_argument('--trigger', action='store_true',
+                        help='trigger a capture rather than wait for one')
+    parser.add_argument('--can-id', type=lambda x: int(x, 0), default=0x6F8,
+                        help='CAN ID of the capture header')
+    parser.add_argument('--command-id', type=lambda x: int(x, 0),
+                        default=0x6FA, help='CAN ID of capture commands')
+    args = parser.parse_args()
+
+    bus = can.interface.Bus(channel=args.channel, interface='socketcan',
+                            can_filters=[{'can_id': args.can_id,
+                                          'can_mask': 0x7FE,
+                                          'extended': False}])
+
+    with bus:
+        if args.trigger:
+            bus.send(can.Message(arbitration_id=args.command_id,
+                                 data=[CMD_TRIGGER], is_extended_id=False))
+
+        header = None
+        samples = []
+
+        while header is None or len(samples) < header['samples']:
+            msg = bus.recv()
+
+            if msg.arbitration_id == args.can_id and msg.dlc == 8:
+                header = decode_header(msg.data)
+                samples = []
+                print('Capture {} ({}): {} samples, {} before trigger'.format(
+                      header['number'], header['trigger'], header['samples'],
+                      header['pre_samples']))
+            elif header is not None and msg.dlc == 8:
+                sample = decode_sample(msg.data)
+
+                if sample['index'] != len(samples) & 0xFFF:
+                    print('Lost {} samples'.format(
+                          (sample['index'] - len(samples)) & 0xFFF))
+
+                samples.append(sample)
+
+    # sample times from the recording time after the trigger
+    post_samples = header['samples'] - header['pre_samples']
+    period_ms = header['time_ms'] / max(post_samples - 1, 1)
+
+    with open(args.output, 'w', newline='') as f:
+        writer = csv.writer(f)
+        writer.writerow(['time_ms', 'apps', 'bps', 'torque_request',
+                         'motor_speed'])
+
+        for i, sample in enumerate(samples):
+            writer.writerow(['{:.1f}'.format((i - header['pre_samples'])
+                                             * period_ms),
+                             sample['apps'], sample['bps'],
+                             sample['torque_request'], sample['motor_speed']])
+
+    print('Wrote ' + args.output)
+
+############################################################
+# driver code / main
+############################################################
+
+if __name__  == "__main__":
+    run()
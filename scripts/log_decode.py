@@ -0,0 +1,347 @@
+############################################################
+#               :
+#   File        :   log_decode.py
+#               :
+#   Description :   Decoder for VCU binary log messages
+#               :   (LOG_BINARY_MODE in config.h)
+#               :
+#   Usage       :   python3 log_decode.py build/VCU.elf
+#               :       --port /dev/ttyACM0 [--baud 115200]
+#               :   python3 log_decode.py build/VCU.elf
+#               :       --file capture.bin
+#               :   python3 log_decode.py build/VCU.elf
+#               :       --can can0 [--can-id 0x7F0]
+#               :
+#   Requires    :   pyelftools, pyserial (--port only),
+#               :   python-can (--can only)
+#               :
+############################################################
+
+import argparse
+import re
+import sys
+
+from elftools.elf.elffile import ELFFile
+
+############################################################
+# constants
+############################################################
+
+class Colours:
+    """Colours for printing
+    """
+    Header = '\033[95m'
+    Blue = '\033[94m'
+    Cyan = '\033[96m'
+    Green = '\033[92m'
+    Warning = '\033[93m'
+    Error = '\033[91m'
+    End = '\033[0m'
+    Bold = '\033[1m'
+    Underline = '\033[4m'
+
+LOG_FMT_SECTION = '.log_fmt'
+
+LOG_LEVEL_NAMES = ['DEBUG', 'INFO', 'WARN', 'ERROR', 'FATAL']
+
+LOG_LEVEL_COLOURS = [Colours.Cyan, '', Colours.Warning, Colours.Error,
+                     Colours.Error + Colours.Bold]
+
+# printf conversion specifiers supported by the decoder
+FORMAT_SPEC = re.compile(r'%([-+ 0#]*)(\d*)(?:\.(\d+))?(hh|h|ll|l|z|j|t)?([diuxXcsp%])')
+
+############################################################
+# ELF
+############################################################
+
+class Firmware:
+    """Format strings and constant data from the VCU ELF file
+    """
+
+    def __init__(self, elf_path):
+        self.formats = {}
+        self.segments = []
+
+        with open(elf_path, 'rb') as f:
+            elf = ELFFile(f)
+
+            fmt_section = elf.get_section_by_name(LOG_FMT_SECTION)
+
+            if fmt_section is None:
+                sys.exit(Colours.Error + 'Error: no ' + LOG_FMT_SECTION
+                         + ' section in ' + elf_path
+                         + ' (was LOG_BINARY_MODE defined?)' + Colours.End)
+
+            self.formats = parse_format_table(fmt_section.data(),
+                                              fmt_section['sh_addr'])
+
+            # keep loaded sections so that string arguments in flash can be
+            # looked up
+            for section in elf.iter_sections():
+                if section['sh_flags'] & 0x2 and section['sh_type'] != 'SHT_NOBITS':
+                    self.segments.append((section['sh_addr'], section.data()))
+
+    def read_string(self, address):
+        """Reads a null terminated string from the firmware image
+        """
+        for base, data in self.segments:
+            if base <= address < base + len(data):
+                end = data.find(b'\0', address - base)
+                if end < 0:
+                    end = len(data)
+                return data[address - base:end].decode('ascii', 'replace')
+
+        return '<0x{:08x}>'.format(address)
+
+
+def parse_format_table(data, base_address):
+    """Splits the .log_fmt section into format strings keyed by address
+    """
+    formats = {}
+    start = None
+
+    for i, byte in enumerate(data):
+        if byte != 0 and start is None:
+            start = i
+        elif byte == 0 and start is not None:
+            formats[base_address + start] = data[start:i].decode('ascii', 'replace')
+            start = None
+
+    return formats
+
+############################################################
+# frame decoding
+############################################################
+
+def cobs_decode(frame):
+    """Decodes a COBS encoded frame (without the zero delimiter)
+    """
+    out = bytearray()
+    i = 0
+
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame) + 1:
+            raise ValueError('invalid COBS frame')
+
+        out += frame[i + 1:i + code]
+        i += code
+
+        if code < 0xFF and i < len(frame):
+            out.append(0)
+
+    return bytes(out)
+
+
+def read_varint(data, index):
+    """Reads an unsigned LEB128 value, returns (value, next index)
+    """
+    value = 0
+    shift = 0
+
+    while True:
+        byte = data[index]
+        index += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+
+        if not byte & 0x80:
+            return value & 0xFFFFFFFF, index
+
+
+def decode_frame(payload):
+    """Decodes a binary log message
+
+    Returns
+    -------
+    tuple(4)
+        level, format ID, timestamp, list of raw arguments
+    """
+    level = payload[0] >> 4
+    argc = payload[0] & 0x0F
+
+    fmt_id, i = read_varint(payload, 1)
+    timestamp, i = read_varint(payload, i)
+
+    args = []
+    for _ in range(argc):
+        arg, i = read_varint(payload, i)
+        args.append(arg)
+
+    return level, fmt_id, timestamp, args
+
+############################################################
+# formatting
+############################################################
+
+def to_signed(value, bits):
+    value &= (1 << bits) - 1
+    return value - (1 << bits) if value & (1 << (bits - 1)) else value
+
+
+def c_format(fmt, args, firmware):
+    """Applies printf style formatting to raw 32-bit argument words
+    """
+    args = list(args)
+
+    def convert(match):
+        flags, width, precision, length, conv = match.groups()
+
+        if conv == '%':
+            return '%'
+
+        if not args:
+            return '<missing>'
+
+        raw = args.pop(0)
+        bits = {'hh': 8, 'h': 16}.get(length, 32)
+        spec = '%' + flags.replace('#', '') + width
+
+        if conv in 'di':
+            return (spec + 'd') % to_signed(raw, bits)
+        if conv == 'u':
+            return (spec + 'd') % (raw & ((1 << bits) - 1))
+        if conv in 'xX':
+            prefix = ('0x' if conv == 'x' else '0X') if '#' in flags else ''
+            return prefix + (spec + conv) % (raw & ((1 << bits) - 1))
+        if conv == 'c':
+            return (spec + 'c') % chr(raw & 0xFF)
+        if conv == 's':
+            string = firmware.read_string(raw)
+            if precision:
+                string = string[:int(precision)]
+            return (spec + 's') % string
+        if conv == 'p':
+            return '0x{:08x}'.format(raw)
+
+        return match.group(0)
+
+    return FORMAT_SPEC.sub(convert, fmt)
+
+
+def print_message(firmware, payload):
+    level, fmt_id, timestamp, args = decode_frame(payload)
+
+    fmt = firmware.formats.get(fmt_id)
+    if fmt is None:
+        text = '<unknown format 0x{:x}> {}\n'.format(fmt_id, args)
+    else:
+        text = c_format(fmt, args, firmware)
+
+    if level < len(LOG_LEVEL_NAMES):
+        name = LOG_LEVEL_NAMES[level]
+        colour = LOG_LEVEL_COLOURS[level]
+    else:
+        name = '?'
+        colour = ''
+
+    sys.stdout.write('{}{} [{}]: {}{}'.format(colour, timestamp, name, text,
+                                              Colours.End if colour else ''))
+    sys.stdout.flush()
+
+############################################################
+# input streams
+############################################################
+
+def serial_stream(port, baud):
+    import serial
+
+    with serial.Serial(port, baud, timeout=0.1) as ser:
+        while True:
+            data = ser.read(256)
+            if data:
+                yield data
+
+
+def can_stream(channel, can_id):
+    """Reassembles the log stream sent on CAN S (stream_can_id in config.c)
+
+    Byte 0 of each frame is a sequence number, the rest are log bytes. A
+    zero byte is inserted after lost frames so the partial COBS frame is
+    discarded rather than merged with the next one.
+    """
+    import can
+
+    bus = can.interface.Bus(channel=channel, interface='socketcan',
+                            can_filters=[{'can_id': can_id, 'can_mask': 0x7FF,
+                                          'extended': False}])
+    expected_seq = None
+
+    with bus:
+        while True:
+            msg = bus.recv(0.1)
+            if msg is None or msg.dlc < 1:
+                continue
+
+            seq = msg.data[0]
+            if expected_seq is not None and seq != expected_seq:
+                print(Colours.Warning + 'Lost {} CAN frames'.format(
+                      (seq - expected_seq) & 0xFF) + Colours.End)
+                yield b'\0'
+
+            expected_seq = (seq + 1) & 0xFF
+            yield bytes(msg.data[1:msg.dlc])
+
+
+def file_stream(path):
+    with open(path, 'rb') as f:
+        while True:
+            data = f.read(4096)
+            if not data:
+                return
+            yield data
+
+############################################################
+# main function
+############################################################
+
+def run():
+
+    parser = argparse.ArgumentParser(description='Decodes VCU binary log messages')
+    parser.add_argument('elf', help='ELF file the VCU was flashed with')
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument('--port', help='serial port connected to the VCU UART')
+    source.add_argument('--file', help='file containing captured log bytes')
+    source.add_argument('--can', help='SocketCAN interface connected to CAN S')
+    parser.add_argument('--can-id', type=lambda x: int(x, 0), default=0x7F0,
+                        help='CAN ID of the log stream')
+    parser.add_argument('--baud', type=int, default=115200, help='baud rate')
+    args = parser.parse_args()
+
+    firmware = Firmware(args.elf)
+
+    print(Colours.Header + 'Loaded ' + str(len(firmware.formats))
+          + ' log formats from ' + args.elf + Colours.End)
+
+    if args.port:
+        stream = serial_stream(args.port, args.baud)
+    elif args.can:
+        stream = can_stream(args.can, args.can_id)
+    else:
+        stream = file_stream(args.file)
+    frame = bytearray()
+
+    try:
+        for data in stream:
+            for byte in data:
+                if byte != 0:
+                    frame.append(byte)
+                    continue
+
+                # zero byte marks the end of a frame
+                if frame:
+                    try:
+                        print_message(firmware, cobs_decode(bytes(frame)))
+                    except (ValueError, IndexError):
+                        print(Colours.Warning + 'Dropped corrupt frame'
+                              + Colours.End)
+                    frame.clear()
+    except KeyboardInterrupt:
+        pass
+
+############################################################
+# driver code / main
+############################################################
+
+if __name__  == "__main__":
+    run()
@@ -0,0 +1,429 @@
+############################################################
+#               :
+#   File        :   xcp_a2l.py
+#               :
+#   Description :   Generates an A2L file for the VCU XCP
+#               :   server (xcp in config.c), finding the
+#               :   address and type of each variable by
+#               :   name in the ELF debug information
+#               :
+#   Usage       :   python3 xcp_a2l.py build/VCU.elf
+#               :       vcu.ctrl.apps_reading
+#               :       vcu.ctrl.torque_request [-o vcu.a2l]
+#               :   python3 xcp_a2l.py build/VCU.elf
+#               :       --list [vcu.ctrl]
+#               :
+#   Requires    :   pyelftools
+#               :
+############################################################
+
+import argparse
+import re
+import sys
+
+from elftools.dwarf.enums import ENUM_DW_ATE
+from elftools.elf.elffile import ELFFile
+
+############################################################
+# constants
+############################################################
+
+# A2L data types of base types, by (signed, size)
+INT_TYPES = {
+    (False, 1): 'UBYTE',
+    (True, 1): 'SBYTE',
+    (False, 2): 'UWORD',
+    (True, 2): 'SWORD',
+    (False, 4): 'ULONG',
+    (True, 4): 'SLONG',
+    (False, 8): 'A_UINT64',
+    (True, 8): 'A_INT64',
+}
+
+FLOAT_TYPES = {
+    4: 'FLOAT32_IEEE',
+    8: 'FLOAT64_IEEE',
+}
+
+# DW_ATE encodings of signed base types
+SIGNED_ENCODINGS = ['DW_ATE_signed', 'DW_ATE_signed_char']
+
+# type qualifiers which don't change the layout
+QUALIFIER_TAGS = ['DW_TAG_typedef', 'DW_TAG_const_type',
+                  'DW_TAG_volatile_type', 'DW_TAG_atomic_type']
+
+# event channels, in the order of xcp_event_t
+EVENTS = ['CTRL', 'CANBC']
+
+# DAQ memory, from xcp.h
+MAX_DAQ = 8
+MAX_ODT_ENTRY_SIZE = 7
+
+############################################################
+# DWARF
+############################################################
+
+class Variable:
+    """Scalar variable in memory
+    """
+    def __init__(self, name, address, size, datatype):
+        self.name = name
+        self.address = address
+        self.size = size
+        self.datatype = datatype
+
+
+def strip_type(die):
+    """Follows typedefs and qualifiers to the underlying type
+    """
+    while die.tag in QUALIFIER_TAGS:
+        if 'DW_AT_type' not in die.attributes:
+            return None
+        die = die.get_DIE_from_attribute('DW_AT_type')
+
+    return die
+
+
+def die_name(die):
+    attr = die.attributes.get('DW_AT_name')
+    return attr.value.decode() if attr else None
+
+
+def member_offset(die):
+    """Offset of a structure member, either a constant or a
+    DW_OP_plus_uconst expression
+    """
+    attr = die.attributes.get('DW_AT_data_member_location')
+
+    if attr is None:
+        return 0
+
+    if isinstance(attr.value, int):
+        return attr.value
+
+    # DW_OP_plus_uconst, ULEB128 operand
+    offset = 0
+    shift = 0
+
+    for byte in attr.value[1:]:
+        offset |= (byte & 0x7F) << shift
+        shift += 7
+
+        if not byte & 0x80:
+            break
+
+    return offset
+
+
+def array_dims(die):
+    """Dimensions of an array type
+    """
+    dims = []
+
+    for child in die.iter_children():
+        if child.tag != 'DW_TAG_subrange_type':
+            continue
+
+        if 'DW_AT_count' in child.attributes:
+            dims.append(child.attributes['DW_AT_count'].value)
+        elif 'DW_AT_upper_bound' in child.attributes:
+            dims.append(child.attributes['DW_AT_upper_bound'].value + 1)
+        else:
+            dims.append(0)
+
+    return dims
+
+
+def type_size(die):
+    die = strip_type(die)
+
+    if die is None:
+        return 0
+
+    if 'DW_AT_byte_size' in die.attributes:
+        return die.attributes['DW_AT_byte_size'].value
+
+    if die.tag == 'DW_TAG_array_type':
+        size = type_size(die.get_DIE_from_attribute('DW_AT_type'))
+
+        for dim in array_dims(die):
+            size *= dim
+
+        return size
+
+    return 0
+
+
+def scalar_type(die):
+    """A2L data type of a scalar type, or None if not a scalar
+    """
+    die = strip_type(die)
+
+    if die is None:
+        return None
+
+    size = type_size(die)
+
+    if die.tag == 'DW_TAG_base_type':
+        encoding = die.attributes['DW_AT_encoding'].value
+
+        if encoding == ENUM_DW_ATE['DW_ATE_float']:
+            return FLOAT_TYPES.get(size)
+
+        signed = encoding in [ENUM_DW_ATE[name] for name in SIGNED_ENCODINGS]
+        return INT_TYPES.get((signed, size))
+
+    if die.tag in ['DW_TAG_enumeration_type', 'DW_TAG_pointer_type']:
+        return INT_TYPES.get((False, size))
+
+    return None
+
+
+def find_globals(dwarf):
+    """Finds all variables with a static address, by name
+    """
+    variables = {}
+
+    for cu in dwarf.iter_CUs():
+        for die in cu.get_top_DIE().iter_children():
+            if die.tag != 'DW_TAG_variable':
+                continue
+
+            name = die_name(die)
+            location = die.attributes.get('DW_AT_location')
+
+            # DW_OP_addr followed by a 32 bit address
+            if (name is None or location is None
+                    or not isinstance(location.value, list)
+                    or len(location.value) != 5 or location.value[0] != 0x03):
+                continue
+
+            address = int.from_bytes(bytes(location.value[1:5]), 'little')
+            variables[name] = (address,
+                               die.get_DIE_from_attribute('DW_AT_type'))
+
+    return variables
+
+
+def resolve(variables, path):
+    """Resolves a path such as vcu.ctrl.apps_reading or
+    vcu.canstats.buses[0].load to (address, type DIE)
+    """
+    parts = re.findall(r'[A-Za-z_]\w*|\[\d+\]', path)
+
+    if not parts or parts[0] not in variables:
+        raise KeyError('No global variable ' + parts[0] if parts else path)
+
+    address, die = variables[parts[0]]
+
+    for part in parts[1:]:
+        die = strip_type(die)
+
+        if part.startswith('['):
+            if die.tag != 'DW_TAG_array_type':
+                raise KeyError(path + ': not an array')
+
+            element = die.get_DIE_from_attribute('DW_AT_type')
+            index = int(part[1:-1])
+            dims = array_dims(die)
+
+            if len(dims) > 1:
+                raise KeyError(path + ': multidimensional array')
+
+            if dims and index >= dims[0]:
+                raise KeyError(path + ': index out of range')
+
+            address += index * type_size(element)
+            die = element
+        else:
+            if die.tag not in ['DW_TAG_structure_type', 'DW_TAG_union_type']:
+                raise KeyError(path + ': not a structure')
+
+            member = next((child for child in die.iter_children()
+                           if die_name(child) == part), None)
+
+            if member is None:
+                raise KeyError(path + ': no member ' + part)
+
+            address += member_offset(member)
+            die = member.get_DIE_from_attribute('DW_AT_type')
+
+    return address, die
+
+
+def leaves(name, address, die):
+    """Yields every scalar inside a variable
+    """
+    datatype = scalar_type(die)
+
+    if datatype is not None:
+        yield Variable(name, address, type_size(die), datatype)
+        return
+
+    die = strip_type(die)
+
+    if die is None:
+        return
+
+    if die.tag in ['DW_TAG_structure_type', 'DW_TAG_union_type']:
+        for child in die.iter_children():
+            if child.tag == 'DW_TAG_member' and die_name(child):
+                yield from leaves(name + '.' + die_name(child),
+                                  address + member_offset(child),
+                                  child.get_DIE_from_attribute('DW_AT_type'))
+
+    elif die.tag == 'DW_TAG_array_type':
+        element = die.get_DIE_from_attribute('DW_AT_type')
+        dims = array_dims(die)
+
+        # multidimensional arrays are skipped
+        if len(dims) == 1:
+            for i in range(dims[0]):
+                yield from leaves('{}[{}]'.format(name, i),
+                                  address + i * type_size(element), element)
+
+############################################################
+# A2L
+############################################################
+
+def a2l_name(path):
+    """A2L identifiers can't contain brackets
+    """
+    return re.sub(r'\[(\d+)\]', r'._\1_', path)
+
+
+def limits(datatype, size):
+    if datatype.startswith('FLOAT'):
+        return '-1e38', '1e38'
+
+    if datatype.startswith('S') or datatype == 'A_INT64':
+        return str(-(1 << (8 * size - 1))), str((1 << (8 * size - 1)) - 1)
+
+    return '0', str((1 << (8 * size)) - 1)
+
+
+def write_a2l(f, variables, args):
+    f.write('ASAP2_VERSION 1 71\n')
+    f.write('/begin PROJECT VCU "SUFST VCU"\n')
+    f.write('  /begin MODULE VCU ""\n')
+
+    f.write('    /begin MOD_PAR ""\n')
+    f.write('      BYTE_ORDER MSB_LAST\n')
+    f.write('    /end MOD_PAR\n')
+
+    f.write('    /begin IF_DATA XCP\n')
+    f.write('      /begin PROTOCOL_LAYER\n')
+    f.write('        0x0101 2000 2000 0 0 0 0 0 8 8 BYTE_ORDER_MSB_LAST\n')
+    f.write('        ADDRESS_GRANULARITY_BYTE\n')
+    f.write('      /end PROTOCOL_LAYER\n')
+    f.write('      /begin DAQ\n')
+    f.write('        DYNAMIC {} {} 0 OPTIMISATION_TYPE_DEFAULT\n'
+            .format(MAX_DAQ, len(EVENTS)))
+    f.write('        ADDRESS_EXTENSION_FREE\n')
+    f.write('        IDENTIFICATION_FIELD_TYPE_ABSOLUTE\n')
+    f.write('        GRANULARITY_ODT_ENTRY_SIZE_DAQ_BYTE {}\n'
+            .format(MAX_ODT_ENTRY_SIZE))
+    f.write('        NO_OVERLOAD_INDICATION\n')
+    f.write('        /begin TIMESTAMP_SUPPORTED\n')
+    f.write('          0 NO_TIMESTAMP UNIT_1MS\n')
+    f.write('        /end TIMESTAMP_SUPPORTED\n')
+
+    for i, event in enumerate(EVENTS):
+        f.write('        /begin EVENT "{0}" "{0}" {1} DAQ {2} 0 6 0\n'
+                .format(event, i, MAX_DAQ))
+        f.write('        /end EVENT\n')
+
+    f.write('      /end DAQ\n')
+    f.write('      /begin XCP_ON_CAN\n')
+    f.write('        0x0100\n')
+    f.write('        CAN_ID_MASTER 0x{:X}\n'.format(args.cmd_id))
+    f.write('        CAN_ID_SLAVE 0x{:X}\n'.format(args.res_id))
+    f.write('        BAUDRATE {}\n'.format(args.baudrate))
+    f.write('      /end XCP_ON_CAN\n')
+    f.write('    /end IF_DATA\n')
+
+    for var in variables:
+        lower, upper = limits(var.datatype, var.size)
+        f.write('    /begin MEASUREMENT {} "{}"\n'.format(a2l_name(var.name),
+                                                         var.name))
+        f.write('      {} NO_COMPU_METHOD 0 0 {} {}\n'.format(var.datatype,
+                                                             lower, upper))
+        f.write('      ECU_ADDRESS 0x{:08X}\n'.format(var.address))
+        f.write('    /end MEASUREMENT\n')
+
+    f.write('  /end MODULE\n')
+    f.write('/end PROJECT\n')
+
+############################################################
+# main function
+############################################################
+
+def run():
+
+    parser = argparse.ArgumentParser(description='Generates an A2L file for '
+                                     'the VCU XCP server')
+    parser.add_argument('elf', help='VCU ELF file with debug information')
+    parser.add_argument('names', nargs='*',
+                        help='variables to measure, such as '
+                             'vcu.ctrl.apps_reading (structures and arrays '
+                             'are expanded)')
+    parser.add_argument('--list', action='store_true',
+                        help='list the variables which can be measured, '
+                             'under the given names if any')
+    parser.add_argument('-o', '--output', help='A2L file to write '
+                        '(default stdout)')
+    parser.add_argument('--cmd-id', type=lambda x: int(x, 0), default=0x6E0,
+                        help='CAN ID of XCP commands')
+    parser.add_argument('--res-id', type=lambda x: int(x, 0), default=0x6E1,
+                        help='CAN ID of XCP responses and DAQ data')
+    parser.add_argument('--baudrate', type=int, default=500000,
+                        help='CAN S bit rate')
+    args = parser.parse_args()
+
+    with open(args.elf, 'rb') as f:
+        elf = ELFFile(f)
+
+        if not elf.has_dwarf_info():
+            sys.exit(args.elf + ' has no debug information')
+
+        dwarf = elf.get_dwarf_info()
+        global_vars = find_globals(dwarf)
+        names = args.names
+
+        if not names and args.list:
+            names = sorted(global_vars)
+
+        measurements = []
+
+        for name in names:
+            try:
+                address, die = resolve(global_vars, name)
+            except KeyError as e:
+                sys.exit(e.args[0])
+
+            measurements.extend(leaves(name, address, die))
+
+    if args.list:
+        for var in measurements:
+            print('0x{:08X} {:<13} {}'.format(var.address, var.datatype,
+                                             var.name))
+        return
+
+    if not measurements:
+        sys.exit('No variables to measure')
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            write_a2l(f, measurements, args)
+
+        print('Wrote {} measurements to {}'.format(len(measurements),
+                                                  args.output))
+    else:
+        write_a2l(sys.stdout, measurements, args)
+
+############################################################
+# driver code / main
+############################################################
+
+if __name__  == "__main__":
+    run()
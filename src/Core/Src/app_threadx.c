@@ -114,17 +114,17 @@ void MX_ThreadX_Init(void)
  */
 void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef* can_h)
 {
-    vcu_handle_can_tx_mailbox_callback(&vcu, can_h);
+    vcu_handle_can_tx_cplt(&vcu, can_h, 0);
 }
 
 void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef* can_h)
 {
-    vcu_handle_can_tx_mailbox_callback(&vcu, can_h);
+    vcu_handle_can_tx_cplt(&vcu, can_h, 1);
 }
 
 void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef* can_h)
 {
-    vcu_handle_can_tx_mailbox_callback(&vcu, can_h);
+    vcu_handle_can_tx_cplt(&vcu, can_h, 2);
 }
 
 void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef* can_h)
@@ -157,4 +157,14 @@ void HAL_CAN_ErrorCallback(CAN_HandleTypeDef* can_h)
     vcu_handle_can_err(&vcu, can_h);
 }
 
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef* uart_h)
+{
+    vcu_handle_uart_tx_cplt(&vcu, uart_h);
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef* uart_h)
+{
+    vcu_handle_uart_err(&vcu, uart_h);
+}
+
 /* USER CODE END 1 */
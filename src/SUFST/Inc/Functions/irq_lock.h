@@ -0,0 +1,25 @@
+/******************************************************************************
+ * @file    irq_lock.h
+ * @brief   Short interrupt-disabled critical sections with DWT measurement
+ * @details Replaces tx_interrupt_control() for critical sections which must
+ *          be kept short. The length of the longest interrupt-disabled window
+ *          is recorded with the DWT cycle counter, so regressions in ISR
+ *          latency show up in benchmark output.
+ *****************************************************************************/
+
+#ifndef IRQ_LOCK_H
+#define IRQ_LOCK_H
+
+#include <stdint.h>
+#include <tx_api.h>
+
+/*
+ * public functions
+ */
+void irq_lock_init(void);
+UINT irq_lock(void);
+void irq_unlock(UINT state);
+uint32_t irq_lock_max_cycles(void);
+void irq_lock_reset_max(void);
+
+#endif
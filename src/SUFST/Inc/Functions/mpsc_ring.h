@@ -0,0 +1,47 @@
+/******************************************************************************
+ * @file    mpsc_ring.h
+ * @brief   Lock-free multi-producer single-consumer ring of byte records
+ * @details Producers (threads or ISRs) claim space for a variable length
+ *          record with a single compare-and-swap, fill it in place and then
+ *          commit it. The single consumer reads committed records in order.
+ *          No kernel calls are made and interrupts are never disabled.
+ *****************************************************************************/
+
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// bytes used by the header in front of each record
+#define MPSC_RING_HEADER_SIZE sizeof(uint32_t)
+
+// largest record payload which can be stored
+#define MPSC_RING_MAX_RECORD_LEN 0xFFFF
+
+/**
+ * @brief   Ring context
+ *
+ * @details head and tail are free-running byte counters, the position in the
+ *          buffer is the counter masked by the buffer size
+ */
+typedef struct
+{
+    uint8_t* buf;               // storage, 4 byte aligned
+    uint32_t size;              // size of storage (power of two)
+    atomic_uint_least32_t head; // end of reserved space
+    atomic_uint_least32_t tail; // start of oldest unread record
+} mpsc_ring_t;
+
+/*
+ * public functions
+ */
+bool mpsc_ring_init(mpsc_ring_t* ring_ptr, void* mem_ptr, uint32_t size);
+void* mpsc_ring_reserve(mpsc_ring_t* ring_ptr, uint32_t len);
+void mpsc_ring_commit(mpsc_ring_t* ring_ptr, void* record_ptr);
+const void* mpsc_ring_peek(mpsc_ring_t* ring_ptr, uint32_t* len_ptr);
+void mpsc_ring_release(mpsc_ring_t* ring_ptr);
+uint32_t mpsc_ring_used(mpsc_ring_t* ring_ptr);
+
+#endif
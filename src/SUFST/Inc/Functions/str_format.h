@@ -0,0 +1,24 @@
+/******************************************************************************
+ * @file    str_format.h
+ * @brief   Reentrant printf style string formatting
+ * @details Unlike the C library, no global state or heap is used, so it is
+ *          safe to call from any thread or ISR without masking interrupts.
+ *
+ *          Supports the flags '-', '0', '+', ' ' and '#', width and precision
+ *          (including '*'), the length modifiers hh, h, l, ll, z, j and t and
+ *          the conversions d, i, u, o, x, X, c, s, p, f and %.
+ *****************************************************************************/
+
+#ifndef STR_FORMAT_H
+#define STR_FORMAT_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+uint32_t str_format(char* buf, uint32_t buf_len, const char* format, ...);
+uint32_t str_vformat(char* buf,
+                     uint32_t buf_len,
+                     const char* format,
+                     va_list args);
+
+#endif
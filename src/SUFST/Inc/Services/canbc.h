@@ -12,11 +12,32 @@
 #include <can_c.h>
 #include <can_s.h>
 #include <rtcan.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <tx_api.h>
 
 #include "config.h"
 #include "status.h"
+#include "xcp.h"
+
+// most frames which can be registered, including the VCU's own frames (at
+// most 32, there is one bit for each frame in the dirty flags)
+#define CANBC_MAX_MSGS 16
+
+/**
+ * @brief   Frames which can be broadcast
+ */
+typedef enum
+{
+    CANBC_MSG_STATE,
+    CANBC_MSG_SENSORS,
+    CANBC_MSG_TEMPS,
+    CANBC_MSG_ERRORS,
+    CANBC_MSG_PDM,
+    CANBC_NUM_MSGS
+} canbc_msg_idx_t;
 
 /**
  * @brief   Stores system states which will be broadcast to the CAN bus
@@ -24,7 +45,7 @@
  * @details This is a COPY of specific module states which are useful to
  *          monitor with the datalogger / telemetry systems. Modules are
  *          responsible for updating the broadcast states when their
- *          corresponding states change.
+ *          corresponding states change, using the canbc_set_*() functions.
  */
 typedef struct
 {
@@ -35,17 +56,94 @@ typedef struct
     struct can_s_vcu_pdm_t pdm;
 } canbc_states_t;
 
+/**
+ * @brief   Packs a broadcast frame
+ *
+ * @param[out]  dst_ptr     Frame data
+ * @param[in]   src_ptr     Source given when the frame was registered
+ * @param[in]   size        Frame length
+ *
+ * @return      Frame length, or negative on error (as the DBC pack functions)
+ */
+typedef int (*canbc_pack_func_t)(uint8_t* dst_ptr,
+                                 const void* src_ptr,
+                                 size_t size);
+
+/**
+ * @brief   Broadcast frame declared by a service
+ *
+ * @details Tracked frames are only packed again after their owner calls
+ *          canbc_mark_changed(), untracked frames are packed every time they
+ *          are due. Either way, the pack function runs in the CANBC thread so
+ *          must read the source consistently.
+ */
+typedef struct
+{
+    const char* owner;      // name of the service which registered the frame
+    uint32_t frame_id;      // CAN S frame ID
+    uint8_t length;         // frame length
+    bool extended;          // extended ID
+    canbc_pack_func_t pack; // packs the frame
+    const void* src_ptr;    // passed to pack
+    ULONG period_ticks;     // ticks between broadcasts (or checks)
+    ULONG phase_ticks;      // offset of broadcasts from the period grid
+    ULONG max_age_ticks;    // 0 if periodic, else on change
+    bool catch_up;          // send missed deadlines late, else skip
+    bool tracked;           // only packed after canbc_mark_changed()
+} canbc_frame_t;
+
+/**
+ * @brief   Broadcast statistics of a frame
+ */
+typedef struct
+{
+    uint32_t checks;   // times the frame was due since the last report
+    uint32_t sent;     // times the frame was sent since the last report
+    ULONG total_late;  // sum of lateness of each check since the last report
+    ULONG max_late;    // latest check after its deadline since start up
+    ULONG max_gap;     // longest time between sends since start up
+    uint32_t deferred; // times held back by mailbox pacing since start up
+    uint32_t dropped;  // times not sent at all since start up
+    uint32_t skipped;  // deadlines missed and skipped since start up
+} canbc_slot_stats_t;
+
+/**
+ * @brief   Entry in the broadcast schedule
+ */
+typedef struct
+{
+    canbc_frame_t frame;      // frame to broadcast
+    ULONG next_time;          // absolute deadline of the next broadcast
+    ULONG sent_time;          // time of the last broadcast
+    bool sent_once;           // sent since start up
+    uint8_t sent_data[8];     // data of the last broadcast
+    canbc_slot_stats_t stats; // broadcast statistics
+} canbc_slot_t;
+
 /**
  * @brief   CAN broadcasting service context
  */
 typedef struct
 {
-    TX_THREAD thread;                 // service thread
-    TX_MUTEX state_mutex;             // mutex for locking broadcast states
-    rtcan_handle_t* rtcan_h;          // RTCAN instance to broadcast on
-    canbc_states_t states;            // broadcasting states
-    uint16_t rolling_counter;         // counts number of broadcasts
-    const config_canbc_t* config_ptr; // configuration
+    TX_THREAD thread;                      // service thread
+    rtcan_handle_t* rtcan_h;               // RTCAN instance to broadcast on
+    CAN_HandleTypeDef* can_h;              // CAN peripheral, for pacing
+    xcp_context_t* xcp_ptr;                // XCP service (may be NULL)
+    canbc_states_t states;                 // broadcasting states
+    canbc_states_t snapshot;               // consistent copy of the states
+    atomic_uint_least32_t states_seq;      // odd while states are edited
+    atomic_uint_least32_t dirty;           // frames with changed sources
+    uint32_t repack;                       // frames to pack when next due
+    uint32_t state_msgs[CANBC_NUM_MSGS];   // schedule bit of each VCU frame
+    uint8_t packed[CANBC_MAX_MSGS][8];     // last packed data of each frame
+    uint16_t rolling_counter;              // counts number of broadcasts
+    canbc_slot_t schedule[CANBC_MAX_MSGS]; // broadcast schedule
+    uint32_t schedule_len;                 // entries in schedule
+    uint32_t bitrate;                      // from the CAN bit timing
+    uint32_t bus_load_bps;                 // worst case bits per second
+    uint32_t idle_load_bps;                // bits per second with no changes
+    ULONG report_time;                     // last statistics report
+    const config_canbc_t* config_ptr;      // configuration
 
 } canbc_context_t;
 
@@ -54,11 +152,52 @@ typedef struct
  */
 status_t canbc_init(canbc_context_t* canbc_h,
                     rtcan_handle_t* rtcan_h,
+                    CAN_HandleTypeDef* can_h,
+                    xcp_context_t* xcp_ptr,
                     TX_BYTE_POOL* stack_pool_ptr,
                     const config_canbc_t* config_ptr);
 
-canbc_states_t* canbc_lock_state(canbc_context_t* canbc_h, uint32_t timeout);
+status_t canbc_register(canbc_context_t* canbc_h,
+                        const canbc_frame_t* frame_ptr,
+                        uint32_t* handle_ptr);
+
+void canbc_mark_changed(canbc_context_t* canbc_h, uint32_t handle);
 
-void canbc_unlock_state(canbc_context_t* canbc_h);
+/*
+ * frames packed by their owner, registered with canbc_pack_raw() and the
+ * frame data as the source
+ */
+int canbc_pack_raw(uint8_t* dst_ptr, const void* src_ptr, size_t size);
+
+void canbc_set_raw(canbc_context_t* canbc_h,
+                   uint32_t handle,
+                   uint8_t* frame_ptr,
+                   const uint8_t* data,
+                   size_t size);
+
+void canbc_put_u16(uint8_t* buf, uint32_t value);
+
+uint32_t canbc_get_bus_load(const canbc_context_t* canbc_h);
+
+void canbc_get_tx_stats(const canbc_context_t* canbc_h,
+                        uint32_t* deferred_ptr,
+                        uint32_t* dropped_ptr);
+
+/*
+ * broadcast state setters, safe to call from any thread
+ */
+void canbc_set_apps(canbc_context_t* canbc_h, uint16_t value);
+void canbc_set_bps(canbc_context_t* canbc_h, uint16_t value);
+void canbc_set_sagl(canbc_context_t* canbc_h, int16_t value);
+void canbc_set_torque_request(canbc_context_t* canbc_h, uint16_t value);
+void canbc_set_max_temp(canbc_context_t* canbc_h, int8_t value);
+void canbc_set_ctrl_state(canbc_context_t* canbc_h, uint8_t value);
+void canbc_set_drs_active(canbc_context_t* canbc_h, uint8_t value);
+void canbc_set_r2d(canbc_context_t* canbc_h, uint8_t value);
+void canbc_set_ctrl_error(canbc_context_t* canbc_h, uint8_t value);
+void canbc_set_brakelight(canbc_context_t* canbc_h, uint8_t value);
+void canbc_set_inverter(canbc_context_t* canbc_h, uint8_t value);
+void canbc_set_pump(canbc_context_t* canbc_h, uint8_t value);
+void canbc_set_fan(canbc_context_t* canbc_h, uint8_t value);
 
 #endif
@@ -0,0 +1,119 @@
+/***************************************************************************
+ * @file    canstats.h
+ * @brief   CAN bus load and per identifier statistics
+ * @details Frames are counted from the CAN RX and TX complete interrupts.
+ *          Bus load is worked out over a sliding window using the bit timing
+ *          the CAN peripherals were configured with, then logged and
+ *          broadcast on CAN S at a low rate through the CANBC service.
+ ***************************************************************************/
+
+#ifndef CANSTATS_H
+#define CANSTATS_H
+
+#include <can.h>
+#include <rtcan.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <tx_api.h>
+
+#include "canbc.h"
+#include "config.h"
+#include "status.h"
+
+// identifiers tracked per bus, further identifiers are counted as 'other'
+#define CANSTATS_MAX_IDS 64
+
+// buckets in the sliding window
+#define CANSTATS_WINDOW_BUCKETS 10
+
+// set in canstats_id_t.id for extended identifiers
+#define CANSTATS_ID_EXTENDED 0x80000000
+
+// length of each load broadcast
+#define CANSTATS_BROADCAST_LENGTH 8
+
+/**
+ * @brief   Buses with statistics
+ */
+typedef enum
+{
+    CANSTATS_BUS_C,
+    CANSTATS_BUS_S,
+    CANSTATS_NUM_BUSES
+} canstats_bus_idx_t;
+
+/**
+ * @brief   Traffic of one identifier since the last report
+ */
+typedef struct
+{
+    uint32_t id;     // identifier, 0 if the entry is unused
+    uint32_t frames; // frames since the last report
+    uint32_t bits;   // bits since the last report
+} canstats_id_t;
+
+/**
+ * @brief   Traffic in one part of the sliding window
+ */
+typedef struct
+{
+    ULONG epoch;     // time / bucket length when the bucket was started
+    uint32_t frames; // frames in the bucket
+    uint32_t bits;   // bits in the bucket
+} canstats_bucket_t;
+
+/**
+ * @brief   Statistics of one bus
+ */
+typedef struct
+{
+    CAN_HandleTypeDef* can_h;                              // CAN peripheral
+    uint32_t bitrate;                                      // from bit timing
+    canstats_id_t ids[CANSTATS_MAX_IDS];                   // hash table
+    uint32_t other_frames;                                 // IDs not in table
+    uint32_t other_bits;                                   // IDs not in table
+    canstats_bucket_t window[CANSTATS_WINDOW_BUCKETS + 1]; // sliding window
+    uint32_t peak_load;                                    // in 0.1 %
+    uint8_t bc_data[CANSTATS_BROADCAST_LENGTH];            // latest broadcast
+    uint32_t bc_handle;                                    // CANBC handle
+} canstats_bus_t;
+
+/**
+ * @brief   CAN statistics service context
+ */
+typedef struct
+{
+    TX_THREAD thread;                         // service thread
+    canstats_bus_t buses[CANSTATS_NUM_BUSES]; // per bus statistics
+    canbc_context_t* canbc_ptr;               // for broadcasts (may be NULL)
+    const config_canstats_t* config_ptr;      // configuration
+} canstats_context_t;
+
+/*
+ * public functions
+ */
+status_t canstats_init(canstats_context_t* canstats_ptr,
+                       CAN_HandleTypeDef* can_c_h,
+                       CAN_HandleTypeDef* can_s_h,
+                       TX_BYTE_POOL* stack_pool_ptr,
+                       const config_canstats_t* config_ptr);
+
+status_t canstats_attach_canbc(canstats_context_t* canstats_ptr,
+                               canbc_context_t* canbc_ptr);
+
+void canstats_record_rx(canstats_context_t* canstats_ptr,
+                        CAN_HandleTypeDef* can_h,
+                        uint32_t rx_fifo);
+
+void canstats_record_tx(canstats_context_t* canstats_ptr,
+                        CAN_HandleTypeDef* can_h,
+                        uint32_t mailbox);
+
+uint32_t canstats_get_load(canstats_context_t* canstats_ptr,
+                           canstats_bus_idx_t bus,
+                           uint32_t* frames_per_sec_ptr);
+
+uint32_t canstats_frame_bits(uint32_t length, bool extended);
+uint32_t canstats_get_bitrate(const CAN_HandleTypeDef* can_h);
+
+#endif
@@ -0,0 +1,99 @@
+/***************************************************************************
+ * @file    capture.h
+ * @brief   Triggered burst capture of control signals
+ * @details The control loop samples a few signals into a RAM ring every
+ *          cycle. When a capture is triggered, by a command on CAN S or a
+ *          fault, the samples from before the trigger are kept and the
+ *          following samples are recorded. The capture is then sent on CAN S
+ *          at a capped frame rate, after which sampling starts again.
+ ***************************************************************************/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <rtcan.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <tx_api.h>
+
+#include "config.h"
+#include "status.h"
+
+// samples in the ring, must be a power of two
+#define CAPTURE_MAX_SAMPLES 1024
+
+// command queue size (1 message pointer each)
+#define CAPTURE_RX_QUEUE_SIZE 2
+
+/**
+ * @brief   What triggered a capture
+ */
+typedef enum
+{
+    CAPTURE_TRIGGER_NONE,
+    CAPTURE_TRIGGER_COMMAND,
+    CAPTURE_TRIGGER_FAULT
+} capture_trigger_t;
+
+/**
+ * @brief   Capture state
+ */
+typedef enum
+{
+    CAPTURE_STATE_IDLE,      // sampling into the ring, waiting for a trigger
+    CAPTURE_STATE_RECORDING, // sampling after a trigger
+    CAPTURE_STATE_DRAINING   // sending the capture, not sampling
+} capture_state_t;
+
+/**
+ * @brief   One sample of the captured signals
+ */
+typedef struct
+{
+    uint16_t apps;           // APPS reading
+    uint16_t bps;            // BPS reading
+    uint16_t torque_request; // torque request
+    int16_t motor_speed;     // motor speed (rpm)
+} capture_sample_t;
+
+/**
+ * @brief   Capture service context
+ */
+typedef struct
+{
+    TX_THREAD thread;                           // service thread
+    TX_QUEUE rx_queue;                          // command frames
+    ULONG rx_queue_mem[CAPTURE_RX_QUEUE_SIZE];  // command queue storage
+    rtcan_handle_t* rtcan_s_ptr;                // RTCAN instance for CAN S
+    capture_sample_t ring[CAPTURE_MAX_SAMPLES]; // samples
+    uint32_t head;                              // samples taken
+    uint32_t filled;                            // samples since idle
+    uint32_t remaining;                         // samples left to record
+    uint32_t trigger_pos;                       // first sample after trigger
+    uint32_t pre_samples;                       // samples kept before trigger
+    ULONG trigger_time;                         // time of trigger
+    ULONG end_time;                             // time of last sample
+    atomic_uint_least32_t state;                // capture_state_t
+    atomic_uint_least32_t trigger;              // pending capture_trigger_t
+    capture_trigger_t source;                   // trigger of this capture
+    uint8_t count;                              // captures taken
+    uint32_t drain_pos;                         // next frame to send
+    uint32_t credit;                            // frames * ticks per sec
+    ULONG credit_time;                          // last credit update
+    const config_capture_t* config_ptr;         // configuration
+} capture_context_t;
+
+/*
+ * public functions
+ */
+status_t capture_init(capture_context_t* capture_ptr,
+                      rtcan_handle_t* rtcan_s_ptr,
+                      TX_BYTE_POOL* stack_pool_ptr,
+                      const config_capture_t* config_ptr);
+
+void capture_sample(capture_context_t* capture_ptr,
+                    const capture_sample_t* sample_ptr);
+
+void capture_trigger(capture_context_t* capture_ptr, capture_trigger_t source);
+
+#endif
@@ -15,6 +15,7 @@
 #include "apps.h"
 #include "bps.h"
 #include "canbc.h"
+#include "capture.h"
 #include "config.h"
 #include "dash.h"
 #include "log.h"
@@ -22,6 +23,7 @@
 #include "remote_ctrl.h"
 #include "status.h"
 #include "tick.h"
+#include "xcp.h"
 #include "torque_map.h"
 
 /*
@@ -33,6 +35,7 @@
 #define CTRL_ERROR_PRECHARGE_TIMEOUT  0x04 // precharge timed out
 #define CTRL_ERROR_TRC_RUN_FAULT      0x08 // TRC faulted at runtime
 #define CTRL_ERROR_INVERTER_RUN_FAULT 0x10 // inverter faulted at runtime
+#define CTRL_ERROR_TEMPS_STALE        0x20 // PM100 temps stale (not latched)
 
 /**
  * @brief   Control state
@@ -62,17 +65,18 @@ typedef enum
  */
 typedef struct
 {
-    ctrl_state_t state;          // state machine state
-    TX_THREAD thread;            // service thread
-    uint16_t apps_reading;       // APPS reading (% * 10)
-    uint16_t bps_reading;        // BPS reading (% * 10)
-    int16_t sagl_reading;        // steering angle reading (deg * 10)
-    int16_t motor_speed_reading; // motor speed reading (rpm)
-    uint16_t torque_request;     // last torque request
+    ctrl_state_t state;           // state machine state
+    TX_THREAD thread;             // service thread
+    uint16_t apps_reading;        // APPS reading (% * 10)
+    uint16_t bps_reading;         // BPS reading (% * 10)
+    int16_t sagl_reading;         // steering angle reading (deg * 10)
+    int16_t motor_speed_reading;  // motor speed reading (rpm)
+    uint16_t torque_request;      // last torque request
     uint8_t shdn_reading;
-    int16_t motor_temp;
-    int16_t inv_temp;
-    int8_t max_temp;
+    int16_t motor_temp;           // last fresh motor temperature
+    int16_t inv_temp;             // last fresh inverter temperature
+    pm100_snapshot_t pm100_state; // PM100 states read this cycle
+    int8_t max_temp;              // from the last fresh temperatures
 
     bool inverter_pwr;
     bool pump_pwr;
@@ -82,10 +86,12 @@ typedef struct
     uint32_t precharge_start; // precharge start time in ticks
     uint32_t motor_torque_zero_start;
     uint32_t apps_bps_start;
-    dash_context_t* dash_ptr;   // dash service
-    pm100_context_t* pm100_ptr; // PM100 service
-    canbc_context_t* canbc_ptr; // CANBC service
-    tick_context_t* tick_ptr;   // tick thread (reads certain sensors)
+    dash_context_t* dash_ptr;       // dash service
+    pm100_context_t* pm100_ptr;     // PM100 service
+    canbc_context_t* canbc_ptr;     // CANBC service
+    capture_context_t* capture_ptr; // burst capture service
+    xcp_context_t* xcp_ptr;         // XCP service (may be NULL)
+    tick_context_t* tick_ptr;       // tick thread (reads certain sensors)
     remote_ctrl_context_t*
         remote_ctrl_ptr;     // tick thread (reads certain sensors)
     torque_map_t torque_map; // torque map (APPS -> torque request)
@@ -106,6 +112,8 @@ status_t ctrl_init(ctrl_context_t* ctrl_ptr,
                    tick_context_t* tick_ptr,
                    remote_ctrl_context_t* remote_ctrl_ptr,
                    canbc_context_t* canbc_ptr,
+                   capture_context_t* capture_ptr,
+                   xcp_context_t* xcp_ptr,
                    TX_BYTE_POOL* stack_pool_ptr,
                    const config_ctrl_t* config_ptr,
                    const config_rtds_t* rtds_config_ptr,
@@ -9,10 +9,17 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <rtcan.h>
 #include <tx_api.h>
+#include <usart.h>
 
+#include "canbc.h"
 #include "config.h"
+#include "mpsc_ring.h"
 #include "status.h"
 
 // error codes
@@ -27,15 +34,121 @@
 // the max length for a single line of log message transmission
 #define LOG_MSG_MAX_TRANSMITION_LEN 128
 
+// size of each of the two DMA transmit buffers
+#define LOG_TX_BUFFER_SIZE 512
+
+// the max number of arguments to a binary log message
+#define LOG_MSG_MAX_ARGS 8
+
+// number of log messages and ctrl state changes kept over a reset
+#define LOG_CRASH_MSGS   32
+#define LOG_CRASH_STATES 16
+
+// reasons recorded in the crash log
+#define LOG_CRASH_REASON_NONE          0x00 // reset without a known fault
+#define LOG_CRASH_REASON_ERROR_HANDLER 0x01 // Error_Handler() was called
+#define LOG_CRASH_REASON_HARD_FAULT    0x02 // hard fault
+
+// size of the buffer of bytes waiting to be streamed on CAN S (power of 2)
+#define LOG_CAN_BUFFER_SIZE 512
+
+// log bytes carried by each CAN stream frame (after the sequence number)
+#define LOG_CAN_FRAME_PAYLOAD 7
+
+// statistics frames broadcast on CAN S (8 bytes each)
+#define LOG_STATS_FRAMES 3
+
+// how often the log thread wakes to summarise rate limited messages and
+// update the statistics broadcasts when there are no messages
+#define LOG_HOUSEKEEPING_TICKS (TX_TIMER_TICKS_PER_SECOND / 2)
+
 typedef struct
 {
     config_log_level_t level;
     ULONG timestamp;
+#ifdef LOG_BINARY_MODE
+    uint32_t fmt_id;                  // address of format in .log_fmt
+    uint32_t argc;                    // number of arguments
+    uint32_t args[LOG_MSG_MAX_ARGS];  // raw argument words
+#else
     char msg[LOG_MSG_MAX_LEN + 1];
+#endif
 } log_msg_t;
 
-// number of log messages that can be queued
-#define LOG_MSG_QUEUE_SIZE 128 * sizeof(log_msg_t)
+/**
+ * @brief ctrl state change kept in the crash log
+ */
+typedef struct
+{
+    ULONG timestamp;
+    uint32_t state; // ctrl_state_t
+} log_crash_state_t;
+
+/**
+ * @brief log records kept in RAM which is not cleared on reset
+ *
+ * @details each slot has a sequence number (index + 1) which is zeroed while
+ *          the slot is written, so partly written slots are not replayed
+ */
+typedef struct
+{
+    uint32_t magic;                             // marks valid contents
+    uint32_t reason;                            // LOG_CRASH_REASON_x
+    atomic_uint_least32_t msg_count;            // messages ever written
+    atomic_uint_least32_t state_count;          // states ever written
+    uint32_t msg_seq[LOG_CRASH_MSGS];           // sequence number of slots
+    log_msg_t msgs[LOG_CRASH_MSGS];             // last messages
+    uint32_t state_seq[LOG_CRASH_STATES];       // sequence number of slots
+    log_crash_state_t states[LOG_CRASH_STATES]; // last ctrl state changes
+} log_crash_ring_t;
+
+/**
+ * @brief state of a rate limited log message call site
+ *
+ * @details one of these is declared statically by each LOG_*_LIMITED call
+ */
+typedef struct log_rate_limit_s
+{
+    const char* fmt;                   // format string of the message
+    config_log_level_t level;          // level of the message
+    ULONG period_ticks;                // length of the rate limit window
+    ULONG window_start;                // time the last message was logged
+    ULONG last_repeat;                 // time of the last suppressed repeat
+    uint32_t repeats;                  // repeats suppressed in this window
+    bool active;                       // window is open
+    bool registered;                   // in the list flushed by the thread
+    struct log_rate_limit_s* next_ptr; // next registered call site
+} log_rate_limit_t;
+
+/**
+ * @brief messages in a UART transfer, used to measure latency
+ */
+typedef struct
+{
+    uint32_t count;         // messages in the transfer
+    uint64_t timestamp_sum; // sum of message timestamps
+    ULONG oldest;           // earliest message timestamp
+    ULONG newest;           // latest message timestamp
+} log_batch_t;
+
+/**
+ * @brief health of the logging pipeline
+ *
+ * @details latency is from the log call to the end of the UART transfer
+ *          carrying the message, in ticks
+ */
+typedef struct
+{
+    atomic_uint_least32_t dropped; // lost because the pool was full
+    uint32_t uart_dropped;         // lost to UART errors
+    uint32_t sent;                 // sent over the UART
+    uint32_t can_dropped;          // not streamed because CAN S was behind
+    uint32_t can_frames;           // stream frames sent on CAN S
+    uint32_t pool_peak;            // most bytes of the pool ever in use
+    uint32_t latency_min;          // lowest latency
+    uint32_t latency_max;          // highest latency
+    uint64_t latency_total;        // sum of latencies, for the average
+} log_stats_t;
 
 /**
  * @brief logging service context
@@ -44,23 +157,237 @@ typedef struct
 {
     TX_THREAD thread;
     TX_MUTEX uart_mutex;
-    TX_QUEUE msg_queue;
-    ULONG msg_queue_mem[LOG_MSG_QUEUE_SIZE];
+    mpsc_ring_t msg_ring;                      // queued messages
+    log_crash_ring_t* crash_ptr;               // messages kept over reset
+    log_stats_t stats;                         // pipeline health
+    log_batch_t batch_fill;                    // messages in buffer filling
+    log_batch_t batch_sent;                    // messages in UART transfer
+    ULONG tx_done_time;                        // end of last UART transfer
+    rtcan_handle_t* rtcan_s_ptr;               // for the stream
+    canbc_context_t* canbc_ptr;                // for statistics
+    uint32_t stats_handles[LOG_STATS_FRAMES];  // CANBC handle of each frame
+    uint8_t stats_data[LOG_STATS_FRAMES][8];   // latest statistics frames
+    ULONG stats_time;                          // last statistics update
+    uint8_t can_buf[LOG_CAN_BUFFER_SIZE];      // bytes waiting for CAN S
+    uint32_t can_head;                         // end of bytes in can_buf
+    uint32_t can_tail;                         // start of bytes in can_buf
+    uint32_t can_credit;                       // bytes * ticks per second
+    ULONG can_credit_time;                     // last update of can_credit
+    uint8_t can_seq;                           // number of next stream frame
+    TX_SEMAPHORE msg_sem;                      // wakes waiting log thread
+    atomic_bool thread_waiting;                // log thread is waiting
+    TX_SEMAPHORE tx_done_sem;                  // UART DMA transfer done
+    uint8_t tx_buffers[2][LOG_TX_BUFFER_SIZE]; // filled while other is sent
+    uint32_t tx_buffer_idx;                    // buffer being filled
     const config_log_t* config_ptr;
-    uint16_t error;
+    atomic_uint_least16_t error;
 } log_context_t;
 
 status_t log_init(log_context_t* log_ptr,
                   TX_BYTE_POOL* stack_pool_ptr,
                   const config_log_t* config_ptr);
 
+void log_crash_record_state(uint32_t state);
+
+void log_crash_mark(uint32_t reason);
+
+status_t log_attach_can(log_context_t* log_ptr,
+                        rtcan_handle_t* rtcan_s_ptr,
+                        canbc_context_t* canbc_ptr);
+
+uint32_t log_get_latency_avg(const log_stats_t* stats_ptr);
+
+void log_get_pool_usage(log_context_t* log_ptr,
+                        uint32_t* used_ptr,
+                        uint32_t* peak_ptr);
+
+void log_handle_uart_tx_cplt(log_context_t* log_ptr, UART_HandleTypeDef* huart);
+
+void log_handle_uart_err(log_context_t* log_ptr, UART_HandleTypeDef* huart);
+
+#ifdef LOG_BINARY_MODE
+
+status_t log_write_binary(const config_log_level_t level,
+                          uint32_t fmt_id,
+                          uint32_t argc,
+                          const uint32_t* args);
+
+/*
+ * Binary log messages
+ *
+ * The format string of each call site is placed in the .log_fmt section,
+ * which is kept in the ELF but never loaded onto the VCU. The address of the
+ * string is used as the format ID, and the arguments are sent as raw 32-bit
+ * words, so no formatting is done on the VCU. scripts/log_decode.py rebuilds
+ * the text on the host using the format strings from the ELF.
+ *
+ * Arguments must be integers or pointers to constant strings in flash.
+ * Floating point arguments are not supported.
+ */
+#define LOG_FMT_SECTION __attribute__((section(".log_fmt"), used))
+
+#define LOG_ARG(x) ((uint32_t) (uintptr_t) (x))
+
+#define LOG_NARGS(...)                                                         \
+    LOG_NARGS_(_, ##__VA_ARGS__, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_, _1, _2, _3, _4, _5, _6, _7, _8, _9, N, ...) N
+
+#define LOG_CAT(a, b)  LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+
+#define LOG_BIN(level, fmt, argc, ...)                                         \
+    do                                                                         \
+    {                                                                          \
+        static const char log_fmt[] LOG_FMT_SECTION = fmt;                     \
+        const uint32_t log_args[] = {__VA_ARGS__};                             \
+        log_write_binary(level, LOG_ARG(log_fmt), argc, log_args);             \
+    } while (0)
+
+#define LOG_BIN_1(level, fmt)                                                  \
+    do                                                                         \
+    {                                                                          \
+        static const char log_fmt[] LOG_FMT_SECTION = fmt;                     \
+        log_write_binary(level, LOG_ARG(log_fmt), 0, NULL);                    \
+    } while (0)
+
+#define LOG_BIN_2(level, fmt, a) LOG_BIN(level, fmt, 1, LOG_ARG(a))
+#define LOG_BIN_3(level, fmt, a, b)                                            \
+    LOG_BIN(level, fmt, 2, LOG_ARG(a), LOG_ARG(b))
+#define LOG_BIN_4(level, fmt, a, b, c)                                         \
+    LOG_BIN(level, fmt, 3, LOG_ARG(a), LOG_ARG(b), LOG_ARG(c))
+#define LOG_BIN_5(level, fmt, a, b, c, d)                                      \
+    LOG_BIN(level, fmt, 4, LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d))
+#define LOG_BIN_6(level, fmt, a, b, c, d, e)                                   \
+    LOG_BIN(level,                                                             \
+            fmt,                                                               \
+            5,                                                                 \
+            LOG_ARG(a),                                                        \
+            LOG_ARG(b),                                                        \
+            LOG_ARG(c),                                                        \
+            LOG_ARG(d),                                                        \
+            LOG_ARG(e))
+#define LOG_BIN_7(level, fmt, a, b, c, d, e, f)                                \
+    LOG_BIN(level,                                                             \
+            fmt,                                                               \
+            6,                                                                 \
+            LOG_ARG(a),                                                        \
+            LOG_ARG(b),                                                        \
+            LOG_ARG(c),                                                        \
+            LOG_ARG(d),                                                        \
+            LOG_ARG(e),                                                        \
+            LOG_ARG(f))
+#define LOG_BIN_8(level, fmt, a, b, c, d, e, f, g)                             \
+    LOG_BIN(level,                                                             \
+            fmt,                                                               \
+            7,                                                                 \
+            LOG_ARG(a),                                                        \
+            LOG_ARG(b),                                                        \
+            LOG_ARG(c),                                                        \
+            LOG_ARG(d),                                                        \
+            LOG_ARG(e),                                                        \
+            LOG_ARG(f),                                                        \
+            LOG_ARG(g))
+#define LOG_BIN_9(level, fmt, a, b, c, d, e, f, g, h)                          \
+    LOG_BIN(level,                                                             \
+            fmt,                                                               \
+            8,                                                                 \
+            LOG_ARG(a),                                                        \
+            LOG_ARG(b),                                                        \
+            LOG_ARG(c),                                                        \
+            LOG_ARG(d),                                                        \
+            LOG_ARG(e),                                                        \
+            LOG_ARG(f),                                                        \
+            LOG_ARG(g),                                                        \
+            LOG_ARG(h))
+
+#define LOG_EMIT(level, ...)                                                   \
+    LOG_CAT(LOG_BIN_, LOG_NARGS(__VA_ARGS__))(level, __VA_ARGS__)
+
+#else
+
 status_t log_printf(const config_log_level_t level, const char* format, ...);
 
+#define LOG_EMIT(level, ...) log_printf(level, ##__VA_ARGS__)
+
+#endif
+
+/*
+ * Compile-time filtering
+ *
+ * A source file may define LOG_MODULE_MIN_LEVEL (before any includes) to one
+ * of the per-module levels in config.h. Messages below it, or below
+ * LOG_MIN_LEVEL, are removed by the compiler along with their arguments.
+ * Every call site leaves one byte in the .log_sites section holding its level
+ * and whether it was compiled in, so removed messages can still be counted.
+ */
+#ifndef LOG_MODULE_MIN_LEVEL
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL
+#endif
+
+#define LOG_ENABLED(level)                                                     \
+    ((level) >= LOG_MIN_LEVEL && (level) >= LOG_MODULE_MIN_LEVEL)
+
+#define LOG_SITES_SECTION __attribute__((section(".log_sites"), used))
+
+#define LOG_SITE_COMPILED 0x80 // set in .log_sites if the site was compiled in
+
+#define LOG_SITE(level, ...)                                                   \
+    do                                                                         \
+    {                                                                          \
+        static const uint8_t log_site LOG_SITES_SECTION                        \
+            = (level) | (LOG_ENABLED(level) ? LOG_SITE_COMPILED : 0);          \
+                                                                               \
+        if (LOG_ENABLED(level))                                                \
+        {                                                                      \
+            LOG_EMIT(level, __VA_ARGS__);                                      \
+        }                                                                      \
+    } while (0)
+
+uint32_t log_get_stripped_count(config_log_level_t level);
+
+bool log_rate_limit(log_rate_limit_t* limit_ptr, ULONG period_ticks);
+
+/*
+ * Rate limited messages
+ *
+ * The first message from a call site is logged as normal, then repeats from
+ * the same call site within period_ms are counted instead of logged. When
+ * the window ends the repeats are logged as a single "xN in T ms" message.
+ */
+#define LOG_FIRST(...)         LOG_FIRST_(__VA_ARGS__, ~)
+#define LOG_FIRST_(first, ...) first
+
+#define LOG_RATE_LIMITED(log_level, period_ms, ...)                            \
+    do                                                                         \
+    {                                                                          \
+        static log_rate_limit_t log_limit                                      \
+            = {.fmt = LOG_FIRST(__VA_ARGS__), .level = (log_level)};           \
+                                                                               \
+        if (LOG_ENABLED(log_level)                                             \
+            && log_rate_limit(&log_limit,                                      \
+                              ((period_ms) * TX_TIMER_TICKS_PER_SECOND)        \
+                                  / 1000))                                     \
+        {                                                                      \
+            LOG_SITE(log_level, __VA_ARGS__);                                  \
+        }                                                                      \
+    } while (0)
+
 // Convenience macros
-#define LOG_DEBUG(...) log_printf(LOG_LEVEL_DEBUG, ##__VA_ARGS__)
-#define LOG_INFO(...)  log_printf(LOG_LEVEL_INFO, ##__VA_ARGS__)
-#define LOG_WARN(...)  log_printf(LOG_LEVEL_WARN, ##__VA_ARGS__)
-#define LOG_ERROR(...) log_printf(LOG_LEVEL_ERROR, ##__VA_ARGS__)
-#define LOG_FATAL(...) log_printf(LOG_LEVEL_FATAL, ##__VA_ARGS__)
+#define LOG_DEBUG(...) LOG_SITE(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_SITE(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_SITE(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_SITE(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_FATAL(...) LOG_SITE(LOG_LEVEL_FATAL, __VA_ARGS__)
+
+#define LOG_DEBUG_LIMITED(period_ms, ...)                                      \
+    LOG_RATE_LIMITED(LOG_LEVEL_DEBUG, period_ms, __VA_ARGS__)
+#define LOG_INFO_LIMITED(period_ms, ...)                                       \
+    LOG_RATE_LIMITED(LOG_LEVEL_INFO, period_ms, __VA_ARGS__)
+#define LOG_WARN_LIMITED(period_ms, ...)                                       \
+    LOG_RATE_LIMITED(LOG_LEVEL_WARN, period_ms, __VA_ARGS__)
+#define LOG_ERROR_LIMITED(period_ms, ...)                                      \
+    LOG_RATE_LIMITED(LOG_LEVEL_ERROR, period_ms, __VA_ARGS__)
+#define LOG_FATAL_LIMITED(period_ms, ...)                                      \
+    LOG_RATE_LIMITED(LOG_LEVEL_FATAL, period_ms, __VA_ARGS__)
 
 #endif
@@ -14,6 +14,8 @@
 
 #include <can_c.h>
 #include <rtcan.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <tx_api.h>
 
@@ -30,26 +32,60 @@
 #define PM100_ERROR_POST_FAULT        0x04 // power-on self-test fault
 #define PM100_ERROR_RUN_FAULT         0x08 // runtime fault
 
-#define PM100_RX_QUEUE_SIZE           10 // 10 items
+#define PM100_RX_QUEUE_SIZE           32 // 32 items
+
+// broadcast frames are looked up by offset from the first broadcast ID
+#define PM100_BROADCAST_BASE_ID       0x0A0
+#define PM100_BROADCAST_ID_SPAN       16
+
+// torque bytes of the command message (little endian)
+#define PM100_TORQUE_BYTE_LO          0
+#define PM100_TORQUE_BYTE_HI          1
 
 /**
- * @brief   PM100 context
+ * @brief   Decoded PM100 broadcast states
+ *
+ * @details Per-frame arrays and bits are indexed by the offset of the frame ID
+ *          from PM100_BROADCAST_BASE_ID
  */
 typedef struct
 {
-    TX_THREAD thread;
-    rtcan_handle_t* rtcan_c_ptr;
-    rtcan_handle_t* rtcan_s_ptr;
-    TX_QUEUE can_rx_queue;
-    ULONG can_rx_queue_mem[PM100_RX_QUEUE_SIZE];
-    TX_MUTEX state_mutex;
-    bool broadcasts_valid;
+    bool broadcasts_valid;                  // broadcasts received in timeout
+    ULONG time;                             // when the snapshot was taken
+    ULONG rx_time[PM100_BROADCAST_ID_SPAN]; // when each frame was decoded
+    uint32_t received;                      // frames decoded at least once
+    uint32_t stale;                         // frames older than their max age
     struct can_c_pm100_internal_states_t states;
     struct can_c_pm100_fault_codes_t faults;
     struct can_c_pm100_temperature_set_1_t temp1;
     struct can_c_pm100_temperature_set_2_t temp2;
     struct can_c_pm100_temperature_set_3_t temp3;
     struct can_c_pm100_motor_position_info_t info;
+    struct can_c_pm100_current_info_t current;
+    struct can_c_pm100_voltage_info_t voltage;
+    struct can_c_pm100_flux_info_t flux;
+    struct can_c_pm100_torque_and_timer_info_t torque;
+    struct can_c_pm100_modulation_index_and_flux_weakening_output_info_t
+        modulation;
+} pm100_snapshot_t;
+
+/**
+ * @brief   PM100 context
+ */
+typedef struct
+{
+    TX_THREAD thread;
+    rtcan_handle_t* rtcan_c_ptr;
+    rtcan_handle_t* rtcan_s_ptr;
+    TX_QUEUE can_rx_queue;
+    ULONG can_rx_queue_mem[PM100_RX_QUEUE_SIZE];
+    pm100_snapshot_t shared;                           // latest states
+    atomic_uint_least32_t shared_seq;                  // odd while written
+    uint8_t broadcast_lut[PM100_BROADCAST_ID_SPAN];    // table idx + 1
+    uint8_t decimation_count[PM100_BROADCAST_ID_SPAN]; // frames skipped
+    uint8_t decimation[PM100_BROADCAST_ID_SPAN];       // decode every nth
+    uint32_t max_age_ticks[PM100_BROADCAST_ID_SPAN];   // 0 for never stale
+    rtcan_msg_t torque_msg;                            // pre-packed command
     uint16_t error;
     const config_pm100_t* config_ptr;
 } pm100_context_t;
@@ -64,11 +100,38 @@ status_t pm100_init(pm100_context_t* pm100_ptr,
                     const config_pm100_t* config_ptr);
 status_t pm100_lvs_on(pm100_context_t* pm100_ptr);
 status_t pm100_lvs_off(pm100_context_t* pm100_ptr);
-bool pm100_is_precharged(pm100_context_t* pm100_ptr);
-int16_t pm100_motor_temp(pm100_context_t* pm100_ptr);
-int16_t pm100_max_inverter_temp(pm100_context_t* pm100_ptr);
-int16_t pm100_motor_speed(pm100_context_t* pm100_ptr);
+void pm100_snapshot(pm100_context_t* pm100_ptr, pm100_snapshot_t* snapshot_ptr);
+bool pm100_is_fresh(const pm100_snapshot_t* snapshot_ptr, uint32_t frame_id);
+bool pm100_is_precharged(const pm100_snapshot_t* snapshot_ptr);
+bool pm100_motor_temp(const pm100_snapshot_t* snapshot_ptr, int16_t* temp_ptr);
+bool pm100_max_inverter_temp(const pm100_snapshot_t* snapshot_ptr,
+                             int16_t* temp_ptr);
+bool pm100_motor_speed(const pm100_snapshot_t* snapshot_ptr,
+                       int16_t* speed_ptr);
+bool pm100_dc_bus_voltage(const pm100_snapshot_t* snapshot_ptr,
+                          int16_t* voltage_ptr);
+bool pm100_dc_bus_current(const pm100_snapshot_t* snapshot_ptr,
+                          int16_t* current_ptr);
 status_t pm100_disable(pm100_context_t* pm100_ptr);
-status_t pm100_request_torque(pm100_context_t* pm100_ptr, uint16_t torque);
+status_t pm100_request_torque(pm100_context_t* pm100_ptr,
+                              const pm100_snapshot_t* snapshot_ptr,
+                              uint16_t torque);
+void pm100_pack_torque_command(uint16_t torque, rtcan_msg_t* msg_ptr);
+
+/**
+ * @brief       Writes a torque into a command message built by
+ *              pm100_pack_torque_command()
+ *
+ * @details     Only the torque changes between torque requests, so the rest
+ *              of the message is packed once at start up
+ *
+ * @param[in]   msg_ptr     Command message
+ * @param[in]   torque      Desired torque
+ */
+static inline void pm100_patch_torque(rtcan_msg_t* msg_ptr, uint16_t torque)
+{
+    msg_ptr->data[PM100_TORQUE_BYTE_LO] = (uint8_t) (torque & 0xFF);
+    msg_ptr->data[PM100_TORQUE_BYTE_HI] = (uint8_t) (torque >> 8);
+}
 
 #endif
@@ -0,0 +1,111 @@
+/***************************************************************************
+ * @file    xcp.h
+ * @brief   XCP on CAN measurement server
+ * @details Implements the measurement part of an XCP 1.1 slave on CAN S, so
+ *          internal variables can be read by address from a calibration tool
+ *          (or scripts/xcp_a2l.py) without reflashing. Memory can be read
+ *          with SHORT_UPLOAD / UPLOAD, and dynamic DAQ lists sample it at the
+ *          event channels below. Calibration, paging, programming and STIM
+ *          are not supported, and only RAM and flash can be read.
+ ***************************************************************************/
+
+#ifndef XCP_H
+#define XCP_H
+
+#include <rtcan.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <tx_api.h>
+
+#include "config.h"
+#include "status.h"
+
+// dynamic DAQ memory, shared by all DAQ lists
+#define XCP_MAX_DAQ         8
+#define XCP_MAX_ODT         32
+#define XCP_MAX_ODT_ENTRIES 128
+
+// command queue size (1 message pointer each)
+#define XCP_RX_QUEUE_SIZE 2
+
+/**
+ * @brief   Event channels which DAQ lists can be sampled at
+ */
+typedef enum
+{
+    XCP_EVENT_CTRL,  // every control loop cycle
+    XCP_EVENT_CANBC, // every CAN broadcast pass
+    XCP_NUM_EVENTS
+} xcp_event_t;
+
+/**
+ * @brief   Element of an ODT, a block of memory to sample
+ */
+typedef struct
+{
+    uint32_t address; // start address
+    uint8_t size;     // bytes
+} xcp_odt_entry_t;
+
+/**
+ * @brief   Object descriptor table, sent as one DTO frame
+ */
+typedef struct
+{
+    uint16_t first_entry; // index of first entry in the entry pool
+    uint8_t entries;      // number of entries
+} xcp_odt_t;
+
+/**
+ * @brief   DAQ list
+ */
+typedef struct
+{
+    uint16_t first_odt; // absolute ODT number of the first ODT
+    uint8_t odts;       // number of ODTs
+    uint16_t event;     // event channel
+    uint8_t prescaler;  // sample every nth event
+    uint8_t counter;    // events since the last sample
+    bool selected;      // selected for START_STOP_SYNCH
+} xcp_daq_t;
+
+/**
+ * @brief   XCP service context
+ */
+typedef struct
+{
+    TX_THREAD thread;                             // service thread
+    TX_QUEUE rx_queue;                            // command frames
+    ULONG rx_queue_mem[XCP_RX_QUEUE_SIZE];        // command queue storage
+    TX_MUTEX daq_mutex;                           // DAQ config vs sampling
+    rtcan_handle_t* rtcan_s_ptr;                  // RTCAN instance for CAN S
+    bool connected;                               // master connected
+    uint32_t mta;                                 // memory transfer address
+    xcp_daq_t daq[XCP_MAX_DAQ];                   // DAQ lists
+    xcp_odt_t odt[XCP_MAX_ODT];                   // ODT pool
+    xcp_odt_entry_t entries[XCP_MAX_ODT_ENTRIES]; // ODT entry pool
+    uint16_t daq_count;                           // DAQ lists allocated
+    uint16_t odt_count;                           // ODTs allocated
+    uint16_t entry_count;                         // ODT entries allocated
+    uint8_t alloc_state;                          // dynamic allocation step
+    uint16_t daq_ptr_list;                        // DAQ pointer, list
+    uint8_t daq_ptr_odt;                          // DAQ pointer, ODT
+    uint8_t daq_ptr_entry;                        // DAQ pointer, entry
+    atomic_uint_least32_t running;                // DAQ lists running
+    uint32_t overloads;                           // DTOs RTCAN refused
+    uint32_t missed_events;                       // events during DAQ config
+    const config_xcp_t* config_ptr;               // configuration
+} xcp_context_t;
+
+/*
+ * public functions
+ */
+status_t xcp_init(xcp_context_t* xcp_ptr,
+                  rtcan_handle_t* rtcan_s_ptr,
+                  TX_BYTE_POOL* stack_pool_ptr,
+                  const config_xcp_t* config_ptr);
+
+void xcp_event(xcp_context_t* xcp_ptr, xcp_event_t event);
+
+#endif
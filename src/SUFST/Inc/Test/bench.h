@@ -0,0 +1,59 @@
+/***************************************************************************
+ * @file   bench.h
+ * @brief  On-target benchmarks using the DWT cycle counter
+ * @note   Enabled from the testbenches section of config.c, results are
+ *         reported through the logging service
+ ***************************************************************************/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stm32f7xx.h>
+
+/**
+ * @brief   Cycle count statistics
+ */
+typedef struct
+{
+    uint32_t min;   // fewest cycles
+    uint32_t max;   // most cycles
+    uint32_t total; // sum of cycles
+    uint32_t count; // number of samples
+} bench_stats_t;
+
+/**
+ * @brief   Reads the DWT cycle counter
+ */
+static inline uint32_t bench_cycles(void)
+{
+    return DWT->CYCCNT;
+}
+
+/***************************************************************************
+ * helpers
+ ***************************************************************************/
+
+void bench_stats_reset(bench_stats_t* stats_ptr);
+void bench_stats_add(bench_stats_t* stats_ptr, uint32_t cycles);
+uint32_t bench_stats_avg(const bench_stats_t* stats_ptr);
+
+/***************************************************************************
+ * log enqueue benchmark
+ ***************************************************************************/
+
+void bench_log_enqueue(void);
+
+/***************************************************************************
+ * log format benchmark
+ ***************************************************************************/
+
+void bench_log_format(void);
+
+/***************************************************************************
+ * PM100 torque command benchmark
+ ***************************************************************************/
+
+void bench_pm100_torque(void);
+
+#endif
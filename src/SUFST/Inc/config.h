@@ -27,6 +27,37 @@
 // Doesn't matter if VCU_SIMULATION_MODE is not defined
 // #define VCU_SIMULATION_ON_POWER
 
+// Should be defined if log messages are sent in binary format
+// The format strings stay in the ELF and the text is rebuilt on the host
+// with scripts/log_decode.py
+// When not defined(commented out) - log messages are formatted on the VCU
+// #define LOG_BINARY_MODE
+
+// Compile-time log levels
+// Log messages below these levels generate no code, unlike the min_level in
+// the log config which is checked when the message is logged
+// LOG_MIN_LEVEL applies to everything, the others are per module
+#if COMPETITION_MODE
+#define LOG_MIN_LEVEL               LOG_LEVEL_WARN
+#else
+#define LOG_MIN_LEVEL               LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_MIN_LEVEL_VCU           LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_LOG           LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_APPS          LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_BPS           LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_RTDS          LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_CTRL          LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_PM100         LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_CANBC         LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_CANSTATS      LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_CAPTURE       LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_XCP           LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_TICK          LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_REMOTE_CTRL   LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL_TEST          LOG_MIN_LEVEL
+
 /**
  * @brief  Threads
  */
@@ -118,23 +149,47 @@ typedef struct {
      float deadzone_fraction;                // fraction of input range for deadzone
 } config_torque_map_t;
 
+/**
+ * @brief   PM100DZ broadcast decoding
+ */
+typedef struct {
+     uint32_t frame_id;                      // CAN C frame ID (see can_c.h)
+     uint8_t decimation;                     // decode every nth frame
+     uint32_t max_age_ticks;                 // age at which decoded values are stale (0 for never), must allow for decimation
+} config_pm100_msg_t;
+
 /**
  * @brief   PM100DZ inverter
  */
 typedef struct {
      config_thread_t thread;                 // service thread config
      uint32_t broadcast_timeout_ticks;       // maximum number of ticks to wait for a broadcast
-     uint32_t torque_request_timeout_ticks;
-     uint32_t precharge_timeout_ticks;
+     const config_pm100_msg_t* msgs;         // broadcast decoding, frames not listed are decoded every time and never stale
+     uint32_t msgs_len;                      // number of entries in msgs
      uint8_t speed_mode;
 } config_pm100_t;
 
+/**
+ * @brief   CAN broadcast table entry
+ */
+typedef struct {
+     uint32_t frame_id;                      // CAN S frame ID (see can_s.h)
+     uint32_t period_ticks;                  // ticks between broadcasts
+     uint32_t phase_ticks;                   // offset of the first broadcast
+     uint32_t max_age_ticks;                 // 0 to send every period, else send on change or at this age
+     bool catch_up;                          // send missed broadcasts late rather than skip them
+} config_canbc_msg_t;
+
 /**
  * @brief   CAN broadcasting service
  */
 typedef struct {
      config_thread_t thread;                 // CANBC thread config
-     uint32_t broadcast_period_ticks;        // ticks between broadcasts
+     const config_canbc_msg_t* schedule;     // broadcast table
+     uint32_t schedule_len;                  // number of entries in table
+     uint32_t report_period_ticks;           // ticks between logging broadcast statistics (0 to disable)
+     uint32_t max_in_flight;                 // most broadcast frames in the TX mailboxes at once
+     uint32_t max_catch_up;                  // most periods a catch up frame can fall behind before skipping
 } config_canbc_t;
 
 typedef struct
@@ -143,6 +198,45 @@ typedef struct
      uint32_t blink_period_ticks;            // period to blink the LED
 } config_heartbeat_t;
 
+/**
+ * @brief   CAN statistics service
+ */
+typedef struct
+{
+     config_thread_t thread;                 // thread config
+     uint32_t window_ticks;                  // length of the bus load window
+     uint32_t report_period_ticks;           // ticks between logging statistics (0 to disable)
+     uint32_t report_top_ids;                // busiest IDs logged for each bus
+     uint32_t broadcast_period_ticks;        // ticks between broadcasts on CAN S (0 to disable)
+     uint32_t broadcast_phase_ticks;         // offset of the CAN C load broadcast (+ 1 for CAN S)
+     uint32_t can_id;                        // CAN S ID of CAN C load (+ 1 for CAN S)
+} config_canstats_t;
+
+/**
+ * @brief   Burst capture service
+ */
+typedef struct
+{
+     config_thread_t thread;                 // thread config
+     uint32_t pre_trigger_samples;           // samples kept from before the trigger
+     uint32_t post_trigger_samples;          // samples recorded after the trigger
+     uint32_t drain_frames_per_sec;          // cap on frames sent on CAN S while draining
+     uint32_t drain_burst_frames;            // most frames sent back to back while draining
+     uint32_t idle_poll_ticks;               // ticks between checks for a finished recording
+     uint32_t can_id;                        // CAN S ID of capture header (samples at + 1)
+     uint32_t command_can_id;                // CAN S ID of capture commands
+} config_capture_t;
+
+/**
+ * @brief   XCP on CAN measurement server
+ */
+typedef struct
+{
+     config_thread_t thread;                 // thread config
+     uint32_t cmd_can_id;                    // CAN S ID of commands from the master
+     uint32_t res_can_id;                    // CAN S ID of responses and DAQ data
+} config_xcp_t;
+
 typedef struct
 {
      config_thread_t thread;
@@ -179,6 +273,13 @@ typedef struct
      config_thread_t thread;
      config_log_level_t min_level;
      UART_HandleTypeDef *uart;
+     uint32_t msg_pool_size;          // bytes for queued messages (power of 2)
+     uint32_t stats_can_id;           // CAN S ID of statistics (+ 1 and + 2 too)
+     uint32_t stats_period_ticks;     // statistics broadcast period (0 to disable)
+     uint32_t stats_phase_ticks;      // offset of the statistics broadcasts
+     uint32_t stream_can_id;          // CAN S ID of the log stream
+     uint32_t stream_bytes_per_sec;   // CAN S bandwidth cap (0 to disable)
+     uint32_t stream_burst_bytes;     // bytes which may be sent back to back
 } config_log_t;
 
 typedef struct
@@ -195,6 +296,8 @@ typedef struct
      bool run_apps_testbench;
      bool run_fault_state_testbench;
      uint8_t apps_testbench_laps;
+     bool run_log_benchmark;         // time log enqueue/format at start up
+     bool run_torque_benchmark;      // time torque command packing at start up
 } config_testbenches;
 
 /**
@@ -217,6 +320,9 @@ typedef struct {
      config_remote_ctrl_t remote_ctrl;
      config_canbc_t canbc;
      config_heartbeat_t heartbeat;
+     config_canstats_t canstats;
+     config_capture_t capture;
+     config_xcp_t xcp;
      config_log_t log;
      config_rtos_t rtos;
      config_testbenches testbenches;
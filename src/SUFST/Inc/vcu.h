@@ -12,8 +12,11 @@
 #include <rtcan.h>
 #include <stdint.h>
 #include <tx_api.h>
+#include <usart.h>
 
 #include "canbc.h"
+#include "canstats.h"
+#include "capture.h"
 #include "config.h"
 #include "ctrl.h"
 #include "dash.h"
@@ -23,6 +26,7 @@
 #include "remote_ctrl.h"
 #include "status.h"
 #include "tick.h"
+#include "xcp.h"
 
 /**
  * @brief       VCU context
@@ -31,12 +35,15 @@
  */
 typedef struct
 {
-    rtcan_handle_t rtcan_s; // RTCAN service for sensors CAN bus
-    rtcan_handle_t rtcan_c; // RTCAN service for critical systems CAN bus
-    canbc_context_t canbc;  // CAN broadcasting service instance
-    dash_context_t dash;    // dash service
-    ctrl_context_t ctrl;    // control service
-    pm100_context_t pm100;  // PM100 service
+    rtcan_handle_t rtcan_s;        // RTCAN service for sensors CAN bus
+    rtcan_handle_t rtcan_c;        // RTCAN service for critical systems CAN bus
+    canbc_context_t canbc;         // CAN broadcasting service instance
+    canstats_context_t canstats;   // CAN bus statistics service
+    capture_context_t capture;     // burst capture service
+    xcp_context_t xcp;             // XCP measurement service
+    dash_context_t dash;           // dash service
+    ctrl_context_t ctrl;           // control service
+    pm100_context_t pm100;         // PM100 service
     tick_context_t tick;
     remote_ctrl_context_t remote_ctrl;
     heartbeat_context_t heartbeat; // heartbeat service
@@ -59,10 +66,20 @@ status_t vcu_init(vcu_context_t* vcu_ptr,
 status_t vcu_handle_can_tx_mailbox_callback(vcu_context_t* vcu_ptr,
                                             CAN_HandleTypeDef* can_h);
 
+status_t vcu_handle_can_tx_cplt(vcu_context_t* vcu_ptr,
+                                CAN_HandleTypeDef* can_h,
+                                uint32_t mailbox);
+
 status_t vcu_handle_can_rx_it(vcu_context_t* vcu_ptr,
                               CAN_HandleTypeDef* can_h,
                               uint32_t rx_fifo);
 
 status_t vcu_handle_can_err(vcu_context_t* vcu_ptr, CAN_HandleTypeDef* can_h);
 
+status_t vcu_handle_uart_tx_cplt(vcu_context_t* vcu_ptr,
+                                 UART_HandleTypeDef* uart_h);
+
+status_t vcu_handle_uart_err(vcu_context_t* vcu_ptr,
+                             UART_HandleTypeDef* uart_h);
+
 #endif
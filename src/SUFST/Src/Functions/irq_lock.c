@@ -0,0 +1,77 @@
+#include "irq_lock.h"
+
+#include <stm32f7xx.h>
+
+/*
+ * lock state, only modified with interrupts disabled
+ */
+static uint32_t lock_depth = 0;
+static uint32_t lock_start = 0;
+static uint32_t lock_max_cycles = 0;
+
+/**
+ * @brief       Enables the DWT cycle counter used for measurement
+ */
+void irq_lock_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->LAR = 0xC5ACCE55; // unlock DWT registers on Cortex-M7
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/**
+ * @brief       Disables interrupts
+ *
+ * @details     May be nested, only the outermost lock is measured
+ *
+ * @return      Previous interrupt state, to be passed to irq_unlock()
+ */
+UINT irq_lock(void)
+{
+    const UINT state = tx_interrupt_control(TX_INT_DISABLE);
+
+    if (lock_depth++ == 0)
+    {
+        lock_start = DWT->CYCCNT;
+    }
+
+    return state;
+}
+
+/**
+ * @brief       Restores the interrupt state from before irq_lock()
+ *
+ * @param[in]   state   Value returned by irq_lock()
+ */
+void irq_unlock(UINT state)
+{
+    if (--lock_depth == 0)
+    {
+        const uint32_t cycles = DWT->CYCCNT - lock_start;
+
+        if (cycles > lock_max_cycles)
+        {
+            lock_max_cycles = cycles;
+        }
+    }
+
+    tx_interrupt_control(state);
+}
+
+/**
+ * @brief       Returns the longest interrupt-disabled window in CPU cycles
+ */
+uint32_t irq_lock_max_cycles(void)
+{
+    return lock_max_cycles;
+}
+
+/**
+ * @brief       Clears the longest interrupt-disabled window
+ */
+void irq_lock_reset_max(void)
+{
+    const UINT state = tx_interrupt_control(TX_INT_DISABLE);
+    lock_max_cycles = 0;
+    tx_interrupt_control(state);
+}
@@ -0,0 +1,230 @@
+#include "mpsc_ring.h"
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * record header layout
+ *
+ * | committed (1 bit) | padding (1 bit) | length (30 bits) |
+ *
+ * a header of zero marks space which has been reserved but not yet written,
+ * so the consumer clears every record it releases
+ */
+#define HEADER_COMMITTED 0x80000000
+#define HEADER_PADDING   0x40000000
+#define HEADER_LEN_MASK  0x3FFFFFFF
+
+/*
+ * internal function prototypes
+ */
+static inline uint32_t record_size(uint32_t len);
+static inline atomic_uint_least32_t* header_at(mpsc_ring_t* ring_ptr,
+                                               uint32_t pos);
+
+/**
+ * @brief       Initialises a ring
+ *
+ * @param[in]   ring_ptr    Ring
+ * @param[in]   mem_ptr     Storage, must be 4 byte aligned
+ * @param[in]   size        Size of storage in bytes, must be a power of two
+ *
+ * @return      false if the storage is unsuitable
+ */
+bool mpsc_ring_init(mpsc_ring_t* ring_ptr, void* mem_ptr, uint32_t size)
+{
+    if (mem_ptr == NULL || ((uintptr_t) mem_ptr & 0x3) != 0
+        || size < 2 * MPSC_RING_HEADER_SIZE || (size & (size - 1)) != 0)
+    {
+        return false;
+    }
+
+    memset(mem_ptr, 0, size);
+
+    ring_ptr->buf = (uint8_t*) mem_ptr;
+    ring_ptr->size = size;
+    atomic_init(&ring_ptr->head, 0);
+    atomic_init(&ring_ptr->tail, 0);
+
+    return true;
+}
+
+/**
+ * @brief       Reserves space for a record
+ *
+ * @details     Safe to call from any thread or ISR. Records never wrap around
+ *              the end of the buffer, instead a padding record is inserted and
+ *              the record starts at the beginning of the buffer.
+ *
+ *              The record is not visible to the consumer until it has been
+ *              passed to mpsc_ring_commit().
+ *
+ * @param[in]   ring_ptr    Ring
+ * @param[in]   len         Length of record payload in bytes
+ *
+ * @return      Pointer to the 4 byte aligned payload, or NULL if full
+ */
+void* mpsc_ring_reserve(mpsc_ring_t* ring_ptr, uint32_t len)
+{
+    if (len > MPSC_RING_MAX_RECORD_LEN)
+        return NULL;
+
+    const uint32_t total = record_size(len);
+    uint32_t head = atomic_load_explicit(&ring_ptr->head, memory_order_relaxed);
+    uint32_t offset;
+    uint32_t need;
+
+    do
+    {
+        const uint32_t tail
+            = atomic_load_explicit(&ring_ptr->tail, memory_order_acquire);
+
+        offset = head & (ring_ptr->size - 1);
+        need = total;
+
+        // skip the remainder of the buffer if the record doesn't fit
+        if (offset + total > ring_ptr->size)
+        {
+            need += ring_ptr->size - offset;
+        }
+
+        if (head + need - tail > ring_ptr->size)
+            return NULL;
+
+    } while (!atomic_compare_exchange_weak_explicit(&ring_ptr->head,
+                                                    &head,
+                                                    head + need,
+                                                    memory_order_acq_rel,
+                                                    memory_order_relaxed));
+
+    if (need != total)
+    {
+        atomic_store(header_at(ring_ptr, offset),
+                     (ring_ptr->size - offset) | HEADER_PADDING
+                         | HEADER_COMMITTED);
+        offset = 0;
+    }
+
+    atomic_uint_least32_t* header_ptr = header_at(ring_ptr, offset);
+    atomic_store_explicit(header_ptr, len, memory_order_relaxed);
+
+    return (void*) (header_ptr + 1);
+}
+
+/**
+ * @brief       Makes a reserved record visible to the consumer
+ *
+ * @param[in]   ring_ptr    Ring
+ * @param[in]   record_ptr  Pointer returned by mpsc_ring_reserve()
+ */
+void mpsc_ring_commit(mpsc_ring_t* ring_ptr, void* record_ptr)
+{
+    (void) ring_ptr;
+
+    atomic_uint_least32_t* header_ptr
+        = ((atomic_uint_least32_t*) record_ptr) - 1;
+
+    const uint32_t header
+        = atomic_load_explicit(header_ptr, memory_order_relaxed);
+
+    atomic_store(header_ptr, header | HEADER_COMMITTED);
+}
+
+/**
+ * @brief       Gets the oldest record without removing it
+ *
+ * @details     Must only be called by the consumer. Returns NULL if the oldest
+ *              record is still being written, even if newer records have been
+ *              committed, so that records are always read in order.
+ *
+ * @param[in]   ring_ptr    Ring
+ * @param[out]  len_ptr     Length of record payload
+ *
+ * @return      Pointer to the payload, or NULL if there is no record to read
+ */
+const void* mpsc_ring_peek(mpsc_ring_t* ring_ptr, uint32_t* len_ptr)
+{
+    uint32_t tail = atomic_load_explicit(&ring_ptr->tail, memory_order_relaxed);
+
+    while (tail != atomic_load(&ring_ptr->head))
+    {
+        atomic_uint_least32_t* header_ptr = header_at(ring_ptr, tail);
+        const uint32_t header = atomic_load(header_ptr);
+
+        if ((header & HEADER_COMMITTED) == 0)
+            return NULL;
+
+        const uint32_t len = header & HEADER_LEN_MASK;
+
+        if ((header & HEADER_PADDING) == 0)
+        {
+            *len_ptr = len;
+            return (const void*) (header_ptr + 1);
+        }
+
+        // discard padding at the end of the buffer
+        memset((void*) header_ptr, 0, len);
+        tail += len;
+        atomic_store_explicit(&ring_ptr->tail, tail, memory_order_release);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief       Removes the record returned by mpsc_ring_peek()
+ *
+ * @param[in]   ring_ptr    Ring
+ */
+void mpsc_ring_release(mpsc_ring_t* ring_ptr)
+{
+    const uint32_t tail
+        = atomic_load_explicit(&ring_ptr->tail, memory_order_relaxed);
+
+    atomic_uint_least32_t* header_ptr = header_at(ring_ptr, tail);
+    const uint32_t header
+        = atomic_load_explicit(header_ptr, memory_order_relaxed);
+    const uint32_t total = record_size(header & HEADER_LEN_MASK);
+
+    // clear the record so stale data is never mistaken for a header
+    memset((void*) header_ptr, 0, total);
+
+    atomic_store_explicit(&ring_ptr->tail,
+                          tail + total,
+                          memory_order_release);
+}
+
+/**
+ * @brief       Gets the number of bytes in use, including headers and padding
+ *
+ * @param[in]   ring_ptr    Ring
+ */
+uint32_t mpsc_ring_used(mpsc_ring_t* ring_ptr)
+{
+    const uint32_t tail = atomic_load(&ring_ptr->tail);
+    const uint32_t head = atomic_load(&ring_ptr->head);
+
+    return head - tail;
+}
+
+/**
+ * @brief       Gets the number of bytes taken up by a record
+ *
+ * @param[in]   len     Length of record payload
+ */
+uint32_t record_size(uint32_t len)
+{
+    return (MPSC_RING_HEADER_SIZE + len + 3) & ~((uint32_t) 3);
+}
+
+/**
+ * @brief       Gets the header at a position in the ring
+ *
+ * @param[in]   ring_ptr    Ring
+ * @param[in]   pos         Free-running position
+ */
+atomic_uint_least32_t* header_at(mpsc_ring_t* ring_ptr, uint32_t pos)
+{
+    return (atomic_uint_least32_t*) &ring_ptr->buf[pos
+                                                   & (ring_ptr->size - 1)];
+}
@@ -0,0 +1,562 @@
+#include "str_format.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// largest number of digits in a 64-bit integer (octal)
+#define MAX_DIGITS 22
+
+// largest supported precision for %f
+#define MAX_FLOAT_PRECISION 9
+
+/**
+ * @brief   Output buffer state
+ */
+typedef struct
+{
+    char* buf;    // output buffer
+    uint32_t len; // size of output buffer
+    uint32_t pos; // characters produced, including those which didn't fit
+} output_t;
+
+/**
+ * @brief   Parsed conversion specification
+ */
+typedef struct
+{
+    bool left;       // '-' flag
+    bool zero;       // '0' flag
+    bool plus;       // '+' flag
+    bool space;      // ' ' flag
+    bool alt;        // '#' flag
+    int32_t width;   // minimum field width
+    int32_t prec;    // precision, or -1 if not given
+} spec_t;
+
+/*
+ * internal function prototypes
+ */
+static void put_char(output_t* out_ptr, char c);
+static void put_padding(output_t* out_ptr, char c, int32_t count);
+static void put_integer(output_t* out_ptr,
+                        const spec_t* spec_ptr,
+                        uint64_t value,
+                        bool negative,
+                        uint32_t base,
+                        bool upper);
+static void put_string(output_t* out_ptr,
+                       const spec_t* spec_ptr,
+                       const char* str);
+static void put_float(output_t* out_ptr, const spec_t* spec_ptr, double value);
+
+/**
+ * @brief       Formats a string
+ *
+ * @param[out]  buf         Output buffer
+ * @param[in]   buf_len     Size of output buffer
+ * @param[in]   format      printf style format string
+ *
+ * @return      Length of the output (excluding the terminator) if the buffer
+ *              had been big enough, as for snprintf()
+ */
+uint32_t str_format(char* buf, uint32_t buf_len, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    const uint32_t len = str_vformat(buf, buf_len, format, args);
+    va_end(args);
+
+    return len;
+}
+
+/**
+ * @brief       Formats a string from a list of arguments
+ *
+ * @details     The output is always null terminated if buf_len is not zero
+ *
+ * @param[out]  buf         Output buffer
+ * @param[in]   buf_len     Size of output buffer
+ * @param[in]   format      printf style format string
+ * @param[in]   args        Arguments
+ *
+ * @return      Length of the output (excluding the terminator) if the buffer
+ *              had been big enough, as for vsnprintf()
+ */
+uint32_t str_vformat(char* buf,
+                     uint32_t buf_len,
+                     const char* format,
+                     va_list args)
+{
+    output_t out = {.buf = buf, .len = buf_len, .pos = 0};
+    const char* p = format;
+
+    while (*p != '\0')
+    {
+        if (*p != '%')
+        {
+            put_char(&out, *p++);
+            continue;
+        }
+
+        p++;
+
+        // flags
+        spec_t spec = {.width = 0, .prec = -1};
+        bool parsing_flags = true;
+
+        while (parsing_flags)
+        {
+            switch (*p)
+            {
+            case '-':
+                spec.left = true;
+                p++;
+                break;
+            case '0':
+                spec.zero = true;
+                p++;
+                break;
+            case '+':
+                spec.plus = true;
+                p++;
+                break;
+            case ' ':
+                spec.space = true;
+                p++;
+                break;
+            case '#':
+                spec.alt = true;
+                p++;
+                break;
+            default:
+                parsing_flags = false;
+                break;
+            }
+        }
+
+        // width
+        if (*p == '*')
+        {
+            spec.width = va_arg(args, int);
+            p++;
+
+            if (spec.width < 0)
+            {
+                spec.left = true;
+                spec.width = -spec.width;
+            }
+        }
+        else
+        {
+            while (*p >= '0' && *p <= '9')
+            {
+                spec.width = spec.width * 10 + (*p++ - '0');
+            }
+        }
+
+        // precision
+        if (*p == '.')
+        {
+            p++;
+            spec.prec = 0;
+
+            if (*p == '*')
+            {
+                spec.prec = va_arg(args, int);
+                p++;
+            }
+            else
+            {
+                while (*p >= '0' && *p <= '9')
+                {
+                    spec.prec = spec.prec * 10 + (*p++ - '0');
+                }
+            }
+        }
+
+        // length modifier, as a number of 'l's
+        uint32_t longs = 0;
+        bool half = false;
+        bool half_half = false;
+
+        switch (*p)
+        {
+        case 'h':
+            p++;
+            half = true;
+            if (*p == 'h')
+            {
+                half_half = true;
+                p++;
+            }
+            break;
+        case 'l':
+            p++;
+            longs = 1;
+            if (*p == 'l')
+            {
+                longs = 2;
+                p++;
+            }
+            break;
+        case 'z':
+        case 't':
+            p++;
+            longs = (sizeof(size_t) > sizeof(long)) ? 2 : 1;
+            break;
+        case 'j':
+            p++;
+            longs = 2;
+            break;
+        default:
+            break;
+        }
+
+        // conversion
+        const char conv = *p;
+
+        if (conv == '\0')
+            break;
+
+        p++;
+
+        switch (conv)
+        {
+        case 'd':
+        case 'i':
+        {
+            int64_t value;
+
+            if (longs == 2)
+                value = va_arg(args, long long);
+            else if (longs == 1)
+                value = va_arg(args, long);
+            else
+                value = va_arg(args, int);
+
+            if (half_half)
+                value = (signed char) value;
+            else if (half)
+                value = (short) value;
+
+            const bool negative = value < 0;
+            const uint64_t magnitude
+                = negative ? (uint64_t) (-(value + 1)) + 1 : (uint64_t) value;
+
+            put_integer(&out, &spec, magnitude, negative, 10, false);
+            break;
+        }
+
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+        {
+            uint64_t value;
+
+            if (longs == 2)
+                value = va_arg(args, unsigned long long);
+            else if (longs == 1)
+                value = va_arg(args, unsigned long);
+            else
+                value = va_arg(args, unsigned int);
+
+            if (half_half)
+                value = (unsigned char) value;
+            else if (half)
+                value = (unsigned short) value;
+
+            const uint32_t base = (conv == 'u') ? 10 : (conv == 'o') ? 8 : 16;
+
+            put_integer(&out, &spec, value, false, base, conv == 'X');
+            break;
+        }
+
+        case 'p':
+        {
+            spec.alt = true;
+            put_integer(&out,
+                        &spec,
+                        (uintptr_t) va_arg(args, void*),
+                        false,
+                        16,
+                        false);
+            break;
+        }
+
+        case 'c':
+        {
+            const char c = (char) va_arg(args, int);
+
+            if (!spec.left)
+                put_padding(&out, ' ', spec.width - 1);
+
+            put_char(&out, c);
+
+            if (spec.left)
+                put_padding(&out, ' ', spec.width - 1);
+
+            break;
+        }
+
+        case 's':
+        {
+            const char* str = va_arg(args, const char*);
+            put_string(&out, &spec, (str != NULL) ? str : "(null)");
+            break;
+        }
+
+        case 'f':
+        case 'F':
+        {
+            put_float(&out, &spec, va_arg(args, double));
+            break;
+        }
+
+        case '%':
+        {
+            put_char(&out, '%');
+            break;
+        }
+
+        default:
+        {
+            // unsupported, output as is
+            put_char(&out, '%');
+            put_char(&out, conv);
+            break;
+        }
+        }
+    }
+
+    // terminate
+    if (out.len > 0)
+    {
+        out.buf[(out.pos < out.len) ? out.pos : out.len - 1] = '\0';
+    }
+
+    return out.pos;
+}
+
+/**
+ * @brief       Outputs a character if there is space for it and a terminator
+ *
+ * @param[in]   out_ptr     Output
+ * @param[in]   c           Character
+ */
+static void put_char(output_t* out_ptr, char c)
+{
+    if (out_ptr->pos + 1 < out_ptr->len)
+    {
+        out_ptr->buf[out_ptr->pos] = c;
+    }
+
+    out_ptr->pos++;
+}
+
+/**
+ * @brief       Outputs a character repeatedly
+ *
+ * @param[in]   out_ptr     Output
+ * @param[in]   c           Character
+ * @param[in]   count       Number of times, nothing is output if negative
+ */
+static void put_padding(output_t* out_ptr, char c, int32_t count)
+{
+    for (int32_t i = 0; i < count; i++)
+    {
+        put_char(out_ptr, c);
+    }
+}
+
+/**
+ * @brief       Outputs an integer
+ *
+ * @param[in]   out_ptr     Output
+ * @param[in]   spec_ptr    Conversion specification
+ * @param[in]   value       Magnitude of the value
+ * @param[in]   negative    True if the value is negative
+ * @param[in]   base        8, 10 or 16
+ * @param[in]   upper       Use upper case hex digits
+ */
+static void put_integer(output_t* out_ptr,
+                        const spec_t* spec_ptr,
+                        uint64_t value,
+                        bool negative,
+                        uint32_t base,
+                        bool upper)
+{
+    const char* digit_chars = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char digits[MAX_DIGITS];
+    int32_t num_digits = 0;
+
+    // digits in reverse order, "0" with precision 0 outputs nothing
+    while (value != 0)
+    {
+        digits[num_digits++] = digit_chars[value % base];
+        value /= base;
+    }
+
+    if (num_digits == 0 && spec_ptr->prec != 0)
+    {
+        digits[num_digits++] = '0';
+    }
+
+    // prefix
+    char prefix[2];
+    int32_t prefix_len = 0;
+
+    if (negative)
+        prefix[prefix_len++] = '-';
+    else if (spec_ptr->plus && base == 10)
+        prefix[prefix_len++] = '+';
+    else if (spec_ptr->space && base == 10)
+        prefix[prefix_len++] = ' ';
+
+    if (spec_ptr->alt && base == 16)
+    {
+        prefix[prefix_len++] = '0';
+        prefix[prefix_len++] = upper ? 'X' : 'x';
+    }
+    else if (spec_ptr->alt && base == 8 && spec_ptr->prec <= num_digits)
+    {
+        prefix[prefix_len++] = '0';
+    }
+
+    // zero padding from precision, or from width with the '0' flag
+    int32_t zeros = (spec_ptr->prec > num_digits) ? spec_ptr->prec - num_digits
+                                                  : 0;
+    int32_t padding = spec_ptr->width - prefix_len - zeros - num_digits;
+
+    if (spec_ptr->zero && !spec_ptr->left && spec_ptr->prec < 0
+        && padding > 0)
+    {
+        zeros += padding;
+        padding = 0;
+    }
+
+    if (!spec_ptr->left)
+        put_padding(out_ptr, ' ', padding);
+
+    for (int32_t i = 0; i < prefix_len; i++)
+    {
+        put_char(out_ptr, prefix[i]);
+    }
+
+    put_padding(out_ptr, '0', zeros);
+
+    while (num_digits > 0)
+    {
+        put_char(out_ptr, digits[--num_digits]);
+    }
+
+    if (spec_ptr->left)
+        put_padding(out_ptr, ' ', padding);
+}
+
+/**
+ * @brief       Outputs a string
+ *
+ * @param[in]   out_ptr     Output
+ * @param[in]   spec_ptr    Conversion specification
+ * @param[in]   str         String
+ */
+static void put_string(output_t* out_ptr,
+                       const spec_t* spec_ptr,
+                       const char* str)
+{
+    int32_t len = 0;
+
+    while (str[len] != '\0' && (spec_ptr->prec < 0 || len < spec_ptr->prec))
+    {
+        len++;
+    }
+
+    if (!spec_ptr->left)
+        put_padding(out_ptr, ' ', spec_ptr->width - len);
+
+    for (int32_t i = 0; i < len; i++)
+    {
+        put_char(out_ptr, str[i]);
+    }
+
+    if (spec_ptr->left)
+        put_padding(out_ptr, ' ', spec_ptr->width - len);
+}
+
+/**
+ * @brief       Outputs a floating point value in fixed point notation
+ *
+ * @details     Values too large for a 64-bit integer part are output as "inf".
+ *              Halfway cases are rounded up rather than to even.
+ *
+ * @param[in]   out_ptr     Output
+ * @param[in]   spec_ptr    Conversion specification
+ * @param[in]   value       Value
+ */
+static void put_float(output_t* out_ptr, const spec_t* spec_ptr, double value)
+{
+    if (value != value)
+    {
+        put_string(out_ptr, spec_ptr, "nan");
+        return;
+    }
+
+    const bool negative = value < 0;
+    if (negative)
+        value = -value;
+
+    if (value >= 18446744073709551615.0)
+    {
+        put_string(out_ptr, spec_ptr, negative ? "-inf" : "inf");
+        return;
+    }
+
+    int32_t prec = (spec_ptr->prec < 0) ? 6 : spec_ptr->prec;
+    if (prec > MAX_FLOAT_PRECISION)
+        prec = MAX_FLOAT_PRECISION;
+
+    // scale the fractional part to an integer, with rounding
+    uint64_t scale = 1;
+    for (int32_t i = 0; i < prec; i++)
+    {
+        scale *= 10;
+    }
+
+    uint64_t integer = (uint64_t) value;
+    uint64_t fraction
+        = (uint64_t) ((value - (double) integer) * (double) scale + 0.5);
+
+    if (fraction >= scale)
+    {
+        integer++;
+        fraction -= scale;
+    }
+
+    // integer part, padded to leave space for the fraction
+    const int32_t fraction_len = (prec > 0 || spec_ptr->alt) ? prec + 1 : 0;
+
+    spec_t int_spec = *spec_ptr;
+    int_spec.prec = -1;
+    int_spec.alt = false;
+    int_spec.width = spec_ptr->left ? 0 : spec_ptr->width - fraction_len;
+
+    const uint32_t start = out_ptr->pos;
+    put_integer(out_ptr, &int_spec, integer, negative, 10, false);
+
+    if (fraction_len > 0)
+    {
+        put_char(out_ptr, '.');
+
+        spec_t frac_spec = {.width = 0, .prec = prec};
+        if (prec > 0)
+            put_integer(out_ptr, &frac_spec, fraction, false, 10, false);
+    }
+
+    if (spec_ptr->left)
+    {
+        put_padding(out_ptr,
+                    ' ',
+                    spec_ptr->width - (int32_t) (out_ptr->pos - start));
+    }
+}
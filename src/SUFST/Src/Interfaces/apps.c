@@ -1,3 +1,5 @@
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_APPS
+
 #include "apps.h"
 
 /**
@@ -75,7 +77,7 @@ status_t apps_read(apps_context_t* apps_ptr, uint16_t* reading_ptr)
     }
     else if (status_1_verbose == STATUS_THRESHOLD_WARNING)
     {
-        LOG_INFO("APPS1 threshold warning; ");
+        LOG_INFO_LIMITED(1000, "APPS1 threshold warning; ");
     }
 
     LOG_INFO("APPS1 reading: %d; ", reading_1);
@@ -95,7 +97,7 @@ status_t apps_read(apps_context_t* apps_ptr, uint16_t* reading_ptr)
     }
     else if (status_2_verbose == STATUS_THRESHOLD_WARNING)
     {
-        LOG_INFO("APPS2 threshold warning; ");
+        LOG_INFO_LIMITED(1000, "APPS2 threshold warning; ");
     }
 
     LOG_INFO("APPS2 reading: %d; ", reading_2);
@@ -1,3 +1,5 @@
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_BPS
+
 #include "bps.h"
 
 /**
@@ -50,7 +52,7 @@ status_t bps_read(bps_context_t* bps_ptr, uint16_t* reading_ptr)
     }
     else if (status_verbose == STATUS_THRESHOLD_WARNING)
     {
-        LOG_INFO("BPS threshold warning; ");
+        LOG_INFO_LIMITED(1000, "BPS threshold warning; ");
     }
 
     LOG_INFO("BPS reading: %d; ", *reading_ptr);
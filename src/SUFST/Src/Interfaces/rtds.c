@@ -1,3 +1,5 @@
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_RTDS
+
 #include "rtds.h"
 
 #include <gpio.h>
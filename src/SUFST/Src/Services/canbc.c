@@ -1,30 +1,132 @@
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_CANBC
+
 #include "canbc.h"
 
 #include <can_c.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "canstats.h"
+#include "irq_lock.h"
+#include "log.h"
+
+// number of bxCAN transmit mailboxes
+#define CANBC_TX_MAILBOXES 3
+
+// owner of the frames packed from the broadcast states
+#define CANBC_STATES_OWNER "VCU"
+
+/**
+ * @brief   Frame which is packed from the broadcast states
+ */
+typedef struct
+{
+    uint32_t frame_id;      // CAN S frame ID
+    uint8_t length;         // frame length
+    bool extended;          // extended ID
+    canbc_pack_func_t pack; // packs the frame from the broadcast states
+} canbc_msg_t;
 
 /*
  * internal function prototypes
  */
 static void canbc_thread_entry(ULONG input);
-static void sleep_till_next_bc(canbc_context_t* canbc_h, uint32_t start_time);
+static status_t register_state_msgs(canbc_context_t* canbc_h);
+static void sleep_till_next_bc(canbc_context_t* canbc_h);
 static void send_bc_messages(canbc_context_t* canbc_h);
+static void read_states(canbc_context_t* canbc_h, canbc_states_t* states_ptr);
+static uint32_t state_msgs_mask(const canbc_context_t* canbc_h);
+static bool should_send(const canbc_slot_t* slot_ptr,
+                        const uint8_t* data,
+                        ULONG now);
+static void report_stats(canbc_context_t* canbc_h);
+static UINT begin_write(canbc_context_t* canbc_h);
+static void end_write(canbc_context_t* canbc_h,
+                      UINT irq_state,
+                      canbc_msg_idx_t msg_idx,
+                      bool changed);
+static int pack_state(uint8_t* dst_ptr, const void* src_ptr, size_t size);
+static int pack_sensors(uint8_t* dst_ptr, const void* src_ptr, size_t size);
+static int pack_temps(uint8_t* dst_ptr, const void* src_ptr, size_t size);
+static int pack_errors(uint8_t* dst_ptr, const void* src_ptr, size_t size);
+static int pack_pdm(uint8_t* dst_ptr, const void* src_ptr, size_t size);
+
+/**
+ * @brief   Frames which are packed from the broadcast states
+ *
+ * @details The packing functions are generated from the DBC (see `can-defs`
+ *          repo). These frames are registered by canbc_init() with the
+ *          periods in the broadcast table in config.c, and setters mark them
+ *          as changed.
+ *
+ *          Other services can broadcast their own frames without touching
+ *          this file by passing a canbc_frame_t to canbc_register().
+ */
+static const canbc_msg_t canbc_msgs[CANBC_NUM_MSGS] = {
+    [CANBC_MSG_STATE] = {.frame_id = CAN_S_VCU_STATE_FRAME_ID,
+                         .length = CAN_S_VCU_STATE_LENGTH,
+                         .extended = CAN_S_VCU_STATE_IS_EXTENDED,
+                         .pack = pack_state},
+    [CANBC_MSG_SENSORS] = {.frame_id = CAN_S_VCU_SENSORS_FRAME_ID,
+                           .length = CAN_S_VCU_SENSORS_LENGTH,
+                           .extended = CAN_S_VCU_SENSORS_IS_EXTENDED,
+                           .pack = pack_sensors},
+    [CANBC_MSG_TEMPS] = {.frame_id = CAN_S_VCU_TEMPS_FRAME_ID,
+                         .length = CAN_S_VCU_TEMPS_LENGTH,
+                         .extended = CAN_S_VCU_TEMPS_IS_EXTENDED,
+                         .pack = pack_temps},
+    [CANBC_MSG_ERRORS] = {.frame_id = CAN_S_VCU_ERROR_FRAME_ID,
+                          .length = CAN_S_VCU_ERROR_LENGTH,
+                          .extended = CAN_S_VCU_ERROR_IS_EXTENDED,
+                          .pack = pack_errors},
+    [CANBC_MSG_PDM] = {.frame_id = CAN_S_VCU_PDM_FRAME_ID,
+                       .length = CAN_S_VCU_PDM_LENGTH,
+                       .extended = CAN_S_VCU_PDM_IS_EXTENDED,
+                       .pack = pack_pdm},
+};
 
 /**
  * @brief       Initialise CANBC service
  *
  * @param[in]   canbc_h         CANBC handle
  * @param[in]   rtcan_h         RTCAN handle
+ * @param[in]   can_h           CAN peripheral of the RTCAN instance
+ * @param[in]   xcp_ptr         XCP context, may be NULL
  * @param[in]   stack_pool_ptr  Application memory pool
  * @param[in]   config_ptr      Configuration
  */
 status_t canbc_init(canbc_context_t* canbc_h,
                     rtcan_handle_t* rtcan_h,
+                    CAN_HandleTypeDef* can_h,
+                    xcp_context_t* xcp_ptr,
                     TX_BYTE_POOL* stack_pool_ptr,
                     const config_canbc_t* config_ptr)
 {
     canbc_h->rtcan_h = rtcan_h;
+    canbc_h->can_h = can_h;
+    canbc_h->xcp_ptr = xcp_ptr;
+    canbc_h->bitrate = canstats_get_bitrate(can_h);
     canbc_h->config_ptr = config_ptr;
     canbc_h->rolling_counter = 0;
+    canbc_h->schedule_len = 0;
+    canbc_h->bus_load_bps = 0;
+    canbc_h->idle_load_bps = 0;
+    canbc_h->report_time = tx_time_get();
+    canbc_h->repack = 0;
+    memset(canbc_h->state_msgs, 0, sizeof(canbc_h->state_msgs));
+    atomic_init(&canbc_h->states_seq, 0);
+    atomic_init(&canbc_h->dirty, 0);
+
+    if (canbc_h->bitrate == 0)
+        return STATUS_ERROR;
+
+    // register the frames in the broadcast table
+    if (register_state_msgs(canbc_h) != STATUS_OK)
+    {
+        LOG_ERROR("Invalid CAN broadcast table\n");
+        return STATUS_ERROR;
+    }
 
     // create service thread
     void* stack_ptr = NULL;
@@ -47,19 +149,13 @@ status_t canbc_init(canbc_context_t* canbc_h,
                                      TX_AUTO_START);
     }
 
-    // create state mutex
-    if (tx_status == TX_SUCCESS)
-    {
-        tx_status = tx_mutex_create(&canbc_h->state_mutex, NULL, 0);
-    }
-
     return (tx_status == TX_SUCCESS) ? STATUS_OK : STATUS_ERROR;
 }
 
 /**
  * @brief       CANBC service thread
  *
- * @details     Wakes periodically to broadcast to the CAN bus
+ * @details     Wakes whenever a broadcast is due
  *
  * @param[in]   input   CANBC handle
  */
@@ -67,147 +163,683 @@ static void canbc_thread_entry(ULONG input)
 {
     canbc_context_t* canbc_h = (canbc_context_t*) input;
 
+    const ULONG report_period = canbc_h->config_ptr->report_period_ticks;
+
+    // every service has registered its frames by now
+    LOG_INFO("CAN S broadcast load: %lu bit/s (%lu.%lu%%), "
+             "%lu bit/s with no changes\n",
+             canbc_h->bus_load_bps,
+             (canbc_h->bus_load_bps * 100) / canbc_h->bitrate,
+             ((canbc_h->bus_load_bps * 1000) / canbc_h->bitrate) % 10,
+             canbc_h->idle_load_bps);
+
     while (1)
     {
-        uint32_t start_time = tx_time_get();
         send_bc_messages(canbc_h);
-        sleep_till_next_bc(canbc_h, start_time);
+        xcp_event(canbc_h->xcp_ptr, XCP_EVENT_CANBC);
+
+        if (report_period != 0
+            && tx_time_get() - canbc_h->report_time >= report_period)
+        {
+            report_stats(canbc_h);
+        }
+
+        sleep_till_next_bc(canbc_h);
+    }
+}
+
+/**
+ * @brief       Registers the frames in the broadcast table
+ *
+ * @param[in]   canbc_h     CANBC handle
+ *
+ * @return      STATUS_ERROR if the table has a frame ID which isn't packed
+ *              from the broadcast states, or a frame can't be registered
+ */
+static status_t register_state_msgs(canbc_context_t* canbc_h)
+{
+    const config_canbc_t* config_ptr = canbc_h->config_ptr;
+
+    for (uint32_t i = 0; i < config_ptr->schedule_len; i++)
+    {
+        const config_canbc_msg_t* entry_ptr = &config_ptr->schedule[i];
+        uint32_t msg_idx = CANBC_NUM_MSGS;
+
+        for (uint32_t j = 0; j < CANBC_NUM_MSGS; j++)
+        {
+            if (canbc_msgs[j].frame_id == entry_ptr->frame_id)
+            {
+                msg_idx = j;
+                break;
+            }
+        }
+
+        if (msg_idx == CANBC_NUM_MSGS)
+            return STATUS_ERROR;
+
+        const canbc_msg_t* msg_ptr = &canbc_msgs[msg_idx];
+        const canbc_frame_t frame = {.owner = CANBC_STATES_OWNER,
+                                     .frame_id = msg_ptr->frame_id,
+                                     .length = msg_ptr->length,
+                                     .extended = msg_ptr->extended,
+                                     .pack = msg_ptr->pack,
+                                     .src_ptr = &canbc_h->snapshot,
+                                     .period_ticks = entry_ptr->period_ticks,
+                                     .phase_ticks = entry_ptr->phase_ticks,
+                                     .max_age_ticks = entry_ptr->max_age_ticks,
+                                     .catch_up = entry_ptr->catch_up,
+                                     .tracked = true};
+        uint32_t handle;
+
+        if (canbc_register(canbc_h, &frame, &handle) != STATUS_OK)
+            return STATUS_ERROR;
+
+        canbc_h->state_msgs[msg_idx] |= 1 << handle;
+    }
+
+    return STATUS_OK;
+}
+
+/**
+ * @brief       Registers a frame to be broadcast
+ *
+ * @details     Must be called during initialisation, before the RTOS kernel
+ *              starts. The frame is copied, so the declaration doesn't need to
+ *              outlive the call. Also adds the worst case bus load of the
+ *              frame, and its load when it never changes, to the totals.
+ *
+ * @param[in]   canbc_h     CANBC handle
+ * @param[in]   frame_ptr   Frame declaration
+ * @param[out]  handle_ptr  Handle for canbc_mark_changed(), may be NULL
+ *
+ * @return      STATUS_ERROR if the schedule is full, the frame ID is already
+ *              registered, or the frame has no pack function, a zero period,
+ *              a phase which isn't less than the period or is too long
+ */
+status_t canbc_register(canbc_context_t* canbc_h,
+                        const canbc_frame_t* frame_ptr,
+                        uint32_t* handle_ptr)
+{
+    const uint32_t handle = canbc_h->schedule_len;
+
+    if (handle >= CANBC_MAX_MSGS || frame_ptr->pack == NULL
+        || frame_ptr->period_ticks == 0
+        || frame_ptr->phase_ticks >= frame_ptr->period_ticks
+        || frame_ptr->length > sizeof(((canbc_slot_t*) 0)->sent_data))
+    {
+        return STATUS_ERROR;
+    }
+
+    for (uint32_t i = 0; i < handle; i++)
+    {
+        if (canbc_h->schedule[i].frame.frame_id == frame_ptr->frame_id)
+            return STATUS_ERROR;
+    }
+
+    const ULONG now = tx_time_get();
+    canbc_slot_t* slot_ptr = &canbc_h->schedule[handle];
+
+    memset(slot_ptr, 0, sizeof(*slot_ptr));
+    slot_ptr->frame = *frame_ptr;
+
+    // deadlines are on a grid of the period from time zero, so broadcast
+    // times don't depend on when the service started
+    slot_ptr->next_time = now - (now % frame_ptr->period_ticks)
+                          + frame_ptr->phase_ticks;
+
+    if ((LONG) (slot_ptr->next_time - now) < 0)
+    {
+        slot_ptr->next_time += frame_ptr->period_ticks;
+    }
+
+    const uint32_t bits
+        = canstats_frame_bits(frame_ptr->length, frame_ptr->extended)
+          * TX_TIMER_TICKS_PER_SECOND;
+
+    canbc_h->bus_load_bps += bits / frame_ptr->period_ticks;
+
+    if (frame_ptr->max_age_ticks != 0)
+    {
+        canbc_h->idle_load_bps += bits / frame_ptr->max_age_ticks;
+    }
+    else
+    {
+        canbc_h->idle_load_bps += bits / frame_ptr->period_ticks;
+    }
+
+    // pack before the first broadcast
+    canbc_h->repack |= 1 << handle;
+    canbc_h->schedule_len++;
+
+    if (handle_ptr != NULL)
+    {
+        *handle_ptr = handle;
+    }
+
+    LOG_DEBUG("%s registered CAN S frame 0x%lx\n",
+              frame_ptr->owner,
+              frame_ptr->frame_id);
+
+    return STATUS_OK;
+}
+
+/**
+ * @brief       Marks a tracked frame to be packed again when next due
+ *
+ * @details     Safe to call from any thread or ISR
+ *
+ * @param[in]   canbc_h     CANBC handle
+ * @param[in]   handle      Handle from canbc_register()
+ */
+void canbc_mark_changed(canbc_context_t* canbc_h, uint32_t handle)
+{
+    if (handle < CANBC_MAX_MSGS)
+    {
+        atomic_fetch_or_explicit(&canbc_h->dirty,
+                                 1 << handle,
+                                 memory_order_relaxed);
     }
 }
 
 /**
- * @brief       Sends broadcast messages via RTCAN
+ * @brief       Pack function for frames packed by their owner
  *
- * @details     The broadcast states packed into the CAN messages using the
- *              packing functions generated from the DBC (see `can-defs` repo).
+ * @details     The source is the frame data, which the owner updates with
+ *              canbc_set_raw(). It is copied with interrupts disabled, so a
+ *              frame is never sent half updated.
  *
- * @note        This approach doesn't scale particularly well, but at the
- *              moment there are a limited number of broadcast states so this
- *              implementation is the simplest.
+ * @param[out]  dst_ptr     Frame data
+ * @param[in]   src_ptr     Data written by canbc_set_raw()
+ * @param[in]   size        Frame length (at most 8, see canbc_register())
+ *
+ * @return      Frame length
+ */
+int canbc_pack_raw(uint8_t* dst_ptr, const void* src_ptr, size_t size)
+{
+    UINT irq_state = irq_lock();
+    memcpy(dst_ptr, src_ptr, size);
+    irq_unlock(irq_state);
+
+    return (int) size;
+}
+
+/**
+ * @brief       Updates the data of a frame registered with canbc_pack_raw()
+ *
+ * @details     Safe to call from any thread
+ *
+ * @param[in]   canbc_h     CANBC handle
+ * @param[in]   handle      Handle from canbc_register()
+ * @param[out]  frame_ptr   Source given when the frame was registered
+ * @param[in]   data        New frame data
+ * @param[in]   size        Frame length
+ */
+void canbc_set_raw(canbc_context_t* canbc_h,
+                   uint32_t handle,
+                   uint8_t* frame_ptr,
+                   const uint8_t* data,
+                   size_t size)
+{
+    UINT irq_state = irq_lock();
+    memcpy(frame_ptr, data, size);
+    irq_unlock(irq_state);
+
+    canbc_mark_changed(canbc_h, handle);
+}
+
+/**
+ * @brief       Packs the low 16 bits of a value, little endian
+ *
+ * @param[out]  buf     Output buffer (at least 2 bytes)
+ * @param[in]   value   Value to pack
+ */
+void canbc_put_u16(uint8_t* buf, uint32_t value)
+{
+    buf[0] = value & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+}
+
+/**
+ * @brief       Sends the broadcast messages which are due via RTCAN
+ *
+ * @details     Deadlines are absolute and always move in whole periods, so
+ *              broadcasts stay on their grid however late the thread runs.
+ *              When deadlines have been missed, catch up messages are sent
+ *              once per pass until they are back on time, unless more than
+ *              max_catch_up periods behind. Other messages are sent once and
+ *              the missed deadlines are skipped.
+ *
+ *              Tracked frames are only packed again if one of their signals
+ *              has been set to a new value, otherwise the cached data is
+ *              sent. Untracked frames are packed every time they are due. On
+ *              change messages are only sent if the data differs from the
+ *              last broadcast or has reached its max age.
+ *
+ *              At most max_in_flight frames are allowed in the TX mailboxes,
+ *              so a mailbox is always left free for other traffic. Frames
+ *              over the limit are deferred to the next tick, and dropped if
+ *              they fall a whole period behind. Frames which RTCAN refuses are
+ *              also dropped.
  *
  * @param[in]   canbc_h     CANBC handle
  */
 static void send_bc_messages(canbc_context_t* canbc_h)
 {
-    UINT tx_status = tx_mutex_get(&canbc_h->state_mutex, TX_WAIT_FOREVER);
+    const ULONG now = tx_time_get();
 
-    if (tx_status == TX_SUCCESS)
+    // frames which can be sent without going over the in flight limit
+    const uint32_t in_flight
+        = CANBC_TX_MAILBOXES - HAL_CAN_GetTxMailboxesFreeLevel(canbc_h->can_h);
+    const uint32_t max_in_flight = canbc_h->config_ptr->max_in_flight;
+    uint32_t budget = (in_flight < max_in_flight) ? max_in_flight - in_flight
+                                                  : 0;
+
+    // collect changes before copying the states, so a change made after the
+    // copy is still marked for the next pass
+    canbc_h->repack |= atomic_exchange(&canbc_h->dirty, 0);
+
+    // pack from one consistent copy of the states, if any have changed
+    if ((canbc_h->repack & state_msgs_mask(canbc_h)) != 0)
+    {
+        read_states(canbc_h, &canbc_h->snapshot);
+    }
+
+    for (uint32_t i = 0; i < canbc_h->schedule_len; i++)
     {
-        // states
+        canbc_slot_t* slot_ptr = &canbc_h->schedule[i];
+
+        if ((LONG) (now - slot_ptr->next_time) < 0)
+            continue;
+
+        const canbc_frame_t* frame_ptr = &slot_ptr->frame;
+        rtcan_msg_t message = {.identifier = frame_ptr->frame_id,
+                               .length = frame_ptr->length,
+                               .extended = frame_ptr->extended};
+
+        if (!frame_ptr->tracked || (canbc_h->repack & (1 << i)) != 0)
         {
-            rtcan_msg_t message = {.identifier = CAN_S_VCU_STATE_FRAME_ID,
-                                   .length = CAN_S_VCU_STATE_LENGTH,
-                                   .extended = CAN_S_VCU_STATE_IS_EXTENDED};
-
-            can_s_vcu_state_pack(message.data,
-                                 &canbc_h->states.state,
-                                 message.length);
-            rtcan_transmit(canbc_h->rtcan_h, &message);
+            frame_ptr->pack(canbc_h->packed[i],
+                            frame_ptr->src_ptr,
+                            message.length);
+            canbc_h->repack &= ~(1 << i);
         }
 
-        // sensors
+        memcpy(message.data, canbc_h->packed[i], message.length);
+        const bool send = should_send(slot_ptr, message.data, now);
+
+        // hold back until a mailbox frees up, unless a period late
+        if (send && budget == 0
+            && now - slot_ptr->next_time < slot_ptr->frame.period_ticks)
         {
-            rtcan_msg_t message = {.identifier = CAN_S_VCU_SENSORS_FRAME_ID,
-                                   .length = CAN_S_VCU_SENSORS_LENGTH,
-                                   .extended = CAN_S_VCU_SENSORS_IS_EXTENDED};
-
-            can_s_vcu_sensors_pack(message.data,
-                                   &canbc_h->states.sensors,
-                                   message.length);
-            rtcan_transmit(canbc_h->rtcan_h, &message);
+            slot_ptr->stats.deferred++;
+            continue;
         }
-        // temps
+
+        const ULONG late = now - slot_ptr->next_time;
+
+        slot_ptr->stats.checks++;
+        slot_ptr->stats.total_late += late;
+
+        if (late > slot_ptr->stats.max_late)
         {
-            rtcan_msg_t message = {.identifier = CAN_S_VCU_TEMPS_FRAME_ID,
-                                   .length = CAN_S_VCU_TEMPS_LENGTH,
-                                   .extended = CAN_S_VCU_TEMPS_IS_EXTENDED};
-
-            can_s_vcu_temps_pack(message.data,
-                                 &canbc_h->states.temps,
-                                 message.length);
-            rtcan_transmit(canbc_h->rtcan_h, &message);
+            slot_ptr->stats.max_late = late;
         }
 
-        // errors
+        if (send && budget == 0)
         {
-            rtcan_msg_t message = {.identifier = CAN_S_VCU_ERROR_FRAME_ID,
-                                   .length = CAN_S_VCU_ERROR_LENGTH,
-                                   .extended = CAN_S_VCU_ERROR_IS_EXTENDED};
-
-            can_s_vcu_error_pack(message.data,
-                                 &canbc_h->states.errors,
-                                 message.length);
-            rtcan_transmit(canbc_h->rtcan_h, &message);
+            slot_ptr->stats.dropped++;
         }
-
+        else if (send)
         {
-            rtcan_msg_t message = {.identifier = CAN_S_VCU_PDM_FRAME_ID,
-                                   .length = CAN_S_VCU_PDM_LENGTH,
-                                   .extended = CAN_S_VCU_PDM_IS_EXTENDED};
-
-            can_s_vcu_pdm_pack(message.data,
-                               &canbc_h->states.pdm,
-                               message.length);
-            rtcan_transmit(canbc_h->rtcan_h, &message);
+            budget--;
+
+            if (rtcan_transmit(canbc_h->rtcan_h, &message) == RTCAN_OK)
+            {
+                if (slot_ptr->sent_once
+                    && now - slot_ptr->sent_time > slot_ptr->stats.max_gap)
+                {
+                    slot_ptr->stats.max_gap = now - slot_ptr->sent_time;
+                }
+
+                memcpy(slot_ptr->sent_data, message.data, message.length);
+                slot_ptr->sent_time = now;
+                slot_ptr->sent_once = true;
+                slot_ptr->stats.sent++;
+            }
+            else
+            {
+                slot_ptr->stats.dropped++;
+            }
         }
 
-        tx_mutex_put(&canbc_h->state_mutex);
+        slot_ptr->next_time += slot_ptr->frame.period_ticks;
+
+        // skip whole periods to get back on the grid if not catching up
+        if ((LONG) (now - slot_ptr->next_time) >= 0)
+        {
+            const ULONG period = slot_ptr->frame.period_ticks;
+            const uint32_t missed = (now - slot_ptr->next_time) / period + 1;
+
+            if (!slot_ptr->frame.catch_up
+                || missed > canbc_h->config_ptr->max_catch_up)
+            {
+                slot_ptr->next_time += missed * period;
+                slot_ptr->stats.skipped += missed;
+            }
+        }
     }
 }
 
 /**
- * @brief       Suspends CANBC thread until the next broadcast is due
+ * @brief       Takes a consistent copy of the broadcast states
+ *
+ * @details     The states are protected by a sequence lock. The sequence
+ *              number is odd while a writer is editing the states, and is
+ *              changed by every edit. If it is odd or changes during the copy,
+ *              the copy is taken again. Writers never wait for the reader.
  *
  * @param[in]   canbc_h     CANBC handle
- * @param[in]   start_time  Timestamp at which last broadcast event started
+ * @param[out]  states_ptr  Copy of the states
  */
-static void sleep_till_next_bc(canbc_context_t* canbc_h, uint32_t start_time)
+static void read_states(canbc_context_t* canbc_h, canbc_states_t* states_ptr)
 {
-    const uint32_t period = canbc_h->config_ptr->broadcast_period_ticks;
-    const uint32_t run_time = tx_time_get() - start_time;
-    uint32_t sleep_time = period - run_time;
+    uint32_t seq;
 
-    // check for overflow or zero, just in case
-    if (run_time >= period)
+    do
     {
-        sleep_time = (TX_TIMER_TICKS_PER_SECOND * 0.5);
+        seq = atomic_load_explicit(&canbc_h->states_seq, memory_order_acquire);
+
+        memcpy(states_ptr, &canbc_h->states, sizeof(*states_ptr));
+        atomic_thread_fence(memory_order_acquire);
+
+    } while ((seq & 1) != 0
+             || seq != atomic_load_explicit(&canbc_h->states_seq,
+                                            memory_order_relaxed));
+}
+
+/**
+ * @brief       Gets the schedule bits of the frames packed from the states
+ *
+ * @param[in]   canbc_h     CANBC handle
+ */
+static uint32_t state_msgs_mask(const canbc_context_t* canbc_h)
+{
+    uint32_t mask = 0;
+
+    for (uint32_t i = 0; i < CANBC_NUM_MSGS; i++)
+    {
+        mask |= canbc_h->state_msgs[i];
     }
 
-    tx_thread_sleep(sleep_time);
+    return mask;
+}
+
+/**
+ * @brief       Decides whether a due message should be sent
+ *
+ * @details     On change messages are sent early if waiting for the next
+ *              check would take them past their max age, so the max age is
+ *              never exceeded
+ *
+ * @param[in]   slot_ptr    Schedule entry
+ * @param[in]   data        Newly packed data
+ * @param[in]   now         Current time
+ */
+static bool should_send(const canbc_slot_t* slot_ptr,
+                        const uint8_t* data,
+                        ULONG now)
+{
+    if (slot_ptr->frame.max_age_ticks == 0 || !slot_ptr->sent_once)
+        return true;
+
+    if (memcmp(data, slot_ptr->sent_data, slot_ptr->frame.length) != 0)
+        return true;
+
+    return (now - slot_ptr->sent_time + slot_ptr->frame.period_ticks
+            > slot_ptr->frame.max_age_ticks);
 }
 
 /**
- * @brief       Locks the broadcast states for editing
+ * @brief       Logs the broadcast statistics since the last report
  *
- * @details     If the CANBC thread or another system service has the lock and
- *              the timeout is reached, NULL is returned.
+ * @details     For each frame, the number of broadcasts sent out of the number
+ *              due, the worst case staleness (longest gap between
+ *              broadcasts) and how late the checks ran after their deadlines
+ *              are logged, followed by the bus load actually used and the load
+ *              if every frame were sent every period
  *
- *              `canbc_unlock_state()` must be called as soon as possible after
- *              editing states.
+ * @param[in]   canbc_h     CANBC handle
+ */
+static void report_stats(canbc_context_t* canbc_h)
+{
+    const ULONG now = tx_time_get();
+    const ULONG elapsed = now - canbc_h->report_time;
+    uint32_t sent_bits = 0;
+    uint32_t periodic_bits = 0;
+
+    for (uint32_t i = 0; i < canbc_h->schedule_len; i++)
+    {
+        canbc_slot_t* slot_ptr = &canbc_h->schedule[i];
+        const canbc_frame_t* frame_ptr = &slot_ptr->frame;
+        const uint32_t bits
+            = canstats_frame_bits(frame_ptr->length, frame_ptr->extended);
+
+        const uint32_t mean_late_us
+            = (slot_ptr->stats.checks > 0)
+                  ? (uint32_t) (((uint64_t) slot_ptr->stats.total_late
+                                 * 1000000)
+                                / ((uint64_t) slot_ptr->stats.checks
+                                   * TX_TIMER_TICKS_PER_SECOND))
+                  : 0;
+
+        LOG_INFO("CANBC 0x%lx (%s): sent %lu of %lu, max gap %lu ms, "
+                 "deferred %lu, dropped %lu\n",
+                 frame_ptr->frame_id,
+                 frame_ptr->owner,
+                 slot_ptr->stats.sent,
+                 slot_ptr->stats.checks,
+                 (slot_ptr->stats.max_gap * 1000) / TX_TIMER_TICKS_PER_SECOND,
+                 slot_ptr->stats.deferred,
+                 slot_ptr->stats.dropped);
+
+        LOG_INFO("CANBC 0x%lx: late mean %lu us, max %lu ms, skipped %lu\n",
+                 frame_ptr->frame_id,
+                 mean_late_us,
+                 (slot_ptr->stats.max_late * 1000) / TX_TIMER_TICKS_PER_SECOND,
+                 slot_ptr->stats.skipped);
+
+        sent_bits += slot_ptr->stats.sent * bits;
+        periodic_bits += slot_ptr->stats.checks * bits;
+        slot_ptr->stats.sent = 0;
+        slot_ptr->stats.checks = 0;
+        slot_ptr->stats.total_late = 0;
+    }
+
+    if (elapsed > 0)
+    {
+        LOG_INFO("CANBC load: %lu bit/s, %lu bit/s if sent every period\n",
+                 (sent_bits * TX_TIMER_TICKS_PER_SECOND) / elapsed,
+                 (periodic_bits * TX_TIMER_TICKS_PER_SECOND) / elapsed);
+    }
+
+    canbc_h->report_time = now;
+}
+
+/**
+ * @brief       Suspends CANBC thread until the next broadcast is due
  *
+ * @details     Sleeps until the earliest absolute deadline, so the wake up
+ *              time doesn't drift however long the last pass took. Sleeps for
+ *              at least a tick, so deferred and catch up frames are retried on
+ *              the next tick.
  *
  * @param[in]   canbc_h     CANBC handle
- * @param[in]   timeout     Timeout in ticks to acquire lock
  */
-canbc_states_t* canbc_lock_state(canbc_context_t* canbc_h, uint32_t timeout)
+static void sleep_till_next_bc(canbc_context_t* canbc_h)
 {
-    UINT tx_status = tx_mutex_get(&canbc_h->state_mutex, timeout);
-    canbc_states_t* ret = NULL;
+    const ULONG now = tx_time_get();
+    LONG sleep_time = TX_TIMER_TICKS_PER_SECOND;
 
-    if (tx_status == TX_SUCCESS)
+    for (uint32_t i = 0; i < canbc_h->schedule_len; i++)
+    {
+        const LONG until_due = (LONG) (canbc_h->schedule[i].next_time - now);
+
+        if (until_due < sleep_time)
+        {
+            sleep_time = until_due;
+        }
+    }
+
+    tx_thread_sleep((sleep_time > 0) ? sleep_time : 1);
+}
+
+/**
+ * @brief       Gets the worst case CAN S bus load of the broadcasts
+ *
+ * @param[in]   canbc_h     CANBC handle
+ *
+ * @return      Bits per second, including worst case bit stuffing
+ */
+uint32_t canbc_get_bus_load(const canbc_context_t* canbc_h)
+{
+    return canbc_h->bus_load_bps;
+}
+
+/**
+ * @brief       Gets the number of broadcasts deferred and dropped by pacing
+ *
+ * @param[in]   canbc_h         CANBC handle
+ * @param[out]  deferred_ptr    Times a frame was held back for a mailbox
+ * @param[out]  dropped_ptr     Times a frame was not sent at all
+ */
+void canbc_get_tx_stats(const canbc_context_t* canbc_h,
+                        uint32_t* deferred_ptr,
+                        uint32_t* dropped_ptr)
+{
+    *deferred_ptr = 0;
+    *dropped_ptr = 0;
+
+    for (uint32_t i = 0; i < canbc_h->schedule_len; i++)
     {
-        ret = &canbc_h->states;
+        *deferred_ptr += canbc_h->schedule[i].stats.deferred;
+        *dropped_ptr += canbc_h->schedule[i].stats.dropped;
     }
+}
+
+/*
+ * packing functions, the source is the copy of the broadcast states and each
+ * frame is in a different struct
+ */
+
+static int pack_state(uint8_t* dst_ptr, const void* src_ptr, size_t size)
+{
+    const canbc_states_t* states_ptr = (const canbc_states_t*) src_ptr;
+
+    return can_s_vcu_state_pack(dst_ptr, &states_ptr->state, size);
+}
+
+static int pack_sensors(uint8_t* dst_ptr, const void* src_ptr, size_t size)
+{
+    const canbc_states_t* states_ptr = (const canbc_states_t*) src_ptr;
+
+    return can_s_vcu_sensors_pack(dst_ptr, &states_ptr->sensors, size);
+}
 
-    return ret;
+static int pack_temps(uint8_t* dst_ptr, const void* src_ptr, size_t size)
+{
+    const canbc_states_t* states_ptr = (const canbc_states_t*) src_ptr;
+
+    return can_s_vcu_temps_pack(dst_ptr, &states_ptr->temps, size);
+}
+
+static int pack_errors(uint8_t* dst_ptr, const void* src_ptr, size_t size)
+{
+    const canbc_states_t* states_ptr = (const canbc_states_t*) src_ptr;
+
+    return can_s_vcu_error_pack(dst_ptr, &states_ptr->errors, size);
+}
+
+static int pack_pdm(uint8_t* dst_ptr, const void* src_ptr, size_t size)
+{
+    const canbc_states_t* states_ptr = (const canbc_states_t*) src_ptr;
+
+    return can_s_vcu_pdm_pack(dst_ptr, &states_ptr->pdm, size);
+}
+
+/**
+ * @brief       Starts editing the broadcast states
+ *
+ * @details     Interrupts are disabled until end_write(), which keeps writers
+ *              from interleaving with each other, so edits must be a handful
+ *              of assignments. The sequence number is odd during the edit so
+ *              the CANBC thread can tell that its copy is inconsistent (see
+ *              read_states()).
+ *
+ * @param[in]   canbc_h     CANBC handle
+ *
+ * @return      Interrupt state to pass to end_write()
+ */
+static UINT begin_write(canbc_context_t* canbc_h)
+{
+    const UINT irq_state = irq_lock();
+
+    atomic_fetch_add_explicit(&canbc_h->states_seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    return irq_state;
 }
 
 /**
- * @brief       Releases CANBC states after editing
+ * @brief       Finishes editing the broadcast states
  *
  * @param[in]   canbc_h     CANBC handle
+ * @param[in]   irq_state   Value returned by begin_write()
+ * @param[in]   msg_idx     Frame containing the edited signal
+ * @param[in]   changed     True if the signal has a new value
  */
-void canbc_unlock_state(canbc_context_t* canbc_h)
+static void end_write(canbc_context_t* canbc_h,
+                      UINT irq_state,
+                      canbc_msg_idx_t msg_idx,
+                      bool changed)
 {
-    tx_mutex_put(&canbc_h->state_mutex);
+    if (changed)
+    {
+        atomic_fetch_or_explicit(&canbc_h->dirty,
+                                 canbc_h->state_msgs[msg_idx],
+                                 memory_order_relaxed);
+    }
+
+    atomic_fetch_add_explicit(&canbc_h->states_seq, 1, memory_order_release);
+    irq_unlock(irq_state);
 }
+
+/**
+ * @brief       Defines a setter for a broadcast signal
+ *
+ * @details     The frame is only marked for packing if the value changes
+ */
+#define CANBC_SETTER(name, msg_idx, signal, type)                              \
+    void canbc_set_##name(canbc_context_t* canbc_h, type value)                \
+    {                                                                          \
+        const UINT irq_state = begin_write(canbc_h);                           \
+        const bool changed = (canbc_h->states.signal != value);                \
+        canbc_h->states.signal = value;                                        \
+        end_write(canbc_h, irq_state, msg_idx, changed);                       \
+    }
+
+CANBC_SETTER(apps, CANBC_MSG_SENSORS, sensors.vcu_apps, uint16_t)
+CANBC_SETTER(bps, CANBC_MSG_SENSORS, sensors.vcu_bps, uint16_t)
+CANBC_SETTER(sagl, CANBC_MSG_SENSORS, sensors.vcu_sagl, int16_t)
+CANBC_SETTER(torque_request,
+             CANBC_MSG_SENSORS,
+             sensors.vcu_torque_request,
+             uint16_t)
+CANBC_SETTER(max_temp, CANBC_MSG_TEMPS, temps.vcu_max_temp, int8_t)
+CANBC_SETTER(ctrl_state, CANBC_MSG_STATE, state.vcu_ctrl_state, uint8_t)
+CANBC_SETTER(drs_active, CANBC_MSG_STATE, state.vcu_drs_active, uint8_t)
+CANBC_SETTER(r2d, CANBC_MSG_STATE, state.vcu_r2_d, uint8_t)
+CANBC_SETTER(ctrl_error, CANBC_MSG_ERRORS, errors.vcu_ctrl_error, uint8_t)
+CANBC_SETTER(brakelight, CANBC_MSG_PDM, pdm.brakelight, uint8_t)
+CANBC_SETTER(inverter, CANBC_MSG_PDM, pdm.inverter, uint8_t)
+CANBC_SETTER(pump, CANBC_MSG_PDM, pdm.pump, uint8_t)
+CANBC_SETTER(fan, CANBC_MSG_PDM, pdm.fan, uint8_t)
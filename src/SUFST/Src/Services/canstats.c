@@ -0,0 +1,566 @@
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_CANSTATS
+
+#include "canstats.h"
+
+#include <string.h>
+
+#include "irq_lock.h"
+#include "log.h"
+
+/*
+ * internal function prototypes
+ */
+static void canstats_thread_entry(ULONG input);
+static canstats_bus_t* find_bus(canstats_context_t* canstats_ptr,
+                                CAN_HandleTypeDef* can_h);
+static void record_frame(canstats_context_t* canstats_ptr,
+                         canstats_bus_t* bus_ptr,
+                         uint32_t id,
+                         uint32_t length);
+static void report(canstats_context_t* canstats_ptr);
+static void report_bus(canstats_context_t* canstats_ptr,
+                       canstats_bus_idx_t bus);
+static void update_broadcasts(canstats_context_t* canstats_ptr);
+
+// bus names for reports
+static const char* bus_names[CANSTATS_NUM_BUSES] = {"C", "S"};
+
+/**
+ * @brief       Initialises the CAN statistics service
+ *
+ * @details     Must be called before the CAN interrupts are enabled
+ *
+ * @param[in]   canstats_ptr    CAN statistics context
+ * @param[in]   can_c_h         Critical systems CAN bus handle
+ * @param[in]   can_s_h         Sensor CAN bus handle
+ * @param[in]   stack_pool_ptr  Application memory pool
+ * @param[in]   config_ptr      Configuration
+ */
+status_t canstats_init(canstats_context_t* canstats_ptr,
+                       CAN_HandleTypeDef* can_c_h,
+                       CAN_HandleTypeDef* can_s_h,
+                       TX_BYTE_POOL* stack_pool_ptr,
+                       const config_canstats_t* config_ptr)
+{
+    CAN_HandleTypeDef* can_handles[] = {can_c_h, can_s_h};
+
+    memset(canstats_ptr->buses, 0, sizeof(canstats_ptr->buses));
+    canstats_ptr->canbc_ptr = NULL;
+    canstats_ptr->config_ptr = config_ptr;
+
+    for (uint32_t i = 0; i < CANSTATS_NUM_BUSES; i++)
+    {
+        canstats_bus_t* bus_ptr = &canstats_ptr->buses[i];
+
+        bus_ptr->can_h = can_handles[i];
+        bus_ptr->bitrate = canstats_get_bitrate(can_handles[i]);
+
+        LOG_INFO("CAN %s bit rate: %lu bit/s\n",
+                 bus_names[i],
+                 bus_ptr->bitrate);
+    }
+
+    if (config_ptr->window_ticks < CANSTATS_WINDOW_BUCKETS)
+        return STATUS_ERROR;
+
+    // create service thread
+    void* stack_ptr = NULL;
+    UINT tx_status = tx_byte_allocate(stack_pool_ptr,
+                                      &stack_ptr,
+                                      config_ptr->thread.stack_size,
+                                      TX_NO_WAIT);
+
+    if (tx_status == TX_SUCCESS)
+    {
+        tx_status = tx_thread_create(&canstats_ptr->thread,
+                                     (CHAR*) config_ptr->thread.name,
+                                     canstats_thread_entry,
+                                     (ULONG) canstats_ptr,
+                                     stack_ptr,
+                                     config_ptr->thread.stack_size,
+                                     config_ptr->thread.priority,
+                                     config_ptr->thread.priority,
+                                     TX_NO_TIME_SLICE,
+                                     TX_AUTO_START);
+    }
+
+    return (tx_status == TX_SUCCESS) ? STATUS_OK : STATUS_ERROR;
+}
+
+/**
+ * @brief       Registers the load broadcasts with the CANBC service
+ *
+ * @details     Statistics are counted from before the CAN interrupts are
+ *              enabled, which is before CANBC exists, so the frames are
+ *              registered separately. A zero broadcast period disables them.
+ *
+ * @param[in]   canstats_ptr    CAN statistics context
+ * @param[in]   canbc_ptr       CANBC context
+ */
+status_t canstats_attach_canbc(canstats_context_t* canstats_ptr,
+                               canbc_context_t* canbc_ptr)
+{
+    const config_canstats_t* config_ptr = canstats_ptr->config_ptr;
+
+    if (config_ptr->broadcast_period_ticks == 0)
+        return STATUS_OK;
+
+    for (uint32_t i = 0; i < CANSTATS_NUM_BUSES; i++)
+    {
+        canstats_bus_t* bus_ptr = &canstats_ptr->buses[i];
+        const canbc_frame_t frame
+            = {.owner = "CANSTATS",
+               .frame_id = config_ptr->can_id + i,
+               .length = CANSTATS_BROADCAST_LENGTH,
+               .extended = false,
+               .pack = canbc_pack_raw,
+               .src_ptr = bus_ptr->bc_data,
+               .period_ticks = config_ptr->broadcast_period_ticks,
+               .phase_ticks = config_ptr->broadcast_phase_ticks + i,
+               .max_age_ticks = 0,
+               .catch_up = false,
+               .tracked = true};
+
+        if (canbc_register(canbc_ptr, &frame, &bus_ptr->bc_handle)
+            != STATUS_OK)
+        {
+            return STATUS_ERROR;
+        }
+    }
+
+    canstats_ptr->canbc_ptr = canbc_ptr;
+
+    return STATUS_OK;
+}
+
+/**
+ * @brief       CAN statistics service thread
+ *
+ * @details     Updates the broadcasts every bucket and logs the statistics
+ *              when due
+ *
+ * @param[in]   input   CAN statistics context
+ */
+static void canstats_thread_entry(ULONG input)
+{
+    canstats_context_t* canstats_ptr = (canstats_context_t*) input;
+    const config_canstats_t* config_ptr = canstats_ptr->config_ptr;
+
+    ULONG report_time = tx_time_get();
+
+    while (1)
+    {
+        tx_thread_sleep(config_ptr->window_ticks / CANSTATS_WINDOW_BUCKETS);
+
+        const ULONG now = tx_time_get();
+
+        // sample the load every bucket so that the peak is not missed
+        update_broadcasts(canstats_ptr);
+
+        if (config_ptr->report_period_ticks != 0
+            && now - report_time >= config_ptr->report_period_ticks)
+        {
+            report_time = now;
+            report(canstats_ptr);
+        }
+    }
+}
+
+/**
+ * @brief       Records a received frame
+ *
+ * @details     Called from the RX FIFO pending interrupt, before the frame is
+ *              read out of the FIFO. The identifier and length are read
+ *              directly from the FIFO output mailbox, so the frame is left
+ *              for RTCAN.
+ *
+ * @param[in]   canstats_ptr    CAN statistics context
+ * @param[in]   can_h           CAN handle from the callback
+ * @param[in]   rx_fifo         RX FIFO number
+ */
+void canstats_record_rx(canstats_context_t* canstats_ptr,
+                        CAN_HandleTypeDef* can_h,
+                        uint32_t rx_fifo)
+{
+    canstats_bus_t* bus_ptr = find_bus(canstats_ptr, can_h);
+
+    if (bus_ptr == NULL || rx_fifo > 1)
+        return;
+
+    const uint32_t rir = can_h->Instance->sFIFOMailBox[rx_fifo].RIR;
+    const uint32_t rdtr = can_h->Instance->sFIFOMailBox[rx_fifo].RDTR;
+
+    const uint32_t id
+        = ((rir & CAN_RI0R_IDE) != 0)
+              ? ((rir & (CAN_RI0R_EXID | CAN_RI0R_STID)) >> CAN_RI0R_EXID_Pos)
+                    | CANSTATS_ID_EXTENDED
+              : (rir & CAN_RI0R_STID) >> CAN_RI0R_STID_Pos;
+
+    record_frame(canstats_ptr,
+                 bus_ptr,
+                 id,
+                 (rdtr & CAN_RDT0R_DLC) >> CAN_RDT0R_DLC_Pos);
+}
+
+/**
+ * @brief       Records a transmitted frame
+ *
+ * @details     Called from the TX mailbox complete interrupt. The mailbox
+ *              registers still hold the identifier and length of the frame.
+ *
+ * @param[in]   canstats_ptr    CAN statistics context
+ * @param[in]   can_h           CAN handle from the callback
+ * @param[in]   mailbox         TX mailbox number
+ */
+void canstats_record_tx(canstats_context_t* canstats_ptr,
+                        CAN_HandleTypeDef* can_h,
+                        uint32_t mailbox)
+{
+    canstats_bus_t* bus_ptr = find_bus(canstats_ptr, can_h);
+
+    if (bus_ptr == NULL || mailbox > 2)
+        return;
+
+    const uint32_t tir = can_h->Instance->sTxMailBox[mailbox].TIR;
+    const uint32_t tdtr = can_h->Instance->sTxMailBox[mailbox].TDTR;
+
+    const uint32_t id
+        = ((tir & CAN_TI0R_IDE) != 0)
+              ? ((tir & (CAN_TI0R_EXID | CAN_TI0R_STID)) >> CAN_TI0R_EXID_Pos)
+                    | CANSTATS_ID_EXTENDED
+              : (tir & CAN_TI0R_STID) >> CAN_TI0R_STID_Pos;
+
+    record_frame(canstats_ptr,
+                 bus_ptr,
+                 id,
+                 (tdtr & CAN_TDT0R_DLC) >> CAN_TDT0R_DLC_Pos);
+}
+
+/**
+ * @brief       Gets the load of a bus over the sliding window
+ *
+ * @details     The bucket being filled is not included, so the window covers
+ *              the last window_ticks up to the start of the current bucket.
+ *              Also updates the peak load.
+ *
+ * @param[in]   canstats_ptr        CAN statistics context
+ * @param[in]   bus                 Bus
+ * @param[out]  frames_per_sec_ptr  Frames per second, may be NULL
+ *
+ * @return      Load in 0.1 % of the bit rate
+ */
+uint32_t canstats_get_load(canstats_context_t* canstats_ptr,
+                           canstats_bus_idx_t bus,
+                           uint32_t* frames_per_sec_ptr)
+{
+    canstats_bus_t* bus_ptr = &canstats_ptr->buses[bus];
+    const ULONG window_ticks = canstats_ptr->config_ptr->window_ticks;
+    const ULONG bucket_ticks = window_ticks / CANSTATS_WINDOW_BUCKETS;
+    const ULONG epoch = tx_time_get() / bucket_ticks;
+
+    uint32_t bits = 0;
+    uint32_t frames = 0;
+
+    UINT irq_state = irq_lock();
+
+    for (uint32_t i = 0; i < CANSTATS_WINDOW_BUCKETS + 1; i++)
+    {
+        const canstats_bucket_t* bucket_ptr = &bus_ptr->window[i];
+
+        if (bucket_ptr->epoch != epoch
+            && epoch - bucket_ptr->epoch <= CANSTATS_WINDOW_BUCKETS)
+        {
+            bits += bucket_ptr->bits;
+            frames += bucket_ptr->frames;
+        }
+    }
+
+    irq_unlock(irq_state);
+
+    const ULONG window = bucket_ticks * CANSTATS_WINDOW_BUCKETS;
+
+    if (frames_per_sec_ptr != NULL)
+    {
+        *frames_per_sec_ptr = (frames * TX_TIMER_TICKS_PER_SECOND) / window;
+    }
+
+    if (bus_ptr->bitrate == 0)
+        return 0;
+
+    const uint32_t load
+        = (uint32_t) (((uint64_t) bits * TX_TIMER_TICKS_PER_SECOND * 1000)
+                      / ((uint64_t) window * bus_ptr->bitrate));
+
+    if (load > bus_ptr->peak_load)
+    {
+        bus_ptr->peak_load = load;
+    }
+
+    return load;
+}
+
+/**
+ * @brief       Gets the worst case length of a CAN frame on the bus
+ *
+ * @details     Includes stuff bits and the 3 bit interframe space
+ *
+ * @param[in]   length      Data length in bytes
+ * @param[in]   extended    Extended ID
+ */
+uint32_t canstats_frame_bits(uint32_t length, bool extended)
+{
+    // bits which are subject to stuffing
+    const uint32_t stuffed = (extended ? 54 : 34) + 8 * length;
+
+    // end of frame, delimiters and interframe space are not stuffed
+    return stuffed + (stuffed - 1) / 4 + 13;
+}
+
+/**
+ * @brief       Finds the statistics of the bus a CAN handle belongs to
+ *
+ * @param[in]   canstats_ptr    CAN statistics context
+ * @param[in]   can_h           CAN handle
+ *
+ * @return      Bus statistics, or NULL if the handle isn't known
+ */
+static canstats_bus_t* find_bus(canstats_context_t* canstats_ptr,
+                                CAN_HandleTypeDef* can_h)
+{
+    for (uint32_t i = 0; i < CANSTATS_NUM_BUSES; i++)
+    {
+        if (canstats_ptr->buses[i].can_h == can_h)
+            return &canstats_ptr->buses[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief       Adds a frame to the statistics of a bus
+ *
+ * @details     Called from interrupts. The identifier table is a hash table
+ *              with linear probing, identifiers are never removed.
+ *
+ * @param[in]   canstats_ptr    CAN statistics context
+ * @param[in]   bus_ptr         Bus statistics
+ * @param[in]   id              Identifier, with CANSTATS_ID_EXTENDED if needed
+ * @param[in]   length          Data length code
+ */
+static void record_frame(canstats_context_t* canstats_ptr,
+                         canstats_bus_t* bus_ptr,
+                         uint32_t id,
+                         uint32_t length)
+{
+    const ULONG bucket_ticks
+        = canstats_ptr->config_ptr->window_ticks / CANSTATS_WINDOW_BUCKETS;
+    const ULONG epoch = tx_time_get() / bucket_ticks;
+    const uint32_t bits = canstats_frame_bits((length > 8) ? 8 : length,
+                                              (id & CANSTATS_ID_EXTENDED) != 0);
+
+    // identifier zero is valid, so the table stores id + 1
+    const uint32_t key = id + 1;
+
+    UINT irq_state = irq_lock();
+
+    // sliding window, starting the bucket afresh if it is from an old epoch
+    canstats_bucket_t* bucket_ptr
+        = &bus_ptr->window[epoch % (CANSTATS_WINDOW_BUCKETS + 1)];
+
+    if (bucket_ptr->epoch != epoch)
+    {
+        bucket_ptr->epoch = epoch;
+        bucket_ptr->bits = 0;
+        bucket_ptr->frames = 0;
+    }
+
+    bucket_ptr->bits += bits;
+    bucket_ptr->frames++;
+
+    // per identifier
+    canstats_id_t* entry_ptr = NULL;
+
+    for (uint32_t i = 0; i < CANSTATS_MAX_IDS; i++)
+    {
+        canstats_id_t* probe_ptr
+            = &bus_ptr->ids[(key + i) & (CANSTATS_MAX_IDS - 1)];
+
+        if (probe_ptr->id == key || probe_ptr->id == 0)
+        {
+            probe_ptr->id = key;
+            entry_ptr = probe_ptr;
+            break;
+        }
+    }
+
+    if (entry_ptr != NULL)
+    {
+        entry_ptr->bits += bits;
+        entry_ptr->frames++;
+    }
+    else
+    {
+        bus_ptr->other_bits += bits;
+        bus_ptr->other_frames++;
+    }
+
+    irq_unlock(irq_state);
+}
+
+/**
+ * @brief       Logs the statistics of every bus
+ *
+ * @param[in]   canstats_ptr    CAN statistics context
+ */
+static void report(canstats_context_t* canstats_ptr)
+{
+    for (uint32_t i = 0; i < CANSTATS_NUM_BUSES; i++)
+    {
+        report_bus(canstats_ptr, i);
+    }
+}
+
+/**
+ * @brief       Logs the load of a bus and the busiest identifiers since the
+ *              last report, then starts counting afresh
+ *
+ * @param[in]   canstats_ptr    CAN statistics context
+ * @param[in]   bus             Bus
+ */
+static void report_bus(canstats_context_t* canstats_ptr,
+                       canstats_bus_idx_t bus)
+{
+    canstats_bus_t* bus_ptr = &canstats_ptr->buses[bus];
+    uint32_t frames_per_sec;
+    const uint32_t load = canstats_get_load(canstats_ptr, bus, &frames_per_sec);
+
+    LOG_INFO("CAN %s load: %lu.%lu%% (peak %lu.%lu%%), %lu frames/s\n",
+             bus_names[bus],
+             load / 10,
+             load % 10,
+             bus_ptr->peak_load / 10,
+             bus_ptr->peak_load % 10,
+             frames_per_sec);
+
+    // take a copy so the interrupts can carry on counting
+    canstats_id_t ids[CANSTATS_MAX_IDS];
+    uint32_t total_bits;
+
+    UINT irq_state = irq_lock();
+
+    memcpy(ids, bus_ptr->ids, sizeof(ids));
+    total_bits = bus_ptr->other_bits;
+
+    for (uint32_t i = 0; i < CANSTATS_MAX_IDS; i++)
+    {
+        bus_ptr->ids[i].frames = 0;
+        bus_ptr->ids[i].bits = 0;
+    }
+
+    bus_ptr->other_frames = 0;
+    bus_ptr->other_bits = 0;
+
+    irq_unlock(irq_state);
+
+    for (uint32_t i = 0; i < CANSTATS_MAX_IDS; i++)
+    {
+        total_bits += ids[i].bits;
+    }
+
+    if (total_bits == 0)
+        return;
+
+    // busiest identifiers, by bits
+    for (uint32_t n = 0; n < canstats_ptr->config_ptr->report_top_ids; n++)
+    {
+        canstats_id_t* top_ptr = NULL;
+
+        for (uint32_t i = 0; i < CANSTATS_MAX_IDS; i++)
+        {
+            if (ids[i].bits > 0
+                && (top_ptr == NULL || ids[i].bits > top_ptr->bits))
+            {
+                top_ptr = &ids[i];
+            }
+        }
+
+        if (top_ptr == NULL)
+            break;
+
+        const uint32_t id = top_ptr->id - 1;
+
+        LOG_INFO("CAN %s 0x%lx%s: %lu frames, %lu%% of bits\n",
+                 bus_names[bus],
+                 id & ~CANSTATS_ID_EXTENDED,
+                 ((id & CANSTATS_ID_EXTENDED) != 0) ? " (ext)" : "",
+                 top_ptr->frames,
+                 (uint32_t) (((uint64_t) top_ptr->bits * 100) / total_bits));
+
+        top_ptr->bits = 0;
+    }
+}
+
+/**
+ * @brief       Samples the load of each bus and updates its broadcast
+ *
+ * @details     Each bus has its own frame, laid out as 16 bit little endian
+ *              fields (not in the DBC):
+ *
+ *          | load (16) | peak load (16) | frames per second (16) |
+ *          | untracked frames (16) |
+ *
+ *          at can_id for CAN C and can_id + 1 for CAN S, where loads are in
+ *          0.1 % and the untracked frame count (IDs which didn't fit in the
+ *          table) wraps. The CANBC service sends them at the broadcast
+ *          period.
+ *
+ * @param[in]   canstats_ptr    CAN statistics context
+ */
+static void update_broadcasts(canstats_context_t* canstats_ptr)
+{
+    for (uint32_t i = 0; i < CANSTATS_NUM_BUSES; i++)
+    {
+        canstats_bus_t* bus_ptr = &canstats_ptr->buses[i];
+        uint32_t frames_per_sec;
+        const uint32_t load
+            = canstats_get_load(canstats_ptr, i, &frames_per_sec);
+
+        uint8_t data[CANSTATS_BROADCAST_LENGTH];
+
+        canbc_put_u16(&data[0], load);
+        canbc_put_u16(&data[2], bus_ptr->peak_load);
+        canbc_put_u16(&data[4], frames_per_sec);
+        canbc_put_u16(&data[6], bus_ptr->other_frames);
+
+        if (canstats_ptr->canbc_ptr != NULL)
+        {
+            canbc_set_raw(canstats_ptr->canbc_ptr,
+                          bus_ptr->bc_handle,
+                          bus_ptr->bc_data,
+                          data,
+                          sizeof(data));
+        }
+    }
+}
+
+/**
+ * @brief       Works out the bit rate of a CAN peripheral from its bit timing
+ *
+ * @details     Uses the prescaler and time segments set up in can.c, one bit
+ *              is the sync segment plus both time segments
+ *
+ * @param[in]   can_h   CAN handle
+ *
+ * @return      Bits per second
+ */
+uint32_t canstats_get_bitrate(const CAN_HandleTypeDef* can_h)
+{
+    const uint32_t tq_per_bit
+        = 1 + ((can_h->Init.TimeSeg1 >> CAN_BTR_TS1_Pos) + 1)
+          + ((can_h->Init.TimeSeg2 >> CAN_BTR_TS2_Pos) + 1);
+
+    if (can_h->Init.Prescaler == 0)
+        return 0;
+
+    return HAL_RCC_GetPCLK1Freq() / (can_h->Init.Prescaler * tq_per_bit);
+}
@@ -0,0 +1,429 @@
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_CAPTURE
+
+#include "capture.h"
+
+#include "log.h"
+
+// command frame byte 0 to trigger a capture
+#define CAPTURE_CMD_TRIGGER 0x01
+
+// largest value of the 12 bit sample signals
+#define CAPTURE_SIGNAL_MAX 0xFFF
+
+/*
+ * internal function prototypes
+ */
+static void capture_thread_entry(ULONG input);
+static void handle_command(capture_context_t* capture_ptr,
+                           const rtcan_msg_t* msg_ptr);
+static void drain(capture_context_t* capture_ptr);
+static ULONG drain_wait_ticks(const capture_context_t* capture_ptr);
+static void pack_header(const capture_context_t* capture_ptr,
+                        rtcan_msg_t* msg_ptr);
+static void pack_sample(const capture_context_t* capture_ptr,
+                        uint32_t idx,
+                        rtcan_msg_t* msg_ptr);
+static uint32_t clamp_signal(uint32_t value);
+
+// trigger names for logging
+static const char* trigger_names[] = {"none", "command", "fault"};
+
+/**
+ * @brief       Initialises the burst capture service
+ *
+ * @param[in]   capture_ptr     Capture context
+ * @param[in]   rtcan_s_ptr     RTCAN instance for CAN S
+ * @param[in]   stack_pool_ptr  Application memory pool
+ * @param[in]   config_ptr      Configuration
+ */
+status_t capture_init(capture_context_t* capture_ptr,
+                      rtcan_handle_t* rtcan_s_ptr,
+                      TX_BYTE_POOL* stack_pool_ptr,
+                      const config_capture_t* config_ptr)
+{
+    capture_ptr->rtcan_s_ptr = rtcan_s_ptr;
+    capture_ptr->config_ptr = config_ptr;
+    capture_ptr->head = 0;
+    capture_ptr->filled = 0;
+    capture_ptr->remaining = 0;
+    capture_ptr->source = CAPTURE_TRIGGER_NONE;
+    capture_ptr->count = 0;
+    capture_ptr->drain_pos = 0;
+    capture_ptr->credit
+        = config_ptr->drain_burst_frames * TX_TIMER_TICKS_PER_SECOND;
+    capture_ptr->credit_time = 0;
+    atomic_init(&capture_ptr->state, CAPTURE_STATE_IDLE);
+    atomic_init(&capture_ptr->trigger, CAPTURE_TRIGGER_NONE);
+
+    // the whole capture must fit in the ring
+    if (config_ptr->post_trigger_samples == 0
+        || config_ptr->pre_trigger_samples + config_ptr->post_trigger_samples
+               > CAPTURE_MAX_SAMPLES
+        || config_ptr->drain_frames_per_sec == 0
+        || config_ptr->drain_burst_frames == 0)
+    {
+        LOG_ERROR("Invalid capture config\n");
+        return STATUS_ERROR;
+    }
+
+    // create service thread
+    void* stack_ptr = NULL;
+    UINT tx_status = tx_byte_allocate(stack_pool_ptr,
+                                      &stack_ptr,
+                                      config_ptr->thread.stack_size,
+                                      TX_NO_WAIT);
+
+    if (tx_status == TX_SUCCESS)
+    {
+        tx_status = tx_thread_create(&capture_ptr->thread,
+                                     (CHAR*) config_ptr->thread.name,
+                                     capture_thread_entry,
+                                     (ULONG) capture_ptr,
+                                     stack_ptr,
+                                     config_ptr->thread.stack_size,
+                                     config_ptr->thread.priority,
+                                     config_ptr->thread.priority,
+                                     TX_NO_TIME_SLICE,
+                                     TX_AUTO_START);
+    }
+
+    // create command queue
+    if (tx_status == TX_SUCCESS)
+    {
+        tx_status = tx_queue_create(&capture_ptr->rx_queue,
+                                    NULL,
+                                    TX_1_ULONG,
+                                    capture_ptr->rx_queue_mem,
+                                    sizeof(capture_ptr->rx_queue_mem));
+    }
+
+    return (tx_status == TX_SUCCESS) ? STATUS_OK : STATUS_ERROR;
+}
+
+/**
+ * @brief       Capture service thread
+ *
+ * @details     Waits for command frames, and sends the capture once it has
+ *              been recorded
+ *
+ * @param[in]   input   Capture context
+ */
+static void capture_thread_entry(ULONG input)
+{
+    capture_context_t* capture_ptr = (capture_context_t*) input;
+    const config_capture_t* config_ptr = capture_ptr->config_ptr;
+
+    // fault triggers still work without commands
+    if (rtcan_subscribe(capture_ptr->rtcan_s_ptr,
+                        config_ptr->command_can_id,
+                        &capture_ptr->rx_queue)
+        != RTCAN_OK)
+    {
+        LOG_ERROR("Failed to subscribe to capture commands\n");
+    }
+
+    while (1)
+    {
+        ULONG wait_ticks = config_ptr->idle_poll_ticks;
+
+        if (atomic_load_explicit(&capture_ptr->state, memory_order_acquire)
+            == CAPTURE_STATE_DRAINING)
+        {
+            drain(capture_ptr);
+            wait_ticks = drain_wait_ticks(capture_ptr);
+        }
+
+        rtcan_msg_t* msg_ptr = NULL;
+
+        if (tx_queue_receive(&capture_ptr->rx_queue, &msg_ptr, wait_ticks)
+                == TX_SUCCESS
+            && msg_ptr != NULL)
+        {
+            handle_command(capture_ptr, msg_ptr);
+            rtcan_msg_consumed(capture_ptr->rtcan_s_ptr, msg_ptr);
+        }
+    }
+}
+
+/**
+ * @brief       Takes a sample of the captured signals
+ *
+ * @details     Called by the control loop every cycle, so samples are taken at
+ *              the control rate. Only one thread may take samples. Samples
+ *              are not taken while a capture is being sent.
+ *
+ * @param[in]   capture_ptr     Capture context
+ * @param[in]   sample_ptr      Sample
+ */
+void capture_sample(capture_context_t* capture_ptr,
+                    const capture_sample_t* sample_ptr)
+{
+    const config_capture_t* config_ptr = capture_ptr->config_ptr;
+    uint32_t state
+        = atomic_load_explicit(&capture_ptr->state, memory_order_acquire);
+
+    if (state == CAPTURE_STATE_DRAINING)
+        return;
+
+    // start recording, keeping the latest samples from before the trigger
+    if (state == CAPTURE_STATE_IDLE)
+    {
+        const uint32_t source
+            = atomic_exchange(&capture_ptr->trigger, CAPTURE_TRIGGER_NONE);
+
+        if (source != CAPTURE_TRIGGER_NONE)
+        {
+            capture_ptr->source = source;
+            capture_ptr->trigger_pos = capture_ptr->head;
+            capture_ptr->trigger_time = tx_time_get();
+            capture_ptr->remaining = config_ptr->post_trigger_samples;
+            capture_ptr->pre_samples
+                = (capture_ptr->filled < config_ptr->pre_trigger_samples)
+                      ? capture_ptr->filled
+                      : config_ptr->pre_trigger_samples;
+
+            state = CAPTURE_STATE_RECORDING;
+            atomic_store_explicit(&capture_ptr->state,
+                                  state,
+                                  memory_order_relaxed);
+        }
+    }
+
+    capture_ptr->ring[capture_ptr->head & (CAPTURE_MAX_SAMPLES - 1)]
+        = *sample_ptr;
+    capture_ptr->head++;
+
+    if (capture_ptr->filled < CAPTURE_MAX_SAMPLES)
+    {
+        capture_ptr->filled++;
+    }
+
+    // hand the capture over to the service thread
+    if (state == CAPTURE_STATE_RECORDING && --capture_ptr->remaining == 0)
+    {
+        capture_ptr->end_time = tx_time_get();
+        atomic_store_explicit(&capture_ptr->state,
+                              CAPTURE_STATE_DRAINING,
+                              memory_order_release);
+    }
+}
+
+/**
+ * @brief       Triggers a capture
+ *
+ * @details     Safe to call from any thread. Recording starts at the next
+ *              sample. Ignored while a capture is being recorded or sent.
+ *
+ * @param[in]   capture_ptr     Capture context
+ * @param[in]   source          What triggered the capture
+ */
+void capture_trigger(capture_context_t* capture_ptr, capture_trigger_t source)
+{
+    uint32_t expected = CAPTURE_TRIGGER_NONE;
+
+    if (atomic_load(&capture_ptr->state) == CAPTURE_STATE_IDLE)
+    {
+        atomic_compare_exchange_strong(&capture_ptr->trigger,
+                                       &expected,
+                                       source);
+    }
+}
+
+/**
+ * @brief       Handles a command frame
+ *
+ * @param[in]   capture_ptr     Capture context
+ * @param[in]   msg_ptr         Command frame
+ */
+static void handle_command(capture_context_t* capture_ptr,
+                           const rtcan_msg_t* msg_ptr)
+{
+    if (msg_ptr->length >= 1 && msg_ptr->data[0] == CAPTURE_CMD_TRIGGER)
+    {
+        LOG_INFO("Capture triggered by command\n");
+        capture_trigger(capture_ptr, CAPTURE_TRIGGER_COMMAND);
+    }
+}
+
+/**
+ * @brief       Sends the capture on CAN S within the bandwidth cap
+ *
+ * @details     A header frame is sent first, followed by one frame for each
+ *              sample in order. The cap is a token bucket, credit builds up
+ *              at drain_frames_per_sec to at most drain_burst_frames and each
+ *              frame uses up one. Sampling starts again once every frame has
+ *              been sent.
+ *
+ * @param[in]   capture_ptr     Capture context
+ */
+static void drain(capture_context_t* capture_ptr)
+{
+    const config_capture_t* config_ptr = capture_ptr->config_ptr;
+    const uint32_t rate = config_ptr->drain_frames_per_sec;
+    const uint32_t max_credit
+        = config_ptr->drain_burst_frames * TX_TIMER_TICKS_PER_SECOND;
+    const uint32_t total = 1 + capture_ptr->pre_samples
+                           + config_ptr->post_trigger_samples;
+
+    if (capture_ptr->drain_pos == 0)
+    {
+        LOG_INFO("Capture %u (%s) recorded, sending %lu samples\n",
+                 capture_ptr->count,
+                 trigger_names[capture_ptr->source],
+                 total - 1);
+    }
+
+    // build up credit for the time since the last update
+    const ULONG now = tx_time_get();
+    const ULONG elapsed = now - capture_ptr->credit_time;
+    capture_ptr->credit_time = now;
+
+    if (elapsed >= (max_credit - capture_ptr->credit) / rate)
+    {
+        capture_ptr->credit = max_credit;
+    }
+    else
+    {
+        capture_ptr->credit += elapsed * rate;
+    }
+
+    // send as many frames as there is credit for
+    while (capture_ptr->drain_pos < total
+           && capture_ptr->credit >= TX_TIMER_TICKS_PER_SECOND)
+    {
+        rtcan_msg_t msg = {.length = 8, .extended = false};
+
+        if (capture_ptr->drain_pos == 0)
+        {
+            pack_header(capture_ptr, &msg);
+        }
+        else
+        {
+            pack_sample(capture_ptr, capture_ptr->drain_pos - 1, &msg);
+        }
+
+        // try again later if RTCAN can't take the frame
+        if (rtcan_transmit(capture_ptr->rtcan_s_ptr, &msg) != RTCAN_OK)
+            break;
+
+        capture_ptr->credit -= TX_TIMER_TICKS_PER_SECOND;
+        capture_ptr->drain_pos++;
+    }
+
+    // start sampling again, dropping triggers from during the capture
+    if (capture_ptr->drain_pos == total)
+    {
+        LOG_INFO("Capture %u sent\n", capture_ptr->count);
+
+        capture_ptr->count++;
+        capture_ptr->drain_pos = 0;
+        capture_ptr->filled = 0;
+        atomic_store(&capture_ptr->trigger, CAPTURE_TRIGGER_NONE);
+        atomic_store_explicit(&capture_ptr->state,
+                              CAPTURE_STATE_IDLE,
+                              memory_order_release);
+    }
+}
+
+/**
+ * @brief       Gets how long to wait before sending more of the capture
+ *
+ * @param[in]   capture_ptr     Capture context
+ *
+ * @return      Ticks until there is credit for the next frame
+ */
+static ULONG drain_wait_ticks(const capture_context_t* capture_ptr)
+{
+    const uint32_t rate = capture_ptr->config_ptr->drain_frames_per_sec;
+
+    if (atomic_load(&capture_ptr->state) != CAPTURE_STATE_DRAINING)
+        return capture_ptr->config_ptr->idle_poll_ticks;
+
+    if (capture_ptr->credit >= TX_TIMER_TICKS_PER_SECOND)
+        return 1;
+
+    return (TX_TIMER_TICKS_PER_SECOND - capture_ptr->credit + rate - 1) / rate;
+}
+
+/**
+ * @brief       Packs the capture header frame
+ *
+ * @details     The frame is not in the DBC, the layout is (little endian):
+ *
+ *          | trigger (8) | capture number (8) | samples (16) |
+ *          | samples before trigger (16) | recording time (16) |
+ *
+ *          at can_id, where the recording time is in ms from the first to
+ *          the last sample after the trigger
+ *
+ * @param[in]   capture_ptr     Capture context
+ * @param[out]  msg_ptr         Frame
+ */
+static void pack_header(const capture_context_t* capture_ptr,
+                        rtcan_msg_t* msg_ptr)
+{
+    const uint32_t samples = capture_ptr->pre_samples
+                             + capture_ptr->config_ptr->post_trigger_samples;
+    const uint32_t time_ms
+        = ((capture_ptr->end_time - capture_ptr->trigger_time) * 1000)
+          / TX_TIMER_TICKS_PER_SECOND;
+
+    msg_ptr->identifier = capture_ptr->config_ptr->can_id;
+    msg_ptr->data[0] = capture_ptr->source;
+    msg_ptr->data[1] = capture_ptr->count;
+    msg_ptr->data[2] = samples & 0xFF;
+    msg_ptr->data[3] = (samples >> 8) & 0xFF;
+    msg_ptr->data[4] = capture_ptr->pre_samples & 0xFF;
+    msg_ptr->data[5] = (capture_ptr->pre_samples >> 8) & 0xFF;
+    msg_ptr->data[6] = time_ms & 0xFF;
+    msg_ptr->data[7] = (time_ms >> 8) & 0xFF;
+}
+
+/**
+ * @brief       Packs a sample frame
+ *
+ * @details     The frame is not in the DBC, the layout is (little endian):
+ *
+ *          | sample number (12) | APPS (12) | BPS (12) |
+ *          | torque request (12) | motor speed (16, signed) |
+ *
+ *          at can_id + 1, where the sample number counts from the oldest
+ *          sample and wraps. APPS, BPS and torque request saturate.
+ *
+ * @param[in]   capture_ptr     Capture context
+ * @param[in]   idx             Sample number in the capture
+ * @param[out]  msg_ptr         Frame
+ */
+static void pack_sample(const capture_context_t* capture_ptr,
+                        uint32_t idx,
+                        rtcan_msg_t* msg_ptr)
+{
+    const uint32_t pos = capture_ptr->trigger_pos - capture_ptr->pre_samples
+                         + idx;
+    const capture_sample_t* sample_ptr
+        = &capture_ptr->ring[pos & (CAPTURE_MAX_SAMPLES - 1)];
+
+    const uint64_t bits
+        = (uint64_t) (idx & CAPTURE_SIGNAL_MAX)
+          | ((uint64_t) clamp_signal(sample_ptr->apps) << 12)
+          | ((uint64_t) clamp_signal(sample_ptr->bps) << 24)
+          | ((uint64_t) clamp_signal(sample_ptr->torque_request) << 36)
+          | ((uint64_t) (uint16_t) sample_ptr->motor_speed << 48);
+
+    msg_ptr->identifier = capture_ptr->config_ptr->can_id + 1;
+
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        msg_ptr->data[i] = (bits >> (8 * i)) & 0xFF;
+    }
+}
+
+/**
+ * @brief       Saturates a value to the 12 bits of a sample signal
+ *
+ * @param[in]   value   Value
+ */
+static uint32_t clamp_signal(uint32_t value)
+{
+    return (value > CAPTURE_SIGNAL_MAX) ? CAPTURE_SIGNAL_MAX : value;
+}
@@ -5,6 +5,8 @@
  * @brief  Driver control
  ****************************************************************************/
 
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_CTRL
+
 #include "ctrl.h"
 
 #include <stdbool.h>
@@ -18,6 +20,7 @@
 void ctrl_thread_entry(ULONG input);
 void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr);
 void ctrl_update_canbc_states(ctrl_context_t* ctrl_ptr);
+void ctrl_capture_sample(ctrl_context_t* ctrl_ptr);
 void ctrl_handle_ts_fault(ctrl_context_t* ctrl_ptr);
 status_t ctrl_get_apps_reading(tick_context_t* tick_ptr,
                                remote_ctrl_context_t* remote_ctrl_ptr,
@@ -34,6 +37,8 @@ bool ctrl_fan_passed_off_threshold(ctrl_context_t* ctrl_ptr);
  * @param[in]   ctrl_ptr                Control context
  * @param[in]   dash_ptr                Dash context
  * @param[in]   canbc_ptr               CANBC context
+ * @param[in]   capture_ptr             Burst capture context
+ * @param[in]   xcp_ptr                 XCP context, may be NULL
  * @param[in]   pm100_ptr               PM100 context
  * @param[in]   stack_pool_ptr          Byte pool to allocate thread stack from
  * @param[in]   config_ptr              Configuration
@@ -48,6 +53,8 @@ status_t ctrl_init(ctrl_context_t* ctrl_ptr,
                    tick_context_t* tick_ptr,
                    remote_ctrl_context_t* remote_ctrl_ptr,
                    canbc_context_t* canbc_ptr,
+                   capture_context_t* capture_ptr,
+                   xcp_context_t* xcp_ptr,
                    TX_BYTE_POOL* stack_pool_ptr,
                    const config_ctrl_t* config_ptr,
                    const config_rtds_t* rtds_config_ptr,
@@ -58,6 +65,8 @@ status_t ctrl_init(ctrl_context_t* ctrl_ptr,
     ctrl_ptr->pm100_ptr = pm100_ptr;
     ctrl_ptr->tick_ptr = tick_ptr;
     ctrl_ptr->canbc_ptr = canbc_ptr;
+    ctrl_ptr->capture_ptr = capture_ptr;
+    ctrl_ptr->xcp_ptr = xcp_ptr;
     ctrl_ptr->config_ptr = config_ptr;
     ctrl_ptr->rtds_config_ptr = rtds_config_ptr;
     ctrl_ptr->error = CTRL_ERROR_NONE;
@@ -66,6 +75,9 @@ status_t ctrl_init(ctrl_context_t* ctrl_ptr,
     ctrl_ptr->sagl_reading = 0;
     ctrl_ptr->torque_request = 0;
     ctrl_ptr->shdn_reading = 0;
+    ctrl_ptr->motor_temp = 0;
+    ctrl_ptr->inv_temp = 0;
+    ctrl_ptr->max_temp = 0;
     ctrl_ptr->precharge_start = 0;
     ctrl_ptr->inverter_pwr = false;
     ctrl_ptr->pump_pwr = false;
@@ -133,18 +145,63 @@ void ctrl_thread_entry(ULONG input)
 
         ctrl_ptr->shdn_reading = trc_ready();
 
-        ctrl_ptr->motor_temp = pm100_motor_temp(ctrl_ptr->pm100_ptr);
-        ctrl_ptr->inv_temp = pm100_max_inverter_temp(ctrl_ptr->pm100_ptr);
+        // one consistent read of the PM100 states per cycle
+        pm100_snapshot(ctrl_ptr->pm100_ptr, &ctrl_ptr->pm100_state);
+
+        // temperatures are only taken when fresh, so telemetry holds the
+        // last fresh values and flags them as stale
+        int16_t motor_temp;
+        int16_t inv_temp;
+        const bool motor_temp_fresh
+            = pm100_motor_temp(&ctrl_ptr->pm100_state, &motor_temp);
+        const bool inv_temp_fresh
+            = pm100_max_inverter_temp(&ctrl_ptr->pm100_state, &inv_temp);
+        const bool temps_fresh = motor_temp_fresh && inv_temp_fresh;
+
+        if (motor_temp_fresh)
+        {
+            ctrl_ptr->motor_temp = motor_temp;
+        }
+
+        if (inv_temp_fresh)
+        {
+            ctrl_ptr->inv_temp = inv_temp;
+        }
+
         ctrl_ptr->max_temp = ctrl_ptr->motor_temp > ctrl_ptr->inv_temp
                                  ? ctrl_ptr->motor_temp
                                  : ctrl_ptr->inv_temp;
-        LOG_INFO("Motor temp: %d   Inverter temp: %d   Max temp: %d\n",
 
-                 ctrl_ptr->motor_temp,
-                 ctrl_ptr->inv_temp,
-                 ctrl_ptr->max_temp);
+        if (temps_fresh)
+        {
+            LOG_INFO("Motor temp: %d   Inverter temp: %d   Max temp: %d\n",
+                     ctrl_ptr->motor_temp,
+                     ctrl_ptr->inv_temp,
+                     ctrl_ptr->max_temp);
+        }
+
+        // stale temperatures only matter while the inverter is live, an
+        // unpowered PM100 is expected to be silent
+        const bool inverter_live = ctrl_ptr->pm100_state.broadcasts_valid
+                                   || ctrl_ptr->inverter_pwr;
+        const bool temps_stale = !temps_fresh && inverter_live;
+
+        if (temps_stale)
+        {
+            ctrl_ptr->error |= CTRL_ERROR_TEMPS_STALE;
+        }
+        else
+        {
+            ctrl_ptr->error &= ~CTRL_ERROR_TEMPS_STALE;
+        }
 
-        if (ctrl_fan_passed_on_threshold(ctrl_ptr))
+        // fail safe, run the fan while the temperatures are unknown
+        if (temps_stale)
+        {
+            ctrl_ptr->fan_pwr = 1;
+            LOG_WARN_LIMITED(1000, "PM100 temperatures are stale\n");
+        }
+        else if (ctrl_fan_passed_on_threshold(ctrl_ptr))
         {
             ctrl_ptr->fan_pwr = 1;
         }
@@ -162,6 +219,8 @@ void ctrl_thread_entry(ULONG input)
 
         ctrl_state_machine_tick(ctrl_ptr);
         ctrl_update_canbc_states(ctrl_ptr);
+        ctrl_capture_sample(ctrl_ptr);
+        xcp_event(ctrl_ptr->xcp_ptr, XCP_EVENT_CTRL);
 
         tx_thread_sleep(ctrl_ptr->config_ptr->schedule_ticks);
     }
@@ -264,7 +323,7 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
     {
         const uint32_t charge_time = tx_time_get() - ctrl_ptr->precharge_start;
 
-        if (pm100_is_precharged(ctrl_ptr->pm100_ptr))
+        if (pm100_is_precharged(&ctrl_ptr->pm100_state))
         {
 #ifdef VCU_SIMULATION_MODE
             next_state = CTRL_STATE_SIM_WAIT_TS_ON;
@@ -377,7 +436,7 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
                     >= ctrl_ptr->config_ptr->apps_bps_high_threshold
                 && ctrl_ptr->bps_reading > BPS_ON_THRESH)
             {
-                LOG_ERROR("BP and AP pressed\n");
+                LOG_ERROR_LIMITED(1000, "BP and AP pressed\n");
 
                 if (tx_time_get() >= ctrl_ptr->apps_bps_start
                                          + (TX_TIMER_TICKS_PER_SECOND / 3))
@@ -397,9 +456,15 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
 #else
             uint16_t power = remote_get_power_reading(remote_ctrl_ptr);
 
-            int16_t motor_speed = pm100_motor_speed(ctrl_ptr->pm100_ptr);
+            int16_t motor_speed = 0;
             uint16_t rad_s = 1;
 
+            // stale speed is treated as stationary, giving the least torque
+            if (!pm100_motor_speed(&ctrl_ptr->pm100_state, &motor_speed))
+            {
+                motor_speed = 0;
+            }
+
             // this if to be removed
             if (motor_speed < 10)
             {
@@ -423,6 +488,7 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
                      ctrl_ptr->torque_request);
 
             pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr,
+                                                &ctrl_ptr->pm100_state,
                                                 ctrl_ptr->torque_request);
 
             if (pm100_status != STATUS_OK)
@@ -442,7 +508,9 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
     case CTRL_STATE_R2D_OFF:
     {
         ctrl_ptr->torque_request = 0;
-        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr, 0);
+        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr,
+                                                     &ctrl_ptr->pm100_state,
+                                                     0);
         ctrl_ptr->motor_torque_zero_start = tx_time_get();
         ctrl_ptr->pump_pwr = 0;
 
@@ -460,7 +528,9 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
     case CTRL_STATE_R2D_OFF_WAIT:
     {
         ctrl_ptr->torque_request = 0;
-        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr, 0);
+        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr,
+                                                     &ctrl_ptr->pm100_state,
+                                                     0);
 
         if (pm100_status != STATUS_OK)
         {
@@ -500,7 +570,9 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
     case (CTRL_STATE_APPS_SCS_FAULT):
     {
         ctrl_ptr->torque_request = 0;
-        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr, 0);
+        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr,
+                                                     &ctrl_ptr->pm100_state,
+                                                     0);
 
         if (pm100_status != STATUS_OK)
         {
@@ -521,7 +593,9 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
     case (CTRL_STATE_APPS_BPS_FAULT):
     {
         ctrl_ptr->torque_request = 0;
-        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr, 0);
+        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr,
+                                                     &ctrl_ptr->pm100_state,
+                                                     0);
 
         if (pm100_status != STATUS_OK)
         {
@@ -556,7 +630,9 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
     case (CTRL_STATE_SIM_WAIT_TS_OFF):
     {
         ctrl_ptr->torque_request = 0;
-        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr, 0);
+        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr,
+                                                     &ctrl_ptr->pm100_state,
+                                                     0);
         if (pm100_status != STATUS_OK)
         {
             next_state = CTRL_STATE_TS_RUN_FAULT;
@@ -573,7 +649,9 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
     case (CTRL_STATE_SIM_WAIT_TS_ON):
     {
         ctrl_ptr->torque_request = 0;
-        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr, 0);
+        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr,
+                                                     &ctrl_ptr->pm100_state,
+                                                     0);
         if (pm100_status != STATUS_OK)
         {
             next_state = CTRL_STATE_TS_RUN_FAULT;
@@ -589,7 +667,9 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
     case (CTRL_STATE_SIM_WAIT_R2D_ON):
     {
         ctrl_ptr->torque_request = 0;
-        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr, 0);
+        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr,
+                                                     &ctrl_ptr->pm100_state,
+                                                     0);
         if (pm100_status != STATUS_OK)
         {
             next_state = CTRL_STATE_TS_RUN_FAULT;
@@ -605,7 +685,9 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
     case (CTRL_STATE_SIM_WAIT_R2D_OFF):
     {
         ctrl_ptr->torque_request = 0;
-        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr, 0);
+        status_t pm100_status = pm100_request_torque(ctrl_ptr->pm100_ptr,
+                                                     &ctrl_ptr->pm100_state,
+                                                     0);
         if (pm100_status != STATUS_OK)
         {
             next_state = CTRL_STATE_TS_RUN_FAULT;
@@ -622,6 +704,22 @@ void ctrl_state_machine_tick(ctrl_context_t* ctrl_ptr)
         break;
     }
 
+    // keep state changes for post-mortems after a reset
+    if (next_state != ctrl_ptr->state)
+    {
+        log_crash_record_state(next_state);
+    }
+
+    // capture the signals around faults
+    if (next_state != ctrl_ptr->state
+        && (next_state == CTRL_STATE_TS_ACTIVATION_FAILURE
+            || next_state == CTRL_STATE_TS_RUN_FAULT
+            || next_state == CTRL_STATE_APPS_SCS_FAULT
+            || next_state == CTRL_STATE_APPS_BPS_FAULT))
+    {
+        capture_trigger(ctrl_ptr->capture_ptr, CAPTURE_TRIGGER_FAULT);
+    }
+
     ctrl_ptr->state = next_state;
 }
 
@@ -653,22 +751,34 @@ void ctrl_handle_ts_fault(ctrl_context_t* ctrl_ptr)
  */
 void ctrl_update_canbc_states(ctrl_context_t* ctrl_ptr)
 {
-    canbc_states_t* states = canbc_lock_state(ctrl_ptr->canbc_ptr, TX_NO_WAIT);
+    canbc_context_t* canbc_ptr = ctrl_ptr->canbc_ptr;
+
+    // TODO: add ready to drive state?
+    canbc_set_sagl(canbc_ptr, ctrl_ptr->sagl_reading);
+    canbc_set_torque_request(canbc_ptr, ctrl_ptr->torque_request);
+    canbc_set_max_temp(canbc_ptr, (int8_t) ctrl_ptr->max_temp);
+    canbc_set_ctrl_state(canbc_ptr, (uint8_t) ctrl_ptr->state);
+    canbc_set_drs_active(canbc_ptr, ctrl_ptr->shdn_reading);
+    canbc_set_ctrl_error(canbc_ptr, ctrl_ptr->error);
+    canbc_set_inverter(canbc_ptr, ctrl_ptr->inverter_pwr);
+    canbc_set_pump(canbc_ptr, ctrl_ptr->pump_pwr);
+    canbc_set_fan(canbc_ptr, ctrl_ptr->fan_pwr);
+}
 
-    if (states != NULL)
-    {
-        // TODO: add ready to drive state?
-        states->sensors.vcu_sagl = ctrl_ptr->sagl_reading;
-        states->sensors.vcu_torque_request = ctrl_ptr->torque_request;
-        states->temps.vcu_max_temp = (int8_t) ctrl_ptr->max_temp;
-        states->state.vcu_ctrl_state = (uint8_t) ctrl_ptr->state;
-        states->state.vcu_drs_active = ctrl_ptr->shdn_reading;
-        states->errors.vcu_ctrl_error = ctrl_ptr->error;
-        states->pdm.inverter = ctrl_ptr->inverter_pwr;
-        states->pdm.pump = ctrl_ptr->pump_pwr;
-        states->pdm.fan = ctrl_ptr->fan_pwr;
-        canbc_unlock_state(ctrl_ptr->canbc_ptr);
-    }
+/**
+ * @brief       Samples the signals for burst capture
+ *
+ * @param[in]   ctrl_ptr    Control context
+ */
+void ctrl_capture_sample(ctrl_context_t* ctrl_ptr)
+{
+    capture_sample_t sample = {.apps = ctrl_ptr->apps_reading,
+                               .bps = ctrl_ptr->bps_reading,
+                               .torque_request = ctrl_ptr->torque_request};
+
+    (void) pm100_motor_speed(&ctrl_ptr->pm100_state, &sample.motor_speed);
+
+    capture_sample(ctrl_ptr->capture_ptr, &sample);
 }
 
 status_t ctrl_get_apps_reading(tick_context_t* tick_ptr,
@@ -6,20 +6,54 @@
  * @details Thread-safe logging implementation
  ****************************************************************************/
 
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_LOG
+
 #include "log.h"
 
 #include <stdarg.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <string.h>
 #include <tx_api.h>
 #include <usart.h>
 
 #include "config.h"
+#include "irq_lock.h"
 #include "status.h"
+#include "str_format.h"
 
 // internal function prototype
 static void log_thread_entry(ULONG thread_input);
+static void* log_reserve(log_context_t* log_ptr, uint32_t len);
+static void log_commit(log_context_t* log_ptr,
+                       void* record_ptr,
+                       uint32_t len);
+static void log_crash_replay(log_context_t* log_ptr);
+static void log_wait_for_msg(log_context_t* log_ptr);
+static void log_flush_rate_limits(void);
+static void log_housekeeping(log_context_t* log_ptr);
+static void log_batch_add(log_batch_t* batch_ptr, ULONG timestamp);
+static void log_batch_done(log_context_t* log_ptr);
+static void log_update_stats(log_context_t* log_ptr);
+static void log_can_queue(log_context_t* log_ptr,
+                          const uint8_t* bytes,
+                          uint32_t len);
+static void log_can_send(log_context_t* log_ptr);
+static ULONG log_can_wait_ticks(const log_context_t* log_ptr);
+static void log_repeats(const log_rate_limit_t* limit_ptr,
+                        uint32_t repeats,
+                        ULONG elapsed_ticks);
+static uint32_t log_fill_buffer(log_context_t* log_ptr,
+                                uint8_t* buf,
+                                uint32_t len);
+static uint32_t log_encode_msg(const log_msg_t* msg_ptr,
+                               uint8_t* buf,
+                               uint32_t buf_len);
+#ifdef LOG_BINARY_MODE
+static uint32_t encode_varint(uint32_t value, uint8_t* buf);
+static uint32_t encode_cobs(const uint8_t* src,
+                            uint32_t src_len,
+                            uint8_t* dst);
+#endif
 
 // log level names
 static const char* log_level_names[]
@@ -28,11 +62,27 @@ static const char* log_level_names[]
 // Global log Context
 static log_context_t* global_log_context;
 
+// marks valid crash log contents
+#define LOG_CRASH_MAGIC 0x4C4F4721
+
+// crash log, kept in RAM which is not cleared on reset (see linker script)
+static log_crash_ring_t crash_ring __attribute__((section(".noinit")));
+
+// rate limited call sites which have logged at least once
+static log_rate_limit_t* rate_limit_list;
+
+// bounds of the .log_sites section (see linker script)
+extern const uint8_t __log_sites_start[];
+extern const uint8_t __log_sites_end[];
+
 /**
  * @brief initialises the logging service
  *
+ * @details the thread stack and the message pool are both allocated from
+ *          the memory pool, the message pool size comes from the config
+ *
  * @param log_ptr the logging service context
- * @param stack_pool_ptr memory pool for thread stack
+ * @param stack_pool_ptr memory pool for thread stack and message pool
  * @param config_ptr logging service configuration
  * @return status_t outcome of initialisation
  */
@@ -41,7 +91,23 @@ status_t log_init(log_context_t* log_ptr,
                   const config_log_t* config_ptr)
 {
     log_ptr->config_ptr = config_ptr;
-    log_ptr->error = LOG_ERROR_NONE;
+    atomic_init(&log_ptr->error, LOG_ERROR_NONE);
+    log_ptr->tx_buffer_idx = 0;
+    log_ptr->crash_ptr = NULL;
+    log_ptr->rtcan_s_ptr = NULL;
+    log_ptr->canbc_ptr = NULL;
+    log_ptr->stats_time = 0;
+    log_ptr->tx_done_time = 0;
+    log_ptr->can_head = 0;
+    log_ptr->can_tail = 0;
+    log_ptr->can_credit
+        = config_ptr->stream_burst_bytes * TX_TIMER_TICKS_PER_SECOND;
+    log_ptr->can_credit_time = 0;
+    log_ptr->can_seq = 0;
+    memset(&log_ptr->stats, 0, sizeof(log_ptr->stats));
+    memset(&log_ptr->batch_fill, 0, sizeof(log_ptr->batch_fill));
+    memset(&log_ptr->batch_sent, 0, sizeof(log_ptr->batch_sent));
+    log_ptr->stats.latency_min = UINT32_MAX;
     global_log_context = log_ptr;
 
     status_t status = STATUS_OK;
@@ -53,14 +119,40 @@ status_t log_init(log_context_t* log_ptr,
                                       config_ptr->thread.stack_size,
                                       TX_NO_WAIT);
 
-    // create log message queue
+    // allocate message pool
+    void* msg_pool_ptr = NULL;
+
     if (tx_status == TX_SUCCESS)
     {
-        tx_status = tx_queue_create(&log_ptr->msg_queue,
-                                    NULL,
-                                    TX_16_ULONG,
-                                    log_ptr->msg_queue_mem,
-                                    LOG_MSG_QUEUE_SIZE);
+        tx_status = tx_byte_allocate(stack_pool_ptr,
+                                     &msg_pool_ptr,
+                                     config_ptr->msg_pool_size,
+                                     TX_NO_WAIT);
+    }
+
+    // create log message ring in the pool
+    if (tx_status == TX_SUCCESS)
+    {
+        atomic_init(&log_ptr->thread_waiting, false);
+
+        if (!mpsc_ring_init(&log_ptr->msg_ring,
+                            msg_pool_ptr,
+                            config_ptr->msg_pool_size))
+        {
+            tx_status = TX_SIZE_ERROR;
+        }
+    }
+
+    // create message semaphore
+    if (tx_status == TX_SUCCESS)
+    {
+        tx_status = tx_semaphore_create(&log_ptr->msg_sem, NULL, 0);
+    }
+
+    // queue any messages from before the last reset, then start recording
+    if (tx_status == TX_SUCCESS)
+    {
+        log_crash_replay(log_ptr);
     }
 
     // create UART mutex
@@ -69,6 +161,12 @@ status_t log_init(log_context_t* log_ptr,
         tx_status = tx_mutex_create(&log_ptr->uart_mutex, NULL, TX_INHERIT);
     }
 
+    // create DMA transfer complete semaphore (no transfer in progress yet)
+    if (tx_status == TX_SUCCESS)
+    {
+        tx_status = tx_semaphore_create(&log_ptr->tx_done_sem, NULL, 1);
+    }
+
     // create TX thread
     if (tx_status == TX_SUCCESS)
     {
@@ -88,7 +186,7 @@ status_t log_init(log_context_t* log_ptr,
     if (tx_status != TX_SUCCESS)
     {
         status = STATUS_ERROR;
-        log_ptr->error |= LOG_ERROR_INIT;
+        atomic_fetch_or(&log_ptr->error, LOG_ERROR_INIT);
     }
 
     // if status is not OK, terminate the thread
@@ -101,113 +199,1089 @@ status_t log_init(log_context_t* log_ptr,
     return status;
 }
 
+#ifndef LOG_BINARY_MODE
+
+/**
+ * @brief formats a log message and queues it for transmission
+ *
+ * @param level log level of the message
+ * @param format printf style format string
+ * @return status_t STATUS_ERROR if the message could not be queued
+ */
 status_t log_printf(const config_log_level_t level, const char* format, ...)
 {
     // check if the message should be logged
     if (level < global_log_context->config_ptr->min_level)
         return STATUS_OK;
 
-    // create the message
-    log_msg_t msg;
-    msg.level = level;
-
     // timestamp message
-    msg.timestamp = tx_time_get();
+    const ULONG timestamp = tx_time_get();
 
     // format the message
-    UINT last_interrupt_state = tx_interrupt_control(TX_INT_DISABLE);
+    // (str_vformat is reentrant, so interrupts are left enabled)
+    char text[LOG_MSG_MAX_LEN + 1];
     va_list args;
     va_start(args, format);
-    vsnprintf(msg.msg, LOG_MSG_MAX_LEN, format, args);
+    uint32_t text_len = str_vformat(text, LOG_MSG_MAX_LEN, format, args);
     va_end(args);
-    tx_interrupt_control(last_interrupt_state);
 
-    // queue the message
-    UINT tx_status = tx_queue_send(&global_log_context->msg_queue,
-                                   (void*) &msg,
-                                   TX_NO_WAIT);
+    // queue only as much of the message as is used
+    if (text_len >= LOG_MSG_MAX_LEN)
+        text_len = LOG_MSG_MAX_LEN - 1;
+
+    text_len++;
+    log_msg_t* msg_ptr
+        = log_reserve(global_log_context,
+                      offsetof(log_msg_t, msg) + text_len);
 
     // check for errors
-    if (tx_status != TX_SUCCESS)
+    if (msg_ptr == NULL)
+    {
+        atomic_fetch_add(&global_log_context->stats.dropped, 1);
+        return STATUS_ERROR;
+    }
+
+    msg_ptr->level = level;
+    msg_ptr->timestamp = timestamp;
+    memcpy(msg_ptr->msg, text, text_len);
+
+    log_commit(global_log_context,
+               msg_ptr,
+               offsetof(log_msg_t, msg) + text_len);
+
+    return STATUS_OK;
+}
+
+#else
+
+/**
+ * @brief queues a binary log message for transmission
+ *
+ * @details no formatting is done here, the format ID and raw arguments are
+ *          copied into the queue and decoded on the host
+ *
+ * @param level log level of the message
+ * @param fmt_id address of the format string in the .log_fmt section
+ * @param argc number of arguments
+ * @param args raw argument words
+ * @return status_t STATUS_ERROR if the message could not be queued
+ */
+status_t log_write_binary(const config_log_level_t level,
+                          uint32_t fmt_id,
+                          uint32_t argc,
+                          const uint32_t* args)
+{
+    // check if the message should be logged
+    if (level < global_log_context->config_ptr->min_level)
+        return STATUS_OK;
+
+    if (argc > LOG_MSG_MAX_ARGS)
+        argc = LOG_MSG_MAX_ARGS;
+
+    // create the message in place, only as long as the arguments need
+    log_msg_t* msg_ptr
+        = log_reserve(global_log_context,
+                      offsetof(log_msg_t, args) + argc * sizeof(uint32_t));
+
+    if (msg_ptr == NULL)
     {
+        atomic_fetch_add(&global_log_context->stats.dropped, 1);
         return STATUS_ERROR;
     }
 
+    msg_ptr->level = level;
+    msg_ptr->timestamp = tx_time_get();
+    msg_ptr->fmt_id = fmt_id;
+    msg_ptr->argc = argc;
+
+    for (uint32_t i = 0; i < argc; i++)
+    {
+        msg_ptr->args[i] = args[i];
+    }
+
+    log_commit(global_log_context,
+               msg_ptr,
+               offsetof(log_msg_t, args) + argc * sizeof(uint32_t));
+
     return STATUS_OK;
 }
 
+#endif
+
+/**
+ * @brief reserves space for a message in the message ring
+ *
+ * @details safe to call from any thread or ISR, no kernel calls are made
+ *
+ * @param log_ptr the logging service context
+ * @param len length of the message record
+ * @return void* pointer to the record, or NULL if the ring is full
+ */
+void* log_reserve(log_context_t* log_ptr, uint32_t len)
+{
+    return mpsc_ring_reserve(&log_ptr->msg_ring, len);
+}
+
+/**
+ * @brief makes a message visible to the log thread
+ *
+ * @details the semaphore is only put if the log thread is waiting, so most
+ *          messages are queued without a kernel call
+ *
+ * @details a copy of the message is also kept in the crash log
+ *
+ * @param log_ptr the logging service context
+ * @param record_ptr record returned by log_reserve()
+ * @param len length of the record
+ */
+void log_commit(log_context_t* log_ptr, void* record_ptr, uint32_t len)
+{
+    log_crash_ring_t* crash_ptr = log_ptr->crash_ptr;
+
+    if (crash_ptr != NULL)
+    {
+        const uint32_t idx = atomic_fetch_add(&crash_ptr->msg_count, 1);
+        const uint32_t slot = idx % LOG_CRASH_MSGS;
+
+        crash_ptr->msg_seq[slot] = 0;
+        memcpy(&crash_ptr->msgs[slot], record_ptr, len);
+        crash_ptr->msg_seq[slot] = idx + 1;
+    }
+
+    mpsc_ring_commit(&log_ptr->msg_ring, record_ptr);
+
+    if (atomic_exchange(&log_ptr->thread_waiting, false))
+    {
+        tx_semaphore_ceiling_put(&log_ptr->msg_sem, 1);
+    }
+}
+
+/**
+ * @brief queues the contents of the crash log from before the last reset
+ *
+ * @details messages keep their original level and timestamp. The crash log
+ *          is cleared afterwards and new messages are recorded from then on.
+ *
+ * @param log_ptr the logging service context
+ */
+void log_crash_replay(log_context_t* log_ptr)
+{
+    log_crash_ring_t* crash_ptr = &crash_ring;
+    const uint32_t reset_flags = RCC->CSR;
+
+    if (crash_ptr->magic == LOG_CRASH_MAGIC)
+    {
+        const uint32_t msg_count = atomic_load(&crash_ptr->msg_count);
+        const uint32_t state_count = atomic_load(&crash_ptr->state_count);
+        uint32_t start;
+
+        LOG_WARN("Replaying log from before reset (reason %lu, CSR %lx)\n",
+                 crash_ptr->reason,
+                 reset_flags);
+
+        start = (msg_count > LOG_CRASH_MSGS) ? msg_count - LOG_CRASH_MSGS : 0;
+
+        for (uint32_t i = start; i < msg_count; i++)
+        {
+            const uint32_t slot = i % LOG_CRASH_MSGS;
+
+            if (crash_ptr->msg_seq[slot] != i + 1)
+                continue;
+
+            void* record_ptr = log_reserve(log_ptr, sizeof(log_msg_t));
+
+            if (record_ptr == NULL)
+                break;
+
+            memcpy(record_ptr, &crash_ptr->msgs[slot], sizeof(log_msg_t));
+            log_commit(log_ptr, record_ptr, sizeof(log_msg_t));
+        }
+
+        start = (state_count > LOG_CRASH_STATES)
+                    ? state_count - LOG_CRASH_STATES
+                    : 0;
+
+        for (uint32_t i = start; i < state_count; i++)
+        {
+            const uint32_t slot = i % LOG_CRASH_STATES;
+
+            if (crash_ptr->state_seq[slot] != i + 1)
+                continue;
+
+            LOG_WARN("Ctrl state before reset: %lu at %lu\n",
+                     crash_ptr->states[slot].state,
+                     crash_ptr->states[slot].timestamp);
+        }
+
+        LOG_WARN("End of log from before reset\n");
+    }
+
+    // start a new crash log
+    memset(crash_ptr, 0, sizeof(*crash_ptr));
+    crash_ptr->magic = LOG_CRASH_MAGIC;
+    crash_ptr->reason = LOG_CRASH_REASON_NONE;
+    __HAL_RCC_CLEAR_RESET_FLAGS();
+
+    log_ptr->crash_ptr = crash_ptr;
+}
+
+/**
+ * @brief records a ctrl state change in the crash log
+ *
+ * @param state new ctrl_state_t
+ */
+void log_crash_record_state(uint32_t state)
+{
+    if (global_log_context == NULL || global_log_context->crash_ptr == NULL)
+        return;
+
+    log_crash_ring_t* crash_ptr = global_log_context->crash_ptr;
+
+    const uint32_t idx = atomic_fetch_add(&crash_ptr->state_count, 1);
+    const uint32_t slot = idx % LOG_CRASH_STATES;
+
+    crash_ptr->state_seq[slot] = 0;
+    crash_ptr->states[slot].timestamp = tx_time_get();
+    crash_ptr->states[slot].state = state;
+    crash_ptr->state_seq[slot] = idx + 1;
+}
+
+/**
+ * @brief records why the VCU is about to stop or reset
+ *
+ * @details only the first reason is kept, so a hard fault which then calls
+ *          Error_Handler() is recorded as a hard fault. Safe to call before
+ *          the log service is initialised.
+ *
+ * @param reason LOG_CRASH_REASON_x
+ */
+void log_crash_mark(uint32_t reason)
+{
+    if (crash_ring.magic == LOG_CRASH_MAGIC
+        && crash_ring.reason == LOG_CRASH_REASON_NONE)
+    {
+        crash_ring.reason = reason;
+    }
+}
+
+/**
+ * @brief blocks the log thread until a message can be read from the ring
+ *
+ * @param log_ptr the logging service context
+ */
+void log_wait_for_msg(log_context_t* log_ptr)
+{
+    uint32_t len;
+
+    while (mpsc_ring_peek(&log_ptr->msg_ring, &len) == NULL)
+    {
+        // announce that we are waiting, then check again in case a message
+        // was committed before the flag was seen
+        atomic_store(&log_ptr->thread_waiting, true);
+
+        if (mpsc_ring_peek(&log_ptr->msg_ring, &len) != NULL)
+        {
+            atomic_store(&log_ptr->thread_waiting, false);
+            break;
+        }
+
+        // wake up now and then for housekeeping, or when the CAN stream is
+        // next allowed to send
+        if (tx_semaphore_get(&log_ptr->msg_sem, log_can_wait_ticks(log_ptr))
+            == TX_NO_INSTANCE)
+        {
+            atomic_store(&log_ptr->thread_waiting, false);
+            log_housekeeping(log_ptr);
+        }
+    }
+}
+
+/**
+ * @brief checks whether a rate limited message should be logged
+ *
+ * @details the first message opens a window of period_ticks, repeats within
+ *          the window are counted. The count is logged by the next message
+ *          after the window closes, or by the log thread if there isn't one.
+ *
+ * @param limit_ptr state of the call site
+ * @param period_ticks length of the window
+ * @return bool true if the message should be logged
+ */
+bool log_rate_limit(log_rate_limit_t* limit_ptr, ULONG period_ticks)
+{
+    const ULONG now = tx_time_get();
+    uint32_t repeats = 0;
+    ULONG elapsed = 0;
+    bool log_msg = false;
+
+    UINT last_interrupt_state = irq_lock();
+
+    if (!limit_ptr->active || now - limit_ptr->window_start >= period_ticks)
+    {
+        // window closed, log this one and start a new window
+        repeats = limit_ptr->repeats;
+        elapsed = limit_ptr->last_repeat - limit_ptr->window_start;
+
+        limit_ptr->period_ticks = period_ticks;
+        limit_ptr->window_start = now;
+        limit_ptr->repeats = 0;
+        limit_ptr->active = true;
+        log_msg = true;
+
+        if (!limit_ptr->registered)
+        {
+            limit_ptr->next_ptr = rate_limit_list;
+            rate_limit_list = limit_ptr;
+            limit_ptr->registered = true;
+        }
+    }
+    else
+    {
+        limit_ptr->repeats++;
+        limit_ptr->last_repeat = now;
+    }
+
+    irq_unlock(last_interrupt_state);
+
+    if (repeats > 0)
+    {
+        log_repeats(limit_ptr, repeats, elapsed);
+    }
+
+    return log_msg;
+}
+
+/**
+ * @brief logs the repeats of rate limited messages whose window has closed
+ *
+ * @details called by the log thread so that repeats are not lost if a
+ *          message stops being logged
+ */
+void log_flush_rate_limits(void)
+{
+    const ULONG now = tx_time_get();
+
+    for (log_rate_limit_t* limit_ptr = rate_limit_list; limit_ptr != NULL;
+         limit_ptr = limit_ptr->next_ptr)
+    {
+        uint32_t repeats = 0;
+        ULONG elapsed = 0;
+
+        UINT last_interrupt_state = irq_lock();
+
+        if (limit_ptr->active
+            && now - limit_ptr->window_start >= limit_ptr->period_ticks)
+        {
+            repeats = limit_ptr->repeats;
+            elapsed = limit_ptr->last_repeat - limit_ptr->window_start;
+            limit_ptr->repeats = 0;
+            limit_ptr->active = false;
+        }
+
+        irq_unlock(last_interrupt_state);
+
+        if (repeats > 0)
+        {
+            log_repeats(limit_ptr, repeats, elapsed);
+        }
+    }
+}
+
+/**
+ * @brief logs the number of suppressed repeats of a rate limited message
+ *
+ * @param limit_ptr state of the call site
+ * @param repeats number of repeats suppressed
+ * @param elapsed_ticks time from the first message to the last repeat
+ */
+void log_repeats(const log_rate_limit_t* limit_ptr,
+                 uint32_t repeats,
+                 ULONG elapsed_ticks)
+{
+    LOG_EMIT(limit_ptr->level,
+             "x%lu in %lu ms: %s",
+             repeats,
+             (elapsed_ticks * 1000) / TX_TIMER_TICKS_PER_SECOND,
+             limit_ptr->fmt);
+}
+
+/**
+ * @brief log thread
+ *
+ * @details queued messages are packed into one of two buffers, which is sent
+ *          by DMA while the other buffer is filled. Completion of the transfer
+ *          is signalled by the UART TX complete callback, so the thread is
+ *          free while the bytes go out and throughput is limited only by the
+ *          baud rate.
+ *
+ * @param thread_input pointer to the logging service context
+ */
 void log_thread_entry(ULONG thread_input)
 {
     log_context_t* log_ptr = (log_context_t*) thread_input;
-    log_msg_t msg;
     UINT tx_status;
 
-    LOG_INFO("Logging service started, min level: %s\n",
-             log_level_names[log_ptr->config_ptr->min_level]);
+    LOG_INFO("Logging service started, min level: %s, pool: %lu bytes\n",
+             log_level_names[log_ptr->config_ptr->min_level],
+             log_ptr->config_ptr->msg_pool_size);
+
+    LOG_INFO("%lu log messages removed at compile time\n",
+             log_get_stripped_count(LOG_LEVEL_NONE));
 
     while (true)
     {
+        uint8_t* buf = log_ptr->tx_buffers[log_ptr->tx_buffer_idx];
+
+        // summarise rate limited messages and broadcast statistics
+        log_housekeeping(log_ptr);
+
         // wait for a message to be queued
-        tx_status = tx_queue_receive(&log_ptr->msg_queue,
-                                     (void*) &msg,
-                                     TX_WAIT_FOREVER);
+        log_wait_for_msg(log_ptr);
+
+        // pack everything already queued into the same transfer
+        uint32_t len = log_fill_buffer(log_ptr, buf, 0);
+
+        // wait for the previous transfer to finish, then top up the buffer
+        // with anything queued in the meantime
+        tx_status = tx_semaphore_get(&log_ptr->tx_done_sem, TX_WAIT_FOREVER);
 
-        // if no message was recieved, try again
-        // TODO: Error Handling
         if (tx_status != TX_SUCCESS)
             continue;
 
-        // Create a buffer for the log message
-        char log_msg_to_send[LOG_MSG_MAX_TRANSMITION_LEN];
-
-        // format the log message
-        UINT last_interrupt_state = tx_interrupt_control(TX_INT_DISABLE);
-        snprintf(log_msg_to_send,
-                 LOG_MSG_MAX_TRANSMITION_LEN,
-                 "%ld [%s]: %s",
-                 msg.timestamp,
-                 log_level_names[msg.level],
-                 msg.msg);
-        tx_interrupt_control(last_interrupt_state);
+        log_batch_done(log_ptr);
+        len = log_fill_buffer(log_ptr, buf, len);
 
         // lock the UART mutex
         tx_status = tx_mutex_get(&log_ptr->uart_mutex, TX_WAIT_FOREVER);
 
         if (tx_status != TX_SUCCESS)
         {
-            log_ptr->error |= LOG_ERROR_MUTEX;
+            atomic_fetch_or(&log_ptr->error, LOG_ERROR_MUTEX);
+            tx_semaphore_put(&log_ptr->tx_done_sem);
             continue;
         }
         else
         {
-            log_ptr->error &= ~LOG_ERROR_MUTEX;
+            atomic_fetch_and(&log_ptr->error, ~LOG_ERROR_MUTEX);
         }
 
-        // print the message
+        // the batch must be in place before the transfer starts, as its
+        // complete and error callbacks can run as soon as it has
+        log_ptr->batch_sent = log_ptr->batch_fill;
+        memset(&log_ptr->batch_fill, 0, sizeof(log_ptr->batch_fill));
+
+        // start the transfer
         HAL_StatusTypeDef status
-            = HAL_UART_Transmit(log_ptr->config_ptr->uart,
-                                (const uint8_t*) log_msg_to_send,
-                                strlen(log_msg_to_send),
-                                HAL_MAX_DELAY);
+            = HAL_UART_Transmit_DMA(log_ptr->config_ptr->uart, buf, len);
 
         // unlock the UART mutex
         tx_status = tx_mutex_put(&log_ptr->uart_mutex);
         if (tx_status != TX_SUCCESS)
         {
-            log_ptr->error |= LOG_ERROR_MUTEX;
+            atomic_fetch_or(&log_ptr->error, LOG_ERROR_MUTEX);
         }
         else
         {
-            log_ptr->error &= ~LOG_ERROR_MUTEX;
+            atomic_fetch_and(&log_ptr->error, ~LOG_ERROR_MUTEX);
         }
 
         if (status != HAL_OK)
         {
-            log_ptr->error |= LOG_ERROR_UART;
+            // no transfer to wait for, drop this batch
+            atomic_fetch_or(&log_ptr->error, LOG_ERROR_UART);
+            log_ptr->stats.uart_dropped += log_ptr->batch_sent.count;
+            memset(&log_ptr->batch_sent, 0, sizeof(log_ptr->batch_sent));
+            tx_semaphore_put(&log_ptr->tx_done_sem);
+            continue;
+        }
+
+        // fill the other buffer while this one is sent
+        log_ptr->tx_buffer_idx ^= 1;
+    }
+}
+
+/**
+ * @brief packs queued messages into a transmit buffer without blocking
+ *
+ * @details stops when the ring is empty or the buffer may not have space
+ *          for another message
+ *
+ * @param log_ptr the logging service context
+ * @param buf transmit buffer
+ * @param len number of bytes already in the buffer
+ * @return uint32_t number of bytes in the buffer
+ */
+uint32_t log_fill_buffer(log_context_t* log_ptr, uint8_t* buf, uint32_t len)
+{
+    log_msg_t msg;
+    uint32_t record_len;
+    const void* record_ptr;
+
+    // the pool is fullest just before it is drained
+    const uint32_t used = mpsc_ring_used(&log_ptr->msg_ring);
+
+    if (used > log_ptr->stats.pool_peak)
+    {
+        log_ptr->stats.pool_peak = used;
+    }
+
+    while (LOG_TX_BUFFER_SIZE - len >= LOG_MSG_MAX_TRANSMITION_LEN
+           && (record_ptr = mpsc_ring_peek(&log_ptr->msg_ring, &record_len))
+                  != NULL)
+    {
+        // copy out the record so that its space can be reused straight away
+        memcpy(&msg, record_ptr, record_len);
+        mpsc_ring_release(&log_ptr->msg_ring);
+
+        log_batch_add(&log_ptr->batch_fill, msg.timestamp);
+
+        const uint32_t msg_len
+            = log_encode_msg(&msg, &buf[len], LOG_MSG_MAX_TRANSMITION_LEN);
+
+        // the same bytes are streamed on CAN S
+        log_can_queue(log_ptr, &buf[len], msg_len);
+        len += msg_len;
+    }
+
+    return len;
+}
+
+/**
+ * @brief counts the log messages removed at compile time
+ *
+ * @param level log level to count, or LOG_LEVEL_NONE to count all levels
+ * @return uint32_t number of call sites removed
+ */
+uint32_t log_get_stripped_count(config_log_level_t level)
+{
+    uint32_t count = 0;
+
+    for (const uint8_t* site_ptr = __log_sites_start;
+         site_ptr < __log_sites_end;
+         site_ptr++)
+    {
+        if ((*site_ptr & LOG_SITE_COMPILED) != 0)
+            continue;
+
+        if (level == LOG_LEVEL_NONE || *site_ptr == level)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief gets the live and peak usage of the message pool
+ *
+ * @details usage includes record headers and padding
+ *
+ * @param log_ptr the logging service context
+ * @param used_ptr bytes currently queued
+ * @param peak_ptr most bytes queued since start up
+ */
+void log_get_pool_usage(log_context_t* log_ptr,
+                        uint32_t* used_ptr,
+                        uint32_t* peak_ptr)
+{
+    *used_ptr = mpsc_ring_used(&log_ptr->msg_ring);
+    *peak_ptr = log_ptr->stats.pool_peak;
+}
+
+/**
+ * @brief sets the CAN bus used to stream messages and registers the
+ *        statistics broadcasts
+ *
+ * @details logging starts first so that start up errors are seen, which is
+ *          before RTCAN and CANBC exist. The statistics are not broadcast if
+ *          their period is zero.
+ *
+ * @param log_ptr the logging service context
+ * @param rtcan_s_ptr RTCAN instance for the sensor bus
+ * @param canbc_ptr CANBC service which broadcasts the statistics
+ * @return status_t outcome
+ */
+status_t log_attach_can(log_context_t* log_ptr,
+                        rtcan_handle_t* rtcan_s_ptr,
+                        canbc_context_t* canbc_ptr)
+{
+    const config_log_t* config_ptr = log_ptr->config_ptr;
+
+    log_ptr->rtcan_s_ptr = rtcan_s_ptr;
+
+    if (config_ptr->stats_period_ticks == 0)
+        return STATUS_OK;
+
+    for (uint32_t i = 0; i < LOG_STATS_FRAMES; i++)
+    {
+        const canbc_frame_t frame
+            = {.owner = "LOG",
+               .frame_id = config_ptr->stats_can_id + i,
+               .length = sizeof(log_ptr->stats_data[i]),
+               .extended = false,
+               .pack = canbc_pack_raw,
+               .src_ptr = log_ptr->stats_data[i],
+               .period_ticks = config_ptr->stats_period_ticks,
+               .phase_ticks = config_ptr->stats_phase_ticks + i,
+               .max_age_ticks = 0,
+               .catch_up = false,
+               .tracked = true};
+
+        if (canbc_register(canbc_ptr, &frame, &log_ptr->stats_handles[i])
+            != STATUS_OK)
+        {
+            return STATUS_ERROR;
+        }
+    }
+
+    log_ptr->canbc_ptr = canbc_ptr;
+
+    return STATUS_OK;
+}
+
+/**
+ * @brief gets the average latency from the pipeline statistics
+ *
+ * @param stats_ptr statistics
+ * @return uint32_t average latency in ticks
+ */
+uint32_t log_get_latency_avg(const log_stats_t* stats_ptr)
+{
+    return (stats_ptr->sent > 0)
+               ? (uint32_t) (stats_ptr->latency_total / stats_ptr->sent)
+               : 0;
+}
+
+/**
+ * @brief periodic work done by the log thread
+ *
+ * @param log_ptr the logging service context
+ */
+void log_housekeeping(log_context_t* log_ptr)
+{
+    // summarise rate limited messages whose window has closed
+    log_flush_rate_limits();
+
+    // stream messages on CAN S, as far as the bandwidth cap allows
+    log_can_send(log_ptr);
+
+    // update the statistics broadcasts
+    const ULONG now = tx_time_get();
+    const ULONG period = log_ptr->config_ptr->stats_period_ticks;
+
+    if (log_ptr->canbc_ptr != NULL && now - log_ptr->stats_time >= period)
+    {
+        log_ptr->stats_time = now;
+        log_update_stats(log_ptr);
+    }
+}
+
+/**
+ * @brief adds a message to a batch
+ *
+ * @param batch_ptr batch
+ * @param timestamp timestamp of the message
+ */
+void log_batch_add(log_batch_t* batch_ptr, ULONG timestamp)
+{
+    if (batch_ptr->count == 0 || timestamp < batch_ptr->oldest)
+    {
+        batch_ptr->oldest = timestamp;
+    }
+
+    if (batch_ptr->count == 0 || timestamp > batch_ptr->newest)
+    {
+        batch_ptr->newest = timestamp;
+    }
+
+    batch_ptr->timestamp_sum += timestamp;
+    batch_ptr->count++;
+}
+
+/**
+ * @brief updates the latency statistics once a UART transfer has finished
+ *
+ * @param log_ptr the logging service context
+ */
+void log_batch_done(log_context_t* log_ptr)
+{
+    log_batch_t* batch_ptr = &log_ptr->batch_sent;
+    log_stats_t* stats_ptr = &log_ptr->stats;
+
+    if (batch_ptr->count == 0)
+        return;
+
+    const ULONG done = log_ptr->tx_done_time;
+    const uint32_t latency_min = done - batch_ptr->newest;
+    const uint32_t latency_max = done - batch_ptr->oldest;
+
+    if (latency_min < stats_ptr->latency_min)
+    {
+        stats_ptr->latency_min = latency_min;
+    }
+
+    if (latency_max > stats_ptr->latency_max)
+    {
+        stats_ptr->latency_max = latency_max;
+    }
+
+    stats_ptr->latency_total
+        += (uint64_t) done * batch_ptr->count - batch_ptr->timestamp_sum;
+    stats_ptr->sent += batch_ptr->count;
+
+    memset(batch_ptr, 0, sizeof(*batch_ptr));
+}
+
+/**
+ * @brief updates the pipeline statistics broadcast on CAN S
+ *
+ * @details three frames of 16 bit little endian fields, not in the DBC:
+ *
+ *          ID:     | dropped (16) | UART dropped (16) | pool used (16) |
+ *                  | pool peak (16) |
+ *
+ *          ID + 1: | latency min (16) | latency avg (16) |
+ *                  | latency max (16) | sent (16) |
+ *
+ *          ID + 2: | CAN dropped (16) | CAN frames (16) | CAN backlog (16) |
+ *                  | CAN credit (16) |
+ *
+ *          where pool usage, backlog and credit are in bytes, latency is in
+ *          ticks and counts wrap. The CANBC service sends them at the
+ *          statistics period.
+ *
+ * @param log_ptr the logging service context
+ */
+static void log_update_stats(log_context_t* log_ptr)
+{
+    const log_stats_t* stats_ptr = &log_ptr->stats;
+    uint8_t data[LOG_STATS_FRAMES][8];
+
+    canbc_put_u16(&data[0][0], atomic_load(&stats_ptr->dropped));
+    canbc_put_u16(&data[0][2], stats_ptr->uart_dropped);
+    canbc_put_u16(&data[0][4], mpsc_ring_used(&log_ptr->msg_ring));
+    canbc_put_u16(&data[0][6], stats_ptr->pool_peak);
+
+    const uint32_t latency_min
+        = (stats_ptr->sent > 0) ? stats_ptr->latency_min : 0;
+
+    canbc_put_u16(&data[1][0], latency_min);
+    canbc_put_u16(&data[1][2], log_get_latency_avg(stats_ptr));
+    canbc_put_u16(&data[1][4], stats_ptr->latency_max);
+    canbc_put_u16(&data[1][6], stats_ptr->sent);
+
+    canbc_put_u16(&data[2][0], stats_ptr->can_dropped);
+    canbc_put_u16(&data[2][2], stats_ptr->can_frames);
+    canbc_put_u16(&data[2][4], log_ptr->can_head - log_ptr->can_tail);
+    canbc_put_u16(&data[2][6],
+                  log_ptr->can_credit / TX_TIMER_TICKS_PER_SECOND);
+
+    for (uint32_t i = 0; i < LOG_STATS_FRAMES; i++)
+    {
+        canbc_set_raw(log_ptr->canbc_ptr,
+                      log_ptr->stats_handles[i],
+                      log_ptr->stats_data[i],
+                      data[i],
+                      sizeof(data[i]));
+    }
+}
+
+/**
+ * @brief queues encoded bytes to be streamed on CAN S
+ *
+ * @details a message is only queued if all of it fits, so a receiver never
+ *          sees part of a message. Messages which don't fit are counted and
+ *          dropped, the UART still gets them.
+ *
+ * @param log_ptr the logging service context
+ * @param bytes encoded message
+ * @param len number of bytes
+ */
+void log_can_queue(log_context_t* log_ptr, const uint8_t* bytes, uint32_t len)
+{
+    if (log_ptr->rtcan_s_ptr == NULL
+        || log_ptr->config_ptr->stream_bytes_per_sec == 0)
+    {
+        return;
+    }
+
+    if (LOG_CAN_BUFFER_SIZE - (log_ptr->can_head - log_ptr->can_tail) < len)
+    {
+        log_ptr->stats.can_dropped++;
+        return;
+    }
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        log_ptr->can_buf[log_ptr->can_head++ & (LOG_CAN_BUFFER_SIZE - 1)]
+            = bytes[i];
+    }
+}
+
+/**
+ * @brief sends queued bytes on CAN S within the bandwidth cap
+ *
+ * @details the stream is the same byte stream sent over the UART, split into
+ *          frames of up to 8 bytes:
+ *
+ *          | sequence number (8) | log bytes (up to 56) |
+ *
+ *          the sequence number counts frames and wraps, so a receiver can
+ *          spot lost frames and resynchronise at the next line / frame
+ *          delimiter. The cap is a token bucket, credit builds up at
+ *          stream_bytes_per_sec to at most stream_burst_bytes and each frame
+ *          uses up its length. The stream ID is chosen so that the stream
+ *          loses arbitration to the canbc broadcasts.
+ *
+ * @param log_ptr the logging service context
+ */
+void log_can_send(log_context_t* log_ptr)
+{
+    const config_log_t* config_ptr = log_ptr->config_ptr;
+    const uint32_t rate = config_ptr->stream_bytes_per_sec;
+    const uint32_t max_credit
+        = config_ptr->stream_burst_bytes * TX_TIMER_TICKS_PER_SECOND;
+
+    if (log_ptr->rtcan_s_ptr == NULL || rate == 0)
+        return;
+
+    // build up credit for the time since the last update
+    const ULONG now = tx_time_get();
+    const ULONG elapsed = now - log_ptr->can_credit_time;
+    log_ptr->can_credit_time = now;
+
+    if (elapsed >= (max_credit - log_ptr->can_credit) / rate)
+    {
+        log_ptr->can_credit = max_credit;
+    }
+    else
+    {
+        log_ptr->can_credit += elapsed * rate;
+    }
+
+    // send as many frames as there is credit for
+    uint32_t backlog = log_ptr->can_head - log_ptr->can_tail;
+
+    while (backlog > 0)
+    {
+        const uint32_t payload_len = (backlog < LOG_CAN_FRAME_PAYLOAD)
+                                         ? backlog
+                                         : LOG_CAN_FRAME_PAYLOAD;
+        const uint32_t cost = (payload_len + 1) * TX_TIMER_TICKS_PER_SECOND;
+
+        if (log_ptr->can_credit < cost)
+            break;
+
+        rtcan_msg_t msg = {.identifier = config_ptr->stream_can_id,
+                           .length = payload_len + 1,
+                           .extended = false};
+
+        msg.data[0] = log_ptr->can_seq;
+
+        for (uint32_t i = 0; i < payload_len; i++)
+        {
+            msg.data[i + 1]
+                = log_ptr->can_buf[(log_ptr->can_tail + i)
+                                   & (LOG_CAN_BUFFER_SIZE - 1)];
+        }
+
+        // try again later if RTCAN can't take the frame
+        if (rtcan_transmit(log_ptr->rtcan_s_ptr, &msg) != RTCAN_OK)
+            break;
+
+        log_ptr->can_credit -= cost;
+        log_ptr->can_tail += payload_len;
+        log_ptr->can_seq++;
+        log_ptr->stats.can_frames++;
+        backlog -= payload_len;
+    }
+}
+
+/**
+ * @brief gets how long the log thread can sleep before its next housekeeping
+ *
+ * @details this is shortened while there are bytes waiting for CAN S, to
+ *          when there will be enough credit for the next frame
+ *
+ * @param log_ptr the logging service context
+ * @return ULONG ticks to wait
+ */
+ULONG log_can_wait_ticks(const log_context_t* log_ptr)
+{
+    const uint32_t backlog = log_ptr->can_head - log_ptr->can_tail;
+    const uint32_t rate = log_ptr->config_ptr->stream_bytes_per_sec;
+
+    if (backlog == 0 || rate == 0)
+        return LOG_HOUSEKEEPING_TICKS;
+
+    const uint32_t payload_len
+        = (backlog < LOG_CAN_FRAME_PAYLOAD) ? backlog : LOG_CAN_FRAME_PAYLOAD;
+    const uint32_t cost = (payload_len + 1) * TX_TIMER_TICKS_PER_SECOND;
+
+    if (log_ptr->can_credit >= cost)
+        return 1;
+
+    const ULONG ticks = (cost - log_ptr->can_credit + rate - 1) / rate;
+
+    return (ticks < LOG_HOUSEKEEPING_TICKS) ? ticks : LOG_HOUSEKEEPING_TICKS;
+}
+
+/**
+ * @brief handles the UART TX complete callback
+ *
+ * @details called from interrupt context when a DMA transfer has finished,
+ *          releases the log thread to start the next transfer
+ *
+ * @param log_ptr the logging service context
+ * @param huart UART handle passed to the callback
+ */
+void log_handle_uart_tx_cplt(log_context_t* log_ptr, UART_HandleTypeDef* huart)
+{
+    if (huart != log_ptr->config_ptr->uart)
+        return;
+
+    atomic_fetch_and(&log_ptr->error, ~LOG_ERROR_UART);
+    log_ptr->tx_done_time = tx_time_get();
+    tx_semaphore_ceiling_put(&log_ptr->tx_done_sem, 1);
+}
+
+/**
+ * @brief handles the UART error callback
+ *
+ * @details the HAL aborts the transfer on error, so the log thread is released
+ *          to carry on with the next batch
+ *
+ * @param log_ptr the logging service context
+ * @param huart UART handle passed to the callback
+ */
+void log_handle_uart_err(log_context_t* log_ptr, UART_HandleTypeDef* huart)
+{
+    if (huart != log_ptr->config_ptr->uart)
+        return;
+
+    atomic_fetch_or(&log_ptr->error, LOG_ERROR_UART);
+    log_ptr->stats.uart_dropped += log_ptr->batch_sent.count;
+    memset(&log_ptr->batch_sent, 0, sizeof(log_ptr->batch_sent));
+    tx_semaphore_ceiling_put(&log_ptr->tx_done_sem, 1);
+}
+
+/**
+ * @brief encodes a queued log message into the bytes sent over the UART
+ *
+ * @details in text mode this is a formatted line, in binary mode this is a
+ *          COBS encoded frame terminated by a zero byte:
+ *
+ *          | level (4 bits) | argc (4 bits) | fmt ID | timestamp | args... |
+ *
+ *          where the fmt ID, timestamp and arguments are unsigned LEB128
+ *
+ * @param msg_ptr message to encode
+ * @param buf output buffer
+ * @param buf_len size of output buffer
+ * @return uint32_t number of bytes written to the buffer
+ */
+uint32_t log_encode_msg(const log_msg_t* msg_ptr,
+                        uint8_t* buf,
+                        uint32_t buf_len)
+{
+#ifndef LOG_BINARY_MODE
+    // format the log message
+    const uint32_t len = str_format((char*) buf,
+                                    buf_len,
+                                    "%lu [%s]: %s",
+                                    msg_ptr->timestamp,
+                                    log_level_names[msg_ptr->level],
+                                    msg_ptr->msg);
+
+    return (len < buf_len) ? len : buf_len - 1;
+#else
+    // worst case is 5 bytes per LEB128 value, plus the header byte
+    uint8_t frame[1 + 5 * (2 + LOG_MSG_MAX_ARGS)];
+    uint32_t len = 0;
+
+    frame[len++] = (uint8_t) ((msg_ptr->level << 4) | msg_ptr->argc);
+    len += encode_varint(msg_ptr->fmt_id, &frame[len]);
+    len += encode_varint(msg_ptr->timestamp, &frame[len]);
+
+    for (uint32_t i = 0; i < msg_ptr->argc; i++)
+    {
+        len += encode_varint(msg_ptr->args[i], &frame[len]);
+    }
+
+    // COBS adds one byte of overhead for this frame size, plus the delimiter
+    if (len + 2 > buf_len)
+        return 0;
+
+    len = encode_cobs(frame, len, buf);
+    buf[len++] = 0x00;
+
+    return len;
+#endif
+}
+
+#ifdef LOG_BINARY_MODE
+
+/**
+ * @brief encodes a value as unsigned LEB128
+ *
+ * @param value value to encode
+ * @param buf output buffer (at least 5 bytes)
+ * @return uint32_t number of bytes written
+ */
+uint32_t encode_varint(uint32_t value, uint8_t* buf)
+{
+    uint32_t len = 0;
+
+    do
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+
+        if (value != 0)
+            byte |= 0x80;
+
+        buf[len++] = byte;
+    } while (value != 0);
+
+    return len;
+}
+
+/**
+ * @brief consistent overhead byte stuffing (COBS) encoder
+ *
+ * @details removes all zero bytes from the frame so that zero can be used as
+ *          a frame delimiter. Only valid for frames shorter than 254 bytes.
+ *
+ * @param src frame to encode
+ * @param src_len length of frame
+ * @param dst output buffer (at least src_len + 1 bytes)
+ * @return uint32_t number of bytes written
+ */
+uint32_t encode_cobs(const uint8_t* src, uint32_t src_len, uint8_t* dst)
+{
+    uint32_t code_idx = 0;
+    uint32_t dst_idx = 1;
+    uint8_t code = 1;
+
+    for (uint32_t i = 0; i < src_len; i++)
+    {
+        if (src[i] == 0x00)
+        {
+            dst[code_idx] = code;
+            code_idx = dst_idx++;
+            code = 1;
         }
         else
         {
-            log_ptr->error &= ~LOG_ERROR_UART;
+            dst[dst_idx++] = src[i];
+            code++;
         }
     }
+
+    dst[code_idx] = code;
+
+    return dst_idx;
 }
+
+#endif
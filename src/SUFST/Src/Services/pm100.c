@@ -1,7 +1,13 @@
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_PM100
+
 #include "pm100.h"
 
 #include <can_c.h>
 #include <can_s.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "irq_lock.h"
 
 #define PM100_NO_FAULTS                    0x00
 
@@ -30,12 +36,112 @@
 #define PM100_DIRECTION_FORWARD            0x1
 #define PM100_DIRECTION_REVERSE            0x0
 
+/**
+ * @brief   Broadcast frame descriptor
+ */
+typedef struct
+{
+    uint32_t frame_id; // CAN ID
+    size_t offset;     // field in pm100_snapshot_t
+    size_t size;       // size of the field
+
+    // cantools unpack function
+    int (*unpack)(void* dst_ptr, const uint8_t* src_ptr, size_t size);
+
+    // called with each decoded frame, or NULL
+    void (*handler)(pm100_context_t* pm100_ptr, const void* frame_ptr);
+} pm100_broadcast_t;
+
+/**
+ * @brief   Storage for any one decoded broadcast frame
+ */
+typedef union
+{
+    struct can_c_pm100_internal_states_t states;
+    struct can_c_pm100_fault_codes_t faults;
+    struct can_c_pm100_temperature_set_1_t temp1;
+    struct can_c_pm100_temperature_set_2_t temp2;
+    struct can_c_pm100_temperature_set_3_t temp3;
+    struct can_c_pm100_motor_position_info_t info;
+    struct can_c_pm100_current_info_t current;
+    struct can_c_pm100_voltage_info_t voltage;
+    struct can_c_pm100_flux_info_t flux;
+    struct can_c_pm100_torque_and_timer_info_t torque;
+    struct can_c_pm100_modulation_index_and_flux_weakening_output_info_t
+        modulation;
+} pm100_frame_t;
+
 /*
  * internal function prototypes
  */
 static void pm100_thread_entry(ULONG input);
+static status_t build_broadcast_lut(pm100_context_t* pm100_ptr);
 static void process_broadcast(pm100_context_t* pm100_ptr,
                               const rtcan_msg_t* msg_ptr);
+static void handle_faults(pm100_context_t* pm100_ptr, const void* frame_ptr);
+static status_t apply_msg_config(pm100_context_t* pm100_ptr);
+static status_t build_torque_msg(pm100_context_t* pm100_ptr);
+static UINT begin_write(pm100_context_t* pm100_ptr);
+static void end_write(pm100_context_t* pm100_ptr, UINT irq_state);
+static void set_broadcasts_valid(pm100_context_t* pm100_ptr, bool valid);
+
+/**
+ * @brief       Defines a type-erased wrapper for a cantools unpack function
+ */
+#define PM100_UNPACK(name)                                                     \
+    static int unpack_##name(void* dst_ptr,                                    \
+                             const uint8_t* src_ptr,                           \
+                             size_t size)                                      \
+    {                                                                          \
+        return can_c_pm100_##name##_unpack(dst_ptr, src_ptr, size);            \
+    }
+
+PM100_UNPACK(internal_states)
+PM100_UNPACK(fault_codes)
+PM100_UNPACK(temperature_set_1)
+PM100_UNPACK(temperature_set_2)
+PM100_UNPACK(temperature_set_3)
+PM100_UNPACK(motor_position_info)
+PM100_UNPACK(current_info)
+PM100_UNPACK(voltage_info)
+PM100_UNPACK(flux_info)
+PM100_UNPACK(torque_and_timer_info)
+PM100_UNPACK(modulation_index_and_flux_weakening_output_info)
+
+/**
+ * @brief       Defines a broadcast table entry
+ */
+#define PM100_BROADCAST(id, name, field, handler_func)                         \
+    {                                                                          \
+        .frame_id = CAN_C_PM100_##id##_FRAME_ID, .unpack = unpack_##name,      \
+        .offset = offsetof(pm100_snapshot_t, field),                           \
+        .size = sizeof(((pm100_snapshot_t*) 0)->field),                        \
+        .handler = handler_func                                                \
+    }
+
+/*
+ * broadcast frames subscribed to and decoded into the snapshot
+ *
+ * decimation and max age of each frame are in the PM100 config
+ */
+static const pm100_broadcast_t broadcasts[] = {
+    PM100_BROADCAST(INTERNAL_STATES, internal_states, states, NULL),
+    PM100_BROADCAST(FAULT_CODES, fault_codes, faults, handle_faults),
+    PM100_BROADCAST(TEMPERATURE_SET_1, temperature_set_1, temp1, NULL),
+    PM100_BROADCAST(TEMPERATURE_SET_2, temperature_set_2, temp2, NULL),
+    PM100_BROADCAST(TEMPERATURE_SET_3, temperature_set_3, temp3, NULL),
+    PM100_BROADCAST(MOTOR_POSITION_INFO, motor_position_info, info, NULL),
+    PM100_BROADCAST(CURRENT_INFO, current_info, current, NULL),
+    PM100_BROADCAST(VOLTAGE_INFO, voltage_info, voltage, NULL),
+    PM100_BROADCAST(FLUX_INFO, flux_info, flux, NULL),
+    PM100_BROADCAST(TORQUE_AND_TIMER_INFO, torque_and_timer_info, torque, NULL),
+    PM100_BROADCAST(MODULATION_INDEX_AND_FLUX_WEAKENING_OUTPUT_INFO,
+                    modulation_index_and_flux_weakening_output_info,
+                    modulation,
+                    NULL),
+};
+
+#define PM100_NUM_BROADCASTS (sizeof(broadcasts) / sizeof(broadcasts[0]))
 
 /**
  * @brief   Initialises the PM100 service
@@ -56,9 +162,29 @@ status_t pm100_init(pm100_context_t* pm100_ptr,
     pm100_ptr->rtcan_c_ptr = rtcan_c_ptr;
     pm100_ptr->rtcan_s_ptr = rtcan_s_ptr;
     pm100_ptr->error = PM100_ERROR_NONE;
-    pm100_ptr->broadcasts_valid = false;
+    memset(&pm100_ptr->shared, 0, sizeof(pm100_ptr->shared));
+    atomic_init(&pm100_ptr->shared_seq, 0);
 
-    status_t status = STATUS_OK;
+    status_t status = build_broadcast_lut(pm100_ptr);
+
+    if (status == STATUS_OK)
+    {
+        status = apply_msg_config(pm100_ptr);
+    }
+
+    if (status != STATUS_OK)
+    {
+        LOG_ERROR("Invalid PM100 broadcast table\n");
+        return status;
+    }
+
+    status = build_torque_msg(pm100_ptr);
+
+    if (status != STATUS_OK)
+    {
+        LOG_ERROR("PM100 torque command layout mismatch\n");
+        return status;
+    }
 
     // create service thread
     void* stack_ptr = NULL;
@@ -91,12 +217,6 @@ status_t pm100_init(pm100_context_t* pm100_ptr,
                                     sizeof(pm100_ptr->can_rx_queue_mem));
     }
 
-    // create state mutex
-    if (tx_status == TX_SUCCESS)
-    {
-        tx_status = tx_mutex_create(&pm100_ptr->state_mutex, NULL, TX_INHERIT);
-    }
-
     if (tx_status != TX_SUCCESS)
     {
         status = STATUS_ERROR;
@@ -116,6 +236,36 @@ status_t pm100_init(pm100_context_t* pm100_ptr,
     return status;
 }
 
+/**
+ * @brief   Packs the torque command message sent by pm100_request_torque()
+ *
+ * @details The torque is patched in with pm100_patch_torque() on every
+ *          request, so the patched bytes are checked against a message
+ *          packed by cantools in case the DBC layout changes
+ *
+ * @param[in]   pm100_ptr   PM100 context
+ */
+static status_t build_torque_msg(pm100_context_t* pm100_ptr)
+{
+    static const uint16_t test_torque = 0xA55A;
+
+    rtcan_msg_t packed;
+    rtcan_msg_t patched;
+
+    pm100_pack_torque_command(test_torque, &packed);
+    pm100_pack_torque_command(0, &patched);
+    pm100_patch_torque(&patched, test_torque);
+
+    if (memcmp(packed.data, patched.data, sizeof(packed.data)) != 0)
+    {
+        return STATUS_ERROR;
+    }
+
+    pm100_pack_torque_command(0, &pm100_ptr->torque_msg);
+
+    return STATUS_OK;
+}
+
 /**
  * @brief   PM100 service thread entry function
  *
@@ -128,25 +278,18 @@ void pm100_thread_entry(ULONG input)
     const config_pm100_t* config_ptr = pm100_ptr->config_ptr;
 
     // set up RTCAN subscriptions
-    uint32_t subscriptions[] = {CAN_C_PM100_INTERNAL_STATES_FRAME_ID,
-                                CAN_C_PM100_FAULT_CODES_FRAME_ID,
-                                CAN_C_PM100_TEMPERATURE_SET_1_FRAME_ID,
-                                CAN_C_PM100_TEMPERATURE_SET_2_FRAME_ID,
-                                CAN_C_PM100_TEMPERATURE_SET_3_FRAME_ID,
-                                CAN_C_PM100_MOTOR_POSITION_INFO_FRAME_ID};
-
-    for (uint32_t i = 0; i < sizeof(subscriptions) / sizeof(subscriptions[0]);
-         i++)
+    for (uint32_t i = 0; i < PM100_NUM_BROADCASTS; i++)
     {
         rtcan_status_t status = rtcan_subscribe(pm100_ptr->rtcan_c_ptr,
-                                                subscriptions[i],
+                                                broadcasts[i].frame_id,
                                                 &pm100_ptr->can_rx_queue);
 
         if (status != RTCAN_OK)
         {
             // TODO: update broadcast states with error
-            LOG_ERROR(
-                "Could not subscribe on %d message. Terminating thread\n");
+            LOG_ERROR("Could not subscribe on 0x%lX message. Terminating "
+                      "thread\n",
+                      broadcasts[i].frame_id);
             tx_thread_terminate(&pm100_ptr->thread);
         }
     }
@@ -163,12 +306,12 @@ void pm100_thread_entry(ULONG input)
         {
             // timed out
             // TODO: error
-            pm100_ptr->broadcasts_valid = false;
-            LOG_INFO("PM100 broadcast timeout\n");
+            set_broadcasts_valid(pm100_ptr, false);
+            LOG_INFO_LIMITED(1000, "PM100 broadcast timeout\n");
         }
         else if (status == TX_SUCCESS && msg_ptr != NULL)
         {
-            pm100_ptr->broadcasts_valid = true;
+            set_broadcasts_valid(pm100_ptr, true);
             process_broadcast(pm100_ptr, msg_ptr);
             rtcan_msg_consumed(pm100_ptr->rtcan_c_ptr, msg_ptr);
         }
@@ -180,88 +323,251 @@ void pm100_thread_entry(ULONG input)
 }
 
 /**
- * @brief   Processes incoming broadcast messages
+ * @brief   Builds the lookup from CAN ID to broadcast table entry
+ *
+ * @details Every frame ID must be in the broadcast ID span, and appear only
+ *          once. Every frame must fit in pm100_frame_t.
  *
  * @param[in]   pm100_ptr   PM100 context
- * @param[in]   msg_ptr     Incoming message
  */
-void process_broadcast(pm100_context_t* pm100_ptr, const rtcan_msg_t* msg_ptr)
+static status_t build_broadcast_lut(pm100_context_t* pm100_ptr)
 {
-    switch (msg_ptr->identifier)
-    {
-    case CAN_C_PM100_INTERNAL_STATES_FRAME_ID:
+    memset(pm100_ptr->broadcast_lut, 0, sizeof(pm100_ptr->broadcast_lut));
+    memset(pm100_ptr->decimation_count,
+           0,
+           sizeof(pm100_ptr->decimation_count));
+
+    for (uint32_t i = 0; i < PM100_NUM_BROADCASTS; i++)
     {
-        can_c_pm100_internal_states_unpack(&pm100_ptr->states,
-                                           msg_ptr->data,
-                                           msg_ptr->length);
+        const uint32_t idx = broadcasts[i].frame_id - PM100_BROADCAST_BASE_ID;
+
+        if (idx >= PM100_BROADCAST_ID_SPAN
+            || pm100_ptr->broadcast_lut[idx] != 0
+            || broadcasts[i].size > sizeof(pm100_frame_t))
+        {
+            return STATUS_ERROR;
+        }
+
+        pm100_ptr->broadcast_lut[idx] = i + 1;
+    }
+
+    return STATUS_OK;
+}
+
+/**
+ * @brief   Sets the decimation and max age of each broadcast frame
+ *
+ * @details Frames not in the config are decoded every time and never go
+ *          stale. Every frame in the config must be in the broadcast table,
+ *          and frames with a handler can't be decimated.
+ *
+ * @param[in]   pm100_ptr   PM100 context
+ */
+static status_t apply_msg_config(pm100_context_t* pm100_ptr)
+{
+    const config_pm100_t* config_ptr = pm100_ptr->config_ptr;
 
-        break;
+    for (uint32_t idx = 0; idx < PM100_BROADCAST_ID_SPAN; idx++)
+    {
+        pm100_ptr->decimation[idx] = 1;
+        pm100_ptr->max_age_ticks[idx] = 0;
     }
 
-    case CAN_C_PM100_FAULT_CODES_FRAME_ID:
+    for (uint32_t i = 0; i < config_ptr->msgs_len; i++)
     {
-        can_c_pm100_fault_codes_unpack(&pm100_ptr->faults,
-                                       msg_ptr->data,
-                                       msg_ptr->length);
+        const config_pm100_msg_t* msg_ptr = &config_ptr->msgs[i];
+        const uint32_t idx = msg_ptr->frame_id - PM100_BROADCAST_BASE_ID;
 
-        if (pm100_ptr->faults.pm100_run_fault_hi != PM100_NO_FAULTS
-            || pm100_ptr->faults.pm100_post_fault_lo != PM100_NO_FAULTS)
+        if (idx >= PM100_BROADCAST_ID_SPAN || pm100_ptr->broadcast_lut[idx] == 0
+            || msg_ptr->decimation == 0)
         {
-            pm100_ptr->error |= PM100_ERROR_RUN_FAULT;
-            (void) pm100_disable(pm100_ptr);
-        }
-        else if (pm100_ptr->faults.pm100_post_fault_hi != PM100_NO_FAULTS
-                 || pm100_ptr->faults.pm100_post_fault_lo != PM100_NO_FAULTS)
-        {
-            pm100_ptr->error |= PM100_ERROR_POST_FAULT;
-            (void) pm100_disable(pm100_ptr);
+            return STATUS_ERROR;
         }
 
-        break;
-    }
+        const pm100_broadcast_t* broadcast_ptr
+            = &broadcasts[pm100_ptr->broadcast_lut[idx] - 1];
 
-    case CAN_C_PM100_TEMPERATURE_SET_1_FRAME_ID:
-    {
-        can_c_pm100_temperature_set_1_unpack(&pm100_ptr->temp1,
-                                             msg_ptr->data,
-                                             msg_ptr->length);
+        if (broadcast_ptr->handler != NULL && msg_ptr->decimation != 1)
+            return STATUS_ERROR;
 
-        break;
+        pm100_ptr->decimation[idx] = msg_ptr->decimation;
+        pm100_ptr->max_age_ticks[idx] = msg_ptr->max_age_ticks;
     }
 
-    case CAN_C_PM100_TEMPERATURE_SET_2_FRAME_ID:
+    return STATUS_OK;
+}
+
+/**
+ * @brief   Processes incoming broadcast messages
+ *
+ * @details The table entry is found directly from the CAN ID. Each frame is
+ *          decoded into a local copy first, so the shared states are only
+ *          written for as long as it takes to copy it in. A frame which
+ *          fails to decode (e.g. too short) is dropped, leaving the previous
+ *          values and receive time in place.
+ *
+ * @param[in]   pm100_ptr   PM100 context
+ * @param[in]   msg_ptr     Incoming message
+ */
+void process_broadcast(pm100_context_t* pm100_ptr, const rtcan_msg_t* msg_ptr)
+{
+    const uint32_t idx = msg_ptr->identifier - PM100_BROADCAST_BASE_ID;
+
+    if (msg_ptr->extended || idx >= PM100_BROADCAST_ID_SPAN
+        || pm100_ptr->broadcast_lut[idx] == 0)
     {
-        can_c_pm100_temperature_set_2_unpack(&pm100_ptr->temp2,
-                                             msg_ptr->data,
-                                             msg_ptr->length);
+        return;
+    }
+
+    const pm100_broadcast_t* broadcast_ptr
+        = &broadcasts[pm100_ptr->broadcast_lut[idx] - 1];
+
+    if (++pm100_ptr->decimation_count[idx] < pm100_ptr->decimation[idx])
+        return;
 
-        break;
-        can_c_pm100_temperature_set_2_unpack(&pm100_ptr->temp2,
-                                             msg_ptr->data,
-                                             msg_ptr->length);
+    pm100_ptr->decimation_count[idx] = 0;
 
-        break;
+    pm100_frame_t frame;
+
+    if (broadcast_ptr->unpack(&frame, msg_ptr->data, msg_ptr->length) < 0)
+    {
+        LOG_WARN_LIMITED(1000,
+                         "Failed to decode PM100 broadcast 0x%lX\n",
+                         msg_ptr->identifier);
+        return;
     }
 
-    case CAN_C_PM100_TEMPERATURE_SET_3_FRAME_ID:
+    const ULONG now = tx_time_get();
+    const UINT irq_state = begin_write(pm100_ptr);
+
+    memcpy((uint8_t*) &pm100_ptr->shared + broadcast_ptr->offset,
+           &frame,
+           broadcast_ptr->size);
+
+    pm100_ptr->shared.rx_time[idx] = now;
+    pm100_ptr->shared.received |= 1U << idx;
+
+    end_write(pm100_ptr, irq_state);
+
+    if (broadcast_ptr->handler != NULL)
     {
-        can_c_pm100_temperature_set_3_unpack(&pm100_ptr->temp3,
-                                             msg_ptr->data,
-                                             msg_ptr->length);
+        broadcast_ptr->handler(pm100_ptr, &frame);
+    }
+}
+
+/**
+ * @brief   Disables the inverter if the fault codes frame reports a fault
+ *
+ * @param[in]   pm100_ptr   PM100 context
+ * @param[in]   frame_ptr   Decoded fault codes
+ */
+static void handle_faults(pm100_context_t* pm100_ptr, const void* frame_ptr)
+{
+    const struct can_c_pm100_fault_codes_t* faults_ptr = frame_ptr;
 
-        break;
+    if (faults_ptr->pm100_run_fault_hi != PM100_NO_FAULTS
+        || faults_ptr->pm100_run_fault_lo != PM100_NO_FAULTS)
+    {
+        pm100_ptr->error |= PM100_ERROR_RUN_FAULT;
+        (void) pm100_disable(pm100_ptr);
+    }
+    else if (faults_ptr->pm100_post_fault_hi != PM100_NO_FAULTS
+             || faults_ptr->pm100_post_fault_lo != PM100_NO_FAULTS)
+    {
+        pm100_ptr->error |= PM100_ERROR_POST_FAULT;
+        (void) pm100_disable(pm100_ptr);
     }
+}
+
+/**
+ * @brief       Starts writing the shared broadcast states
+ *
+ * @details     Interrupts are disabled while writing so a reader can never
+ *              preempt a half finished write and retry forever. The sequence
+ *              number is odd while the states are being written.
+ *
+ * @param[in]   pm100_ptr   PM100 context
+ *
+ * @return      Interrupt state to pass to end_write()
+ */
+static UINT begin_write(pm100_context_t* pm100_ptr)
+{
+    const UINT irq_state = irq_lock();
+
+    atomic_fetch_add_explicit(&pm100_ptr->shared_seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    return irq_state;
+}
+
+/**
+ * @brief       Finishes writing the shared broadcast states
+ *
+ * @param[in]   pm100_ptr   PM100 context
+ * @param[in]   irq_state   Value returned by begin_write()
+ */
+static void end_write(pm100_context_t* pm100_ptr, UINT irq_state)
+{
+    atomic_fetch_add_explicit(&pm100_ptr->shared_seq, 1, memory_order_release);
+    irq_unlock(irq_state);
+}
 
-    case CAN_C_PM100_MOTOR_POSITION_INFO_FRAME_ID:
+/**
+ * @brief       Sets whether broadcasts are being received
+ *
+ * @param[in]   pm100_ptr   PM100 context
+ * @param[in]   valid       True if a broadcast was received in time
+ */
+static void set_broadcasts_valid(pm100_context_t* pm100_ptr, bool valid)
+{
+    if (pm100_ptr->shared.broadcasts_valid != valid)
     {
-        can_c_pm100_motor_position_info_unpack(&pm100_ptr->info,
-                                               msg_ptr->data,
-                                               msg_ptr->length);
-        break;
+        const UINT irq_state = begin_write(pm100_ptr);
+        pm100_ptr->shared.broadcasts_valid = valid;
+        end_write(pm100_ptr, irq_state);
     }
+}
 
-    default:
-        break;
+/**
+ * @brief       Takes a consistent copy of the PM100 broadcast states
+ *
+ * @details     Lock free, the copy is retried if a broadcast is decoded at
+ *              the same time. Safe to call from any thread. Frames which have
+ *              never been decoded, or were decoded longer ago than their max
+ *              age, are marked stale.
+ *
+ * @param[in]   pm100_ptr       PM100 context
+ * @param[out]  snapshot_ptr    Copy of the states
+ */
+void pm100_snapshot(pm100_context_t* pm100_ptr, pm100_snapshot_t* snapshot_ptr)
+{
+    uint32_t seq;
+
+    do
+    {
+        seq = atomic_load_explicit(&pm100_ptr->shared_seq,
+                                   memory_order_acquire);
+
+        memcpy(snapshot_ptr, &pm100_ptr->shared, sizeof(*snapshot_ptr));
+        atomic_thread_fence(memory_order_acquire);
+
+    } while ((seq & 1) != 0
+             || seq != atomic_load_explicit(&pm100_ptr->shared_seq,
+                                            memory_order_relaxed));
+
+    // ages from after the copy, so no frame can be newer than the snapshot
+    snapshot_ptr->time = tx_time_get();
+    snapshot_ptr->stale = ~snapshot_ptr->received;
+
+    for (uint32_t idx = 0; idx < PM100_BROADCAST_ID_SPAN; idx++)
+    {
+        const uint32_t max_age = pm100_ptr->max_age_ticks[idx];
+
+        if (max_age != 0
+            && snapshot_ptr->time - snapshot_ptr->rx_time[idx] > max_age)
+        {
+            snapshot_ptr->stale |= 1U << idx;
+        }
     }
 }
 
@@ -288,95 +594,134 @@ status_t pm100_lvs_on(pm100_context_t* pm100_ptr)
 }
 
 /**
- * @brief       Checks if the PM100 is precharged
+ * @brief       Checks if a broadcast frame was decoded within its max age
  *
- * @param[in]   pm100_ptr   PM100 context
+ * @param[in]   snapshot_ptr    PM100 states from pm100_snapshot()
+ * @param[in]   frame_id        CAN ID of the frame
  */
-bool pm100_is_precharged(pm100_context_t* pm100_ptr)
+bool pm100_is_fresh(const pm100_snapshot_t* snapshot_ptr, uint32_t frame_id)
 {
-    UINT tx_status
-        = tx_mutex_get(&pm100_ptr->state_mutex,
-                       pm100_ptr->config_ptr->precharge_timeout_ticks);
+    const uint32_t idx = frame_id - PM100_BROADCAST_BASE_ID;
 
-    bool broadcasts_valid = false;
-    uint8_t vsm_state = PM100_VSM_STATE_FAULT; // assume something safe
+    return idx < PM100_BROADCAST_ID_SPAN
+           && (snapshot_ptr->stale & (1U << idx)) == 0;
+}
 
-    if (tx_status == TX_SUCCESS)
-    {
-        vsm_state = pm100_ptr->states.pm100_vsm_state;
-        broadcasts_valid = pm100_ptr->broadcasts_valid;
-        (void) tx_mutex_put(&pm100_ptr->state_mutex);
-    }
+/**
+ * @brief       Checks if the PM100 is precharged
+ *
+ * @details     A stale internal states frame counts as not precharged
+ *
+ * @param[in]   snapshot_ptr    PM100 states from pm100_snapshot()
+ */
+bool pm100_is_precharged(const pm100_snapshot_t* snapshot_ptr)
+{
+    const uint8_t vsm_state = snapshot_ptr->states.pm100_vsm_state;
 
-    return broadcasts_valid
+    return snapshot_ptr->broadcasts_valid
+           && pm100_is_fresh(snapshot_ptr,
+                             CAN_C_PM100_INTERNAL_STATES_FRAME_ID)
            && (vsm_state == PM100_VSM_STATE_PRECHARGE_COMPLETE
                || vsm_state == PM100_VSM_STATE_WAIT
                || vsm_state == PM100_VSM_STATE_READY
                || vsm_state == PM100_VSM_STATE_RUNNING);
 }
 
-int16_t pm100_max_inverter_temp(pm100_context_t* pm100_ptr)
+/**
+ * @brief       Gets the highest inverter temperature
+ *
+ * @param[in]   snapshot_ptr    PM100 states from pm100_snapshot()
+ * @param[out]  temp_ptr        Temperature
+ *
+ * @return      True if the temperature is fresh
+ */
+bool pm100_max_inverter_temp(const pm100_snapshot_t* snapshot_ptr,
+                             int16_t* temp_ptr)
 {
+    const struct can_c_pm100_temperature_set_1_t* temp1_ptr
+        = &snapshot_ptr->temp1;
     int16_t max_temp = 0;
 
-    UINT tx_status = tx_mutex_get(&pm100_ptr->state_mutex, 100);
-
-    if (tx_status == TX_SUCCESS)
-    {
-        if (pm100_ptr->temp1.pm100_module_a > max_temp)
-            max_temp = pm100_ptr->temp1.pm100_module_a;
-        if (pm100_ptr->temp1.pm100_module_b > max_temp)
-            max_temp = pm100_ptr->temp1.pm100_module_b;
-        if (pm100_ptr->temp1.pm100_module_c > max_temp)
-            max_temp = pm100_ptr->temp1.pm100_module_c;
-        if (pm100_ptr->temp1.pm100_gate_driver_board > max_temp)
-            max_temp = pm100_ptr->temp1.pm100_gate_driver_board;
-        if (pm100_ptr->temp2.pm100_control_board_temperature > max_temp)
-            max_temp = pm100_ptr->temp2.pm100_control_board_temperature;
-
-        tx_mutex_put(&pm100_ptr->state_mutex);
-    }
-    else
-    {
-        LOG_ERROR("Failed to get max temp\n");
-    }
-
-    return max_temp;
+    if (temp1_ptr->pm100_module_a > max_temp)
+        max_temp = temp1_ptr->pm100_module_a;
+    if (temp1_ptr->pm100_module_b > max_temp)
+        max_temp = temp1_ptr->pm100_module_b;
+    if (temp1_ptr->pm100_module_c > max_temp)
+        max_temp = temp1_ptr->pm100_module_c;
+    if (temp1_ptr->pm100_gate_driver_board > max_temp)
+        max_temp = temp1_ptr->pm100_gate_driver_board;
+    if (snapshot_ptr->temp2.pm100_control_board_temperature > max_temp)
+        max_temp = snapshot_ptr->temp2.pm100_control_board_temperature;
+
+    *temp_ptr = max_temp;
+
+    return pm100_is_fresh(snapshot_ptr, CAN_C_PM100_TEMPERATURE_SET_1_FRAME_ID)
+           && pm100_is_fresh(snapshot_ptr,
+                             CAN_C_PM100_TEMPERATURE_SET_2_FRAME_ID);
 }
 
-int16_t pm100_motor_temp(pm100_context_t* pm100_ptr)
+/**
+ * @brief       Gets the motor temperature
+ *
+ * @param[in]   snapshot_ptr    PM100 states from pm100_snapshot()
+ * @param[out]  temp_ptr        Temperature
+ *
+ * @return      True if the temperature is fresh
+ */
+bool pm100_motor_temp(const pm100_snapshot_t* snapshot_ptr, int16_t* temp_ptr)
 {
-    int16_t motor_temp = 0;
+    *temp_ptr = snapshot_ptr->temp3.pm100_motor_temperature;
 
-    UINT tx_status = tx_mutex_get(&pm100_ptr->state_mutex, 100);
-
-    if (tx_status == TX_SUCCESS)
-    {
-        motor_temp = pm100_ptr->temp3.pm100_motor_temperature;
+    return pm100_is_fresh(snapshot_ptr, CAN_C_PM100_TEMPERATURE_SET_3_FRAME_ID);
+}
 
-        tx_mutex_put(&pm100_ptr->state_mutex);
-    }
-    else
-    {
-        LOG_ERROR("Failed to get motor temp\n");
-    }
+/**
+ * @brief       Gets the motor speed
+ *
+ * @param[in]   snapshot_ptr    PM100 states from pm100_snapshot()
+ * @param[out]  speed_ptr       Speed (rpm)
+ *
+ * @return      True if the speed is fresh
+ */
+bool pm100_motor_speed(const pm100_snapshot_t* snapshot_ptr,
+                       int16_t* speed_ptr)
+{
+    *speed_ptr = snapshot_ptr->info.pm100_motor_speed;
 
-    return motor_temp;
+    return pm100_is_fresh(snapshot_ptr,
+                          CAN_C_PM100_MOTOR_POSITION_INFO_FRAME_ID);
 }
 
-int16_t pm100_motor_speed(pm100_context_t* pm100_ptr)
+/**
+ * @brief       Gets the DC bus voltage
+ *
+ * @param[in]   snapshot_ptr    PM100 states from pm100_snapshot()
+ * @param[out]  voltage_ptr     Voltage
+ *
+ * @return      True if the voltage is fresh
+ */
+bool pm100_dc_bus_voltage(const pm100_snapshot_t* snapshot_ptr,
+                          int16_t* voltage_ptr)
 {
-    int16_t speed = 0;
+    *voltage_ptr = snapshot_ptr->voltage.pm100_dc_bus_voltage;
 
-    UINT tx_status = tx_mutex_get(&pm100_ptr->state_mutex, 100);
+    return pm100_is_fresh(snapshot_ptr, CAN_C_PM100_VOLTAGE_INFO_FRAME_ID);
+}
 
-    if (tx_status == TX_SUCCESS)
-    {
-        speed = pm100_ptr->info.pm100_motor_speed;
-        tx_mutex_put(&pm100_ptr->state_mutex);
-    }
+/**
+ * @brief       Gets the DC bus current
+ *
+ * @param[in]   snapshot_ptr    PM100 states from pm100_snapshot()
+ * @param[out]  current_ptr     Current
+ *
+ * @return      True if the current is fresh
+ */
+bool pm100_dc_bus_current(const pm100_snapshot_t* snapshot_ptr,
+                          int16_t* current_ptr)
+{
+    *current_ptr = snapshot_ptr->current.pm100_dc_bus_current;
 
-    return speed;
+    return pm100_is_fresh(snapshot_ptr, CAN_C_PM100_CURRENT_INFO_FRAME_ID);
 }
 
 status_t pm100_lvs_off(pm100_context_t* pm100_ptr)
@@ -416,56 +761,40 @@ status_t pm100_disable(pm100_context_t* pm100_ptr)
  *              lockout. If lockout is successfully exited, the next torque
  *              request will actually be sent.
  *
- * @param[in]   pm100_ptr   PM100 context
- * @param[in]   torque      Desired torque
+ *              The states are checked in the caller's snapshot, so a control
+ *              cycle makes its decisions on one consistent read.
+ *
+ * @param[in]   pm100_ptr       PM100 context
+ * @param[in]   snapshot_ptr    PM100 states from pm100_snapshot()
+ * @param[in]   torque          Desired torque
  */
-status_t pm100_request_torque(pm100_context_t* pm100_ptr, uint16_t torque)
+status_t pm100_request_torque(pm100_context_t* pm100_ptr,
+                              const pm100_snapshot_t* snapshot_ptr,
+                              uint16_t torque)
 {
-
     status_t status = STATUS_OK;
-    const bool is_precharged = pm100_is_precharged(
-        pm100_ptr); // do this before getting mutex to avoid deadlock
     const bool no_errors = (pm100_ptr->error == PM100_ERROR_NONE);
 
-    UINT tx_status
-        = tx_mutex_get(&pm100_ptr->state_mutex,
-                       pm100_ptr->config_ptr->torque_request_timeout_ticks);
-
-    if (no_errors && is_precharged && tx_status == TX_SUCCESS)
+    if (no_errors && pm100_is_precharged(snapshot_ptr))
     {
-        if (pm100_ptr->broadcasts_valid)
+        if (snapshot_ptr->states.pm100_inverter_enable_lockout
+            == PM100_LOCKOUT_DISABLED)
         {
-            if (pm100_ptr->states.pm100_inverter_enable_lockout
-                == PM100_LOCKOUT_DISABLED)
-            {
-                rtcan_msg_t msg
-                    = {.identifier = CAN_C_PM100_COMMAND_MESSAGE_FRAME_ID,
-                       .length = CAN_C_PM100_COMMAND_MESSAGE_LENGTH,
-                       .extended = CAN_C_PM100_COMMAND_MESSAGE_IS_EXTENDED,
-                       .data = {0, 0, 0, 0, 0, 0, 0, 0}};
-
-                struct can_c_pm100_command_message_t cmd
-                    = {.pm100_torque_command = torque,
-                       .pm100_direction_command = PM100_DIRECTION_REVERSE,
-                       .pm100_speed_mode_enable = PM100_SPEED_MODE_DISABLE,
-                       .pm100_inverter_enable = PM100_INVERTER_ON};
-
-                can_c_pm100_command_message_pack(msg.data, &cmd, msg.length);
-
-                LOG_INFO("Sending torque request\n");
-                rtcan_status_t rtcan_status
-                    = rtcan_transmit(pm100_ptr->rtcan_c_ptr, &msg);
-                status = (rtcan_status == RTCAN_OK) ? STATUS_OK : STATUS_ERROR;
-            }
-            else
-            {
-                // to get out of lockout, need to send a disable command
-                LOG_WARN("Still in lockout at torque request\n");
-                status = pm100_disable(pm100_ptr);
-            }
+            // template is read-only after init, so no lock is needed
+            rtcan_msg_t msg = pm100_ptr->torque_msg;
+            pm100_patch_torque(&msg, torque);
+
+            LOG_INFO("Sending torque request\n");
+            rtcan_status_t rtcan_status
+                = rtcan_transmit(pm100_ptr->rtcan_c_ptr, &msg);
+            status = (rtcan_status == RTCAN_OK) ? STATUS_OK : STATUS_ERROR;
+        }
+        else
+        {
+            // to get out of lockout, need to send a disable command
+            LOG_WARN("Still in lockout at torque request\n");
+            status = pm100_disable(pm100_ptr);
         }
-
-        (void) tx_mutex_put(&pm100_ptr->state_mutex);
     }
     else
     {
@@ -476,3 +805,28 @@ status_t pm100_request_torque(pm100_context_t* pm100_ptr, uint16_t torque)
 
     return status;
 }
+
+/**
+ * @brief       Packs a complete torque command message
+ *
+ * @details     This runs the full cantools pack, pm100_request_torque() only
+ *              patches the torque into a message packed here at start up
+ *
+ * @param[in]   torque      Desired torque
+ * @param[out]  msg_ptr     Command message
+ */
+void pm100_pack_torque_command(uint16_t torque, rtcan_msg_t* msg_ptr)
+{
+    struct can_c_pm100_command_message_t cmd
+        = {.pm100_torque_command = torque,
+           .pm100_direction_command = PM100_DIRECTION_REVERSE,
+           .pm100_speed_mode_enable = PM100_SPEED_MODE_DISABLE,
+           .pm100_inverter_enable = PM100_INVERTER_ON};
+
+    msg_ptr->identifier = CAN_C_PM100_COMMAND_MESSAGE_FRAME_ID;
+    msg_ptr->length = CAN_C_PM100_COMMAND_MESSAGE_LENGTH;
+    msg_ptr->extended = CAN_C_PM100_COMMAND_MESSAGE_IS_EXTENDED;
+    memset(msg_ptr->data, 0, sizeof(msg_ptr->data));
+
+    can_c_pm100_command_message_pack(msg_ptr->data, &cmd, msg_ptr->length);
+}
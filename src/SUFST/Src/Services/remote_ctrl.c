@@ -6,6 +6,8 @@
  *on the dyno
  ****************************************************************************/
 
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_REMOTE_CTRL
+
 #include "remote_ctrl.h"
 
 #include "clip_to_range.h"
@@ -273,20 +275,11 @@ uint8_t remote_get_r2d_reading(remote_ctrl_context_t* remote_ctrl_ptr)
 
 void remote_ctrl_update_canbc_states(remote_ctrl_context_t* remote_ctrl_ptr)
 {
-    canbc_states_t* states
-        = canbc_lock_state(remote_ctrl_ptr->canbc_ptr, TX_NO_WAIT);
+    canbc_context_t* canbc_ptr = remote_ctrl_ptr->canbc_ptr;
 
-    if (states != NULL)
-    {
-        states->pdm.brakelight = remote_ctrl_ptr->brakelight_pwr;
-        states->sensors.vcu_apps = remote_ctrl_ptr->requests.sim_apps;
-        states->sensors.vcu_bps = remote_ctrl_ptr->requests.sim_bps;
-        canbc_unlock_state(remote_ctrl_ptr->canbc_ptr);
-    }
-    else
-    {
-        LOG_ERROR("CANBC locking failure\n");
-    }
+    canbc_set_brakelight(canbc_ptr, remote_ctrl_ptr->brakelight_pwr);
+    canbc_set_apps(canbc_ptr, remote_ctrl_ptr->requests.sim_apps);
+    canbc_set_bps(canbc_ptr, remote_ctrl_ptr->requests.sim_bps);
 }
 
 void process_broadcast(remote_ctrl_context_t* remote_ctrl_ptr,
@@ -1,3 +1,5 @@
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_TICK
+
 #include "tick.h"
 
 #define BPS_LIGHT_THRESH 5
@@ -98,15 +100,9 @@ status_t tick_init(tick_context_t* tick_ptr,
 
 void tick_update_canbc_states(tick_context_t* tick_ptr)
 {
-    canbc_states_t* states = canbc_lock_state(tick_ptr->canbc_ptr, TX_NO_WAIT);
-
-    if (states != NULL)
-    {
-        states->pdm.brakelight = tick_ptr->brakelight_pwr;
-        states->sensors.vcu_apps = tick_ptr->apps_reading;
-        states->sensors.vcu_bps = tick_ptr->bps_reading;
-        canbc_unlock_state(tick_ptr->canbc_ptr);
-    }
+    canbc_set_brakelight(tick_ptr->canbc_ptr, tick_ptr->brakelight_pwr);
+    canbc_set_apps(tick_ptr->canbc_ptr, tick_ptr->apps_reading);
+    canbc_set_bps(tick_ptr->canbc_ptr, tick_ptr->bps_reading);
 }
 
 static status_t lock_tick_sensors(tick_context_t* tick_ptr, uint32_t timeout)
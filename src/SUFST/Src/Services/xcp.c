@@ -0,0 +1,961 @@
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_XCP
+
+#include "xcp.h"
+
+#include <stm32f7xx.h>
+#include <string.h>
+
+#include "log.h"
+
+// command codes
+#define XCP_CMD_CONNECT                 0xFF
+#define XCP_CMD_DISCONNECT              0xFE
+#define XCP_CMD_GET_STATUS              0xFD
+#define XCP_CMD_SYNCH                   0xFC
+#define XCP_CMD_GET_COMM_MODE_INFO      0xFB
+#define XCP_CMD_SET_MTA                 0xF6
+#define XCP_CMD_UPLOAD                  0xF5
+#define XCP_CMD_SHORT_UPLOAD            0xF4
+#define XCP_CMD_SET_DAQ_PTR             0xE2
+#define XCP_CMD_WRITE_DAQ               0xE1
+#define XCP_CMD_SET_DAQ_LIST_MODE       0xE0
+#define XCP_CMD_START_STOP_DAQ_LIST     0xDE
+#define XCP_CMD_START_STOP_SYNCH        0xDD
+#define XCP_CMD_GET_DAQ_PROCESSOR_INFO  0xDA
+#define XCP_CMD_GET_DAQ_RESOLUTION_INFO 0xD9
+#define XCP_CMD_GET_DAQ_EVENT_INFO      0xD7
+#define XCP_CMD_FREE_DAQ                0xD6
+#define XCP_CMD_ALLOC_DAQ               0xD5
+#define XCP_CMD_ALLOC_ODT               0xD4
+#define XCP_CMD_ALLOC_ODT_ENTRY         0xD3
+
+// response packet identifiers
+#define XCP_PID_RES 0xFF
+#define XCP_PID_ERR 0xFE
+
+// error codes
+#define XCP_ERR_CMD_SYNCH           0x00
+#define XCP_ERR_DAQ_ACTIVE          0x11
+#define XCP_ERR_CMD_UNKNOWN         0x20
+#define XCP_ERR_OUT_OF_RANGE        0x22
+#define XCP_ERR_ACCESS_DENIED       0x24
+#define XCP_ERR_MODE_NOT_VALID      0x27
+#define XCP_ERR_SEQUENCE            0x29
+#define XCP_ERR_MEMORY_OVERFLOW     0x30
+
+// CONNECT and GET_STATUS fields
+#define XCP_RESOURCE_DAQ            0x04
+#define XCP_SESSION_DAQ_RUNNING     0x40
+#define XCP_PROTOCOL_VERSION        0x01
+#define XCP_TRANSPORT_VERSION       0x01
+#define XCP_DRIVER_VERSION          0x10
+
+// packet sizes
+#define XCP_MAX_CTO 8
+#define XCP_MAX_DTO 8
+
+// DAQ processor, resolution and event properties
+#define XCP_DAQ_CONFIG_DYNAMIC      0x01
+#define XCP_DAQ_KEY_ABSOLUTE_PID    0x00
+#define XCP_ODT_ENTRY_MAX_SIZE      (XCP_MAX_DTO - 1)
+#define XCP_EVENT_DAQ               0x04
+#define XCP_EVENT_TIME_UNIT_1MS     0x06
+
+// SET_DAQ_LIST_MODE bits which aren't supported (STIM, timestamp, PID off)
+#define XCP_DAQ_MODE_UNSUPPORTED    0x32
+
+// WRITE_DAQ bit offset for whole bytes
+#define XCP_NO_BIT_OFFSET 0xFF
+
+// START_STOP_DAQ_LIST and START_STOP_SYNCH modes
+#define XCP_MODE_STOP               0x00
+#define XCP_MODE_START              0x01
+#define XCP_MODE_SELECT             0x02
+
+// dynamic allocation steps, which must be taken in order
+#define XCP_ALLOC_NONE  0
+#define XCP_ALLOC_FREED 1
+#define XCP_ALLOC_DAQ   2
+#define XCP_ALLOC_ODT   3
+#define XCP_ALLOC_ENTRY 4
+
+/*
+ * internal function prototypes
+ */
+static void xcp_thread_entry(ULONG input);
+static uint32_t handle_command(xcp_context_t* xcp_ptr,
+                               const rtcan_msg_t* msg_ptr,
+                               uint8_t* res);
+static uint32_t connect(xcp_context_t* xcp_ptr, uint8_t* res);
+static uint32_t upload(xcp_context_t* xcp_ptr,
+                       uint32_t address,
+                       uint32_t size,
+                       uint8_t* res);
+static uint32_t get_daq_event_info(xcp_context_t* xcp_ptr,
+                                   const uint8_t* cmd,
+                                   uint8_t* res);
+static uint32_t free_daq(xcp_context_t* xcp_ptr, uint8_t* res);
+static uint32_t alloc_daq(xcp_context_t* xcp_ptr,
+                          const uint8_t* cmd,
+                          uint8_t* res);
+static uint32_t alloc_odt(xcp_context_t* xcp_ptr,
+                          const uint8_t* cmd,
+                          uint8_t* res);
+static uint32_t alloc_odt_entry(xcp_context_t* xcp_ptr,
+                                const uint8_t* cmd,
+                                uint8_t* res);
+static uint32_t set_daq_ptr(xcp_context_t* xcp_ptr,
+                            const uint8_t* cmd,
+                            uint8_t* res);
+static uint32_t write_daq(xcp_context_t* xcp_ptr,
+                          const uint8_t* cmd,
+                          uint8_t* res);
+static uint32_t set_daq_list_mode(xcp_context_t* xcp_ptr,
+                                  const uint8_t* cmd,
+                                  uint8_t* res);
+static uint32_t start_stop_daq_list(xcp_context_t* xcp_ptr,
+                                    const uint8_t* cmd,
+                                    uint8_t* res);
+static uint32_t start_stop_synch(xcp_context_t* xcp_ptr,
+                                 const uint8_t* cmd,
+                                 uint8_t* res);
+static void sample_daq(xcp_context_t* xcp_ptr, const xcp_daq_t* daq_ptr);
+static bool is_readable(uint32_t address, uint32_t size);
+static uint32_t odt_size(const xcp_context_t* xcp_ptr, const xcp_odt_t* odt);
+static uint32_t error(uint8_t* res, uint8_t code);
+static uint16_t get_u16(const uint8_t* data);
+static uint32_t get_u32(const uint8_t* data);
+
+// event channel names for GET_DAQ_EVENT_INFO
+static const char* event_names[XCP_NUM_EVENTS] = {"CTRL", "CANBC"};
+
+/**
+ * @brief       Initialises the XCP service
+ *
+ * @param[in]   xcp_ptr         XCP context
+ * @param[in]   rtcan_s_ptr     RTCAN instance for CAN S
+ * @param[in]   stack_pool_ptr  Application memory pool
+ * @param[in]   config_ptr      Configuration
+ */
+status_t xcp_init(xcp_context_t* xcp_ptr,
+                  rtcan_handle_t* rtcan_s_ptr,
+                  TX_BYTE_POOL* stack_pool_ptr,
+                  const config_xcp_t* config_ptr)
+{
+    xcp_ptr->rtcan_s_ptr = rtcan_s_ptr;
+    xcp_ptr->config_ptr = config_ptr;
+    xcp_ptr->connected = false;
+    xcp_ptr->mta = 0;
+    xcp_ptr->daq_count = 0;
+    xcp_ptr->odt_count = 0;
+    xcp_ptr->entry_count = 0;
+    xcp_ptr->alloc_state = XCP_ALLOC_NONE;
+    xcp_ptr->daq_ptr_list = 0;
+    xcp_ptr->daq_ptr_odt = 0;
+    xcp_ptr->daq_ptr_entry = 0;
+    xcp_ptr->overloads = 0;
+    xcp_ptr->missed_events = 0;
+    atomic_init(&xcp_ptr->running, 0);
+
+    // create DAQ mutex
+    UINT tx_status = tx_mutex_create(&xcp_ptr->daq_mutex, NULL, TX_INHERIT);
+
+    // create command queue
+    if (tx_status == TX_SUCCESS)
+    {
+        tx_status = tx_queue_create(&xcp_ptr->rx_queue,
+                                    NULL,
+                                    TX_1_ULONG,
+                                    xcp_ptr->rx_queue_mem,
+                                    sizeof(xcp_ptr->rx_queue_mem));
+    }
+
+    // create service thread
+    void* stack_ptr = NULL;
+
+    if (tx_status == TX_SUCCESS)
+    {
+        tx_status = tx_byte_allocate(stack_pool_ptr,
+                                     &stack_ptr,
+                                     config_ptr->thread.stack_size,
+                                     TX_NO_WAIT);
+    }
+
+    if (tx_status == TX_SUCCESS)
+    {
+        tx_status = tx_thread_create(&xcp_ptr->thread,
+                                     (CHAR*) config_ptr->thread.name,
+                                     xcp_thread_entry,
+                                     (ULONG) xcp_ptr,
+                                     stack_ptr,
+                                     config_ptr->thread.stack_size,
+                                     config_ptr->thread.priority,
+                                     config_ptr->thread.priority,
+                                     TX_NO_TIME_SLICE,
+                                     TX_AUTO_START);
+    }
+
+    return (tx_status == TX_SUCCESS) ? STATUS_OK : STATUS_ERROR;
+}
+
+/**
+ * @brief       XCP service thread
+ *
+ * @details     Handles command frames from the master, sending a response to
+ *              each one
+ *
+ * @param[in]   input   XCP context
+ */
+static void xcp_thread_entry(ULONG input)
+{
+    xcp_context_t* xcp_ptr = (xcp_context_t*) input;
+    const config_xcp_t* config_ptr = xcp_ptr->config_ptr;
+
+    if (rtcan_subscribe(xcp_ptr->rtcan_s_ptr,
+                        config_ptr->cmd_can_id,
+                        &xcp_ptr->rx_queue)
+        != RTCAN_OK)
+    {
+        LOG_ERROR("Failed to subscribe to XCP commands\n");
+        tx_thread_terminate(&xcp_ptr->thread);
+    }
+
+    while (1)
+    {
+        rtcan_msg_t* msg_ptr = NULL;
+
+        if (tx_queue_receive(&xcp_ptr->rx_queue, &msg_ptr, TX_WAIT_FOREVER)
+                != TX_SUCCESS
+            || msg_ptr == NULL)
+        {
+            continue;
+        }
+
+        rtcan_msg_t res = {.identifier = config_ptr->res_can_id,
+                           .extended = false};
+
+        tx_mutex_get(&xcp_ptr->daq_mutex, TX_WAIT_FOREVER);
+        res.length = handle_command(xcp_ptr, msg_ptr, res.data);
+        tx_mutex_put(&xcp_ptr->daq_mutex);
+
+        rtcan_msg_consumed(xcp_ptr->rtcan_s_ptr, msg_ptr);
+
+        if (res.length > 0
+            && rtcan_transmit(xcp_ptr->rtcan_s_ptr, &res) != RTCAN_OK)
+        {
+            LOG_WARN("Failed to send XCP response\n");
+        }
+    }
+}
+
+/**
+ * @brief       Samples the DAQ lists running at an event channel
+ *
+ * @details     Called by the thread which owns the event channel. Each ODT of
+ *              a sampled list is sent as one DTO frame, with the absolute ODT
+ *              number in byte 0. The event is skipped if the master is
+ *              changing the DAQ configuration at the time.
+ *
+ * @param[in]   xcp_ptr     XCP context, may be NULL
+ * @param[in]   event       Event channel
+ */
+void xcp_event(xcp_context_t* xcp_ptr, xcp_event_t event)
+{
+    if (xcp_ptr == NULL
+        || atomic_load_explicit(&xcp_ptr->running, memory_order_relaxed) == 0)
+    {
+        return;
+    }
+
+    // never block the caller
+    if (tx_mutex_get(&xcp_ptr->daq_mutex, TX_NO_WAIT) != TX_SUCCESS)
+    {
+        xcp_ptr->missed_events++;
+        return;
+    }
+
+    const uint32_t running = atomic_load(&xcp_ptr->running);
+
+    for (uint32_t i = 0; i < xcp_ptr->daq_count; i++)
+    {
+        xcp_daq_t* daq_ptr = &xcp_ptr->daq[i];
+
+        if ((running & (1U << i)) == 0 || daq_ptr->event != event)
+            continue;
+
+        if (++daq_ptr->counter >= daq_ptr->prescaler)
+        {
+            daq_ptr->counter = 0;
+            sample_daq(xcp_ptr, daq_ptr);
+        }
+    }
+
+    tx_mutex_put(&xcp_ptr->daq_mutex);
+}
+
+/**
+ * @brief       Handles a command frame
+ *
+ * @details     Commands other than CONNECT are ignored until the master has
+ *              connected
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   msg_ptr     Command frame
+ * @param[out]  res         Response, at most MAX_CTO bytes
+ *
+ * @return      Length of the response, or zero for no response
+ */
+static uint32_t handle_command(xcp_context_t* xcp_ptr,
+                               const rtcan_msg_t* msg_ptr,
+                               uint8_t* res)
+{
+    // pad short commands so fields can be read without checking the length
+    uint8_t cmd[XCP_MAX_CTO] = {0};
+
+    if (msg_ptr->length == 0 || msg_ptr->length > XCP_MAX_CTO)
+        return 0;
+
+    memcpy(cmd, msg_ptr->data, msg_ptr->length);
+
+    if (!xcp_ptr->connected && cmd[0] != XCP_CMD_CONNECT)
+        return 0;
+
+    res[0] = XCP_PID_RES;
+
+    switch (cmd[0])
+    {
+    case XCP_CMD_CONNECT:
+        return connect(xcp_ptr, res);
+
+    case XCP_CMD_DISCONNECT:
+        LOG_INFO("Master disconnected\n");
+        atomic_store(&xcp_ptr->running, 0);
+        xcp_ptr->connected = false;
+        return 1;
+
+    case XCP_CMD_GET_STATUS:
+        res[1] = (atomic_load(&xcp_ptr->running) != 0)
+                     ? XCP_SESSION_DAQ_RUNNING
+                     : 0;
+        res[2] = 0; // no resources protected
+        res[3] = 0;
+        res[4] = 0; // session configuration ID
+        res[5] = 0;
+        return 6;
+
+    case XCP_CMD_SYNCH:
+        return error(res, XCP_ERR_CMD_SYNCH);
+
+    case XCP_CMD_GET_COMM_MODE_INFO:
+        memset(&res[1], 0, XCP_MAX_CTO - 2); // no optional modes
+        res[7] = XCP_DRIVER_VERSION;
+        return 8;
+
+    case XCP_CMD_SET_MTA:
+        xcp_ptr->mta = get_u32(&cmd[4]);
+        return 1;
+
+    case XCP_CMD_UPLOAD:
+        return upload(xcp_ptr, xcp_ptr->mta, cmd[1], res);
+
+    case XCP_CMD_SHORT_UPLOAD:
+        return upload(xcp_ptr, get_u32(&cmd[4]), cmd[1], res);
+
+    case XCP_CMD_GET_DAQ_PROCESSOR_INFO:
+        res[1] = XCP_DAQ_CONFIG_DYNAMIC;
+        res[2] = XCP_MAX_DAQ & 0xFF;
+        res[3] = XCP_MAX_DAQ >> 8;
+        res[4] = XCP_NUM_EVENTS & 0xFF;
+        res[5] = XCP_NUM_EVENTS >> 8;
+        res[6] = 0; // no predefined lists
+        res[7] = XCP_DAQ_KEY_ABSOLUTE_PID;
+        return 8;
+
+    case XCP_CMD_GET_DAQ_RESOLUTION_INFO:
+        res[1] = 1; // DAQ granularity
+        res[2] = XCP_ODT_ENTRY_MAX_SIZE;
+        res[3] = 1; // STIM granularity
+        res[4] = XCP_ODT_ENTRY_MAX_SIZE;
+        res[5] = 0; // no timestamps
+        res[6] = 0;
+        res[7] = 0;
+        return 8;
+
+    case XCP_CMD_GET_DAQ_EVENT_INFO:
+        return get_daq_event_info(xcp_ptr, cmd, res);
+
+    case XCP_CMD_FREE_DAQ:
+        return free_daq(xcp_ptr, res);
+
+    case XCP_CMD_ALLOC_DAQ:
+        return alloc_daq(xcp_ptr, cmd, res);
+
+    case XCP_CMD_ALLOC_ODT:
+        return alloc_odt(xcp_ptr, cmd, res);
+
+    case XCP_CMD_ALLOC_ODT_ENTRY:
+        return alloc_odt_entry(xcp_ptr, cmd, res);
+
+    case XCP_CMD_SET_DAQ_PTR:
+        return set_daq_ptr(xcp_ptr, cmd, res);
+
+    case XCP_CMD_WRITE_DAQ:
+        return write_daq(xcp_ptr, cmd, res);
+
+    case XCP_CMD_SET_DAQ_LIST_MODE:
+        return set_daq_list_mode(xcp_ptr, cmd, res);
+
+    case XCP_CMD_START_STOP_DAQ_LIST:
+        return start_stop_daq_list(xcp_ptr, cmd, res);
+
+    case XCP_CMD_START_STOP_SYNCH:
+        return start_stop_synch(xcp_ptr, cmd, res);
+
+    default:
+        return error(res, XCP_ERR_CMD_UNKNOWN);
+    }
+}
+
+/**
+ * @brief       Handles CONNECT
+ *
+ * @details     Only the DAQ resource is available, and data is little endian
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[out]  res         Response
+ */
+static uint32_t connect(xcp_context_t* xcp_ptr, uint8_t* res)
+{
+    if (!xcp_ptr->connected)
+    {
+        LOG_INFO("Master connected\n");
+    }
+
+    xcp_ptr->connected = true;
+
+    res[1] = XCP_RESOURCE_DAQ;
+    res[2] = 0; // little endian, no block mode
+    res[3] = XCP_MAX_CTO;
+    res[4] = XCP_MAX_DTO & 0xFF;
+    res[5] = XCP_MAX_DTO >> 8;
+    res[6] = XCP_PROTOCOL_VERSION;
+    res[7] = XCP_TRANSPORT_VERSION;
+    return 8;
+}
+
+/**
+ * @brief       Handles UPLOAD and SHORT_UPLOAD
+ *
+ * @details     The MTA is left after the last byte read
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   address     Address to read from
+ * @param[in]   size        Bytes to read
+ * @param[out]  res         Response
+ */
+static uint32_t upload(xcp_context_t* xcp_ptr,
+                       uint32_t address,
+                       uint32_t size,
+                       uint8_t* res)
+{
+    if (size == 0 || size > XCP_MAX_CTO - 1)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    if (!is_readable(address, size))
+        return error(res, XCP_ERR_ACCESS_DENIED);
+
+    memcpy(&res[1], (const void*) address, size);
+    xcp_ptr->mta = address + size;
+
+    return 1 + size;
+}
+
+/**
+ * @brief       Handles GET_DAQ_EVENT_INFO
+ *
+ * @details     The event channel name is read back by UPLOAD from the MTA.
+ *              The cycle time is zero as neither event is strictly periodic.
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   cmd         Command
+ * @param[out]  res         Response
+ */
+static uint32_t get_daq_event_info(xcp_context_t* xcp_ptr,
+                                   const uint8_t* cmd,
+                                   uint8_t* res)
+{
+    const uint16_t event = get_u16(&cmd[2]);
+
+    if (event >= XCP_NUM_EVENTS)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    xcp_ptr->mta = (uint32_t) event_names[event];
+
+    res[1] = XCP_EVENT_DAQ;
+    res[2] = 0xFF; // any number of DAQ lists
+    res[3] = strlen(event_names[event]);
+    res[4] = 0; // cycle time
+    res[5] = XCP_EVENT_TIME_UNIT_1MS;
+    res[6] = 0; // priority
+    return 7;
+}
+
+/**
+ * @brief       Handles FREE_DAQ, releasing all DAQ lists
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[out]  res         Response
+ */
+static uint32_t free_daq(xcp_context_t* xcp_ptr, uint8_t* res)
+{
+    atomic_store(&xcp_ptr->running, 0);
+
+    xcp_ptr->daq_count = 0;
+    xcp_ptr->odt_count = 0;
+    xcp_ptr->entry_count = 0;
+    xcp_ptr->alloc_state = XCP_ALLOC_FREED;
+
+    return 1;
+}
+
+/**
+ * @brief       Handles ALLOC_DAQ
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   cmd         Command
+ * @param[out]  res         Response
+ */
+static uint32_t alloc_daq(xcp_context_t* xcp_ptr,
+                          const uint8_t* cmd,
+                          uint8_t* res)
+{
+    const uint16_t count = get_u16(&cmd[2]);
+
+    if (xcp_ptr->alloc_state != XCP_ALLOC_FREED)
+        return error(res, XCP_ERR_SEQUENCE);
+
+    if (count > XCP_MAX_DAQ)
+        return error(res, XCP_ERR_MEMORY_OVERFLOW);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        xcp_ptr->daq[i] = (xcp_daq_t) {.event = XCP_EVENT_CTRL,
+                                       .prescaler = 1};
+    }
+
+    xcp_ptr->daq_count = count;
+    xcp_ptr->alloc_state = XCP_ALLOC_DAQ;
+
+    return 1;
+}
+
+/**
+ * @brief       Handles ALLOC_ODT
+ *
+ * @details     ODTs are numbered across all lists, so the ODT number in a DTO
+ *              identifies its list
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   cmd         Command
+ * @param[out]  res         Response
+ */
+static uint32_t alloc_odt(xcp_context_t* xcp_ptr,
+                          const uint8_t* cmd,
+                          uint8_t* res)
+{
+    const uint16_t list = get_u16(&cmd[2]);
+    const uint8_t count = cmd[4];
+
+    if (xcp_ptr->alloc_state != XCP_ALLOC_DAQ
+        && xcp_ptr->alloc_state != XCP_ALLOC_ODT)
+    {
+        return error(res, XCP_ERR_SEQUENCE);
+    }
+
+    if (list >= xcp_ptr->daq_count || xcp_ptr->daq[list].odts != 0)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    if (xcp_ptr->odt_count + count > XCP_MAX_ODT)
+        return error(res, XCP_ERR_MEMORY_OVERFLOW);
+
+    xcp_daq_t* daq_ptr = &xcp_ptr->daq[list];
+    daq_ptr->first_odt = xcp_ptr->odt_count;
+    daq_ptr->odts = count;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        xcp_ptr->odt[daq_ptr->first_odt + i] = (xcp_odt_t) {0};
+    }
+
+    xcp_ptr->odt_count += count;
+    xcp_ptr->alloc_state = XCP_ALLOC_ODT;
+
+    return 1;
+}
+
+/**
+ * @brief       Handles ALLOC_ODT_ENTRY
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   cmd         Command
+ * @param[out]  res         Response
+ */
+static uint32_t alloc_odt_entry(xcp_context_t* xcp_ptr,
+                                const uint8_t* cmd,
+                                uint8_t* res)
+{
+    const uint16_t list = get_u16(&cmd[2]);
+    const uint8_t odt_num = cmd[4];
+    const uint8_t count = cmd[5];
+
+    if (xcp_ptr->alloc_state != XCP_ALLOC_ODT
+        && xcp_ptr->alloc_state != XCP_ALLOC_ENTRY)
+    {
+        return error(res, XCP_ERR_SEQUENCE);
+    }
+
+    if (list >= xcp_ptr->daq_count || odt_num >= xcp_ptr->daq[list].odts)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    xcp_odt_t* odt_ptr = &xcp_ptr->odt[xcp_ptr->daq[list].first_odt + odt_num];
+
+    if (odt_ptr->entries != 0)
+        return error(res, XCP_ERR_SEQUENCE);
+
+    if (xcp_ptr->entry_count + count > XCP_MAX_ODT_ENTRIES)
+        return error(res, XCP_ERR_MEMORY_OVERFLOW);
+
+    odt_ptr->first_entry = xcp_ptr->entry_count;
+    odt_ptr->entries = count;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        xcp_ptr->entries[odt_ptr->first_entry + i] = (xcp_odt_entry_t) {0};
+    }
+
+    xcp_ptr->entry_count += count;
+    xcp_ptr->alloc_state = XCP_ALLOC_ENTRY;
+
+    return 1;
+}
+
+/**
+ * @brief       Handles SET_DAQ_PTR
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   cmd         Command
+ * @param[out]  res         Response
+ */
+static uint32_t set_daq_ptr(xcp_context_t* xcp_ptr,
+                            const uint8_t* cmd,
+                            uint8_t* res)
+{
+    const uint16_t list = get_u16(&cmd[2]);
+    const uint8_t odt_num = cmd[4];
+    const uint8_t entry = cmd[5];
+
+    if (list >= xcp_ptr->daq_count || odt_num >= xcp_ptr->daq[list].odts)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    const xcp_odt_t* odt_ptr
+        = &xcp_ptr->odt[xcp_ptr->daq[list].first_odt + odt_num];
+
+    if (entry >= odt_ptr->entries)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    if (atomic_load(&xcp_ptr->running) & (1U << list))
+        return error(res, XCP_ERR_DAQ_ACTIVE);
+
+    xcp_ptr->daq_ptr_list = list;
+    xcp_ptr->daq_ptr_odt = odt_num;
+    xcp_ptr->daq_ptr_entry = entry;
+
+    return 1;
+}
+
+/**
+ * @brief       Handles WRITE_DAQ
+ *
+ * @details     Sets the entry at the DAQ pointer, then moves the pointer to
+ *              the next entry. The entries of an ODT must fit in one DTO.
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   cmd         Command
+ * @param[out]  res         Response
+ */
+static uint32_t write_daq(xcp_context_t* xcp_ptr,
+                          const uint8_t* cmd,
+                          uint8_t* res)
+{
+    const uint8_t size = cmd[2];
+    const uint32_t address = get_u32(&cmd[4]);
+    const uint16_t list = xcp_ptr->daq_ptr_list;
+
+    if (list >= xcp_ptr->daq_count
+        || xcp_ptr->daq_ptr_odt >= xcp_ptr->daq[list].odts)
+    {
+        return error(res, XCP_ERR_SEQUENCE);
+    }
+
+    const xcp_odt_t* odt_ptr
+        = &xcp_ptr->odt[xcp_ptr->daq[list].first_odt + xcp_ptr->daq_ptr_odt];
+
+    if (xcp_ptr->daq_ptr_entry >= odt_ptr->entries)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    if (atomic_load(&xcp_ptr->running) & (1U << list))
+        return error(res, XCP_ERR_DAQ_ACTIVE);
+
+    if (cmd[1] != XCP_NO_BIT_OFFSET)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    xcp_odt_entry_t* entry_ptr
+        = &xcp_ptr->entries[odt_ptr->first_entry + xcp_ptr->daq_ptr_entry];
+
+    if (size == 0
+        || odt_size(xcp_ptr, odt_ptr) - entry_ptr->size + size
+               > XCP_ODT_ENTRY_MAX_SIZE)
+    {
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+    }
+
+    if (!is_readable(address, size))
+        return error(res, XCP_ERR_ACCESS_DENIED);
+
+    entry_ptr->address = address;
+    entry_ptr->size = size;
+    xcp_ptr->daq_ptr_entry++;
+
+    return 1;
+}
+
+/**
+ * @brief       Handles SET_DAQ_LIST_MODE
+ *
+ * @details     Only DAQ direction without timestamps is supported, and every
+ *              DTO carries its ODT number
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   cmd         Command
+ * @param[out]  res         Response
+ */
+static uint32_t set_daq_list_mode(xcp_context_t* xcp_ptr,
+                                  const uint8_t* cmd,
+                                  uint8_t* res)
+{
+    const uint8_t mode = cmd[1];
+    const uint16_t list = get_u16(&cmd[2]);
+    const uint16_t event = get_u16(&cmd[4]);
+    const uint8_t prescaler = cmd[6];
+
+    if (list >= xcp_ptr->daq_count || event >= XCP_NUM_EVENTS)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    if (mode & XCP_DAQ_MODE_UNSUPPORTED)
+        return error(res, XCP_ERR_MODE_NOT_VALID);
+
+    if (atomic_load(&xcp_ptr->running) & (1U << list))
+        return error(res, XCP_ERR_DAQ_ACTIVE);
+
+    xcp_daq_t* daq_ptr = &xcp_ptr->daq[list];
+    daq_ptr->event = event;
+    daq_ptr->prescaler = (prescaler == 0) ? 1 : prescaler;
+    daq_ptr->counter = 0;
+
+    return 1;
+}
+
+/**
+ * @brief       Handles START_STOP_DAQ_LIST
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   cmd         Command
+ * @param[out]  res         Response
+ */
+static uint32_t start_stop_daq_list(xcp_context_t* xcp_ptr,
+                                    const uint8_t* cmd,
+                                    uint8_t* res)
+{
+    const uint8_t mode = cmd[1];
+    const uint16_t list = get_u16(&cmd[2]);
+
+    if (list >= xcp_ptr->daq_count || xcp_ptr->daq[list].odts == 0)
+        return error(res, XCP_ERR_OUT_OF_RANGE);
+
+    xcp_daq_t* daq_ptr = &xcp_ptr->daq[list];
+
+    switch (mode)
+    {
+    case XCP_MODE_STOP:
+        atomic_fetch_and(&xcp_ptr->running, ~(1U << list));
+        break;
+
+    case XCP_MODE_START:
+        daq_ptr->counter = 0;
+        atomic_fetch_or(&xcp_ptr->running, 1U << list);
+        break;
+
+    case XCP_MODE_SELECT:
+        daq_ptr->selected = true;
+        break;
+
+    default:
+        return error(res, XCP_ERR_MODE_NOT_VALID);
+    }
+
+    res[1] = daq_ptr->first_odt;
+    return 2;
+}
+
+/**
+ * @brief       Handles START_STOP_SYNCH
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   cmd         Command
+ * @param[out]  res         Response
+ */
+static uint32_t start_stop_synch(xcp_context_t* xcp_ptr,
+                                 const uint8_t* cmd,
+                                 uint8_t* res)
+{
+    const uint8_t mode = cmd[1];
+    uint32_t selected = 0;
+
+    if (mode > XCP_MODE_SELECT)
+        return error(res, XCP_ERR_MODE_NOT_VALID);
+
+    for (uint32_t i = 0; i < xcp_ptr->daq_count; i++)
+    {
+        if (xcp_ptr->daq[i].selected)
+        {
+            selected |= 1U << i;
+            xcp_ptr->daq[i].counter = 0;
+            xcp_ptr->daq[i].selected = false;
+        }
+    }
+
+    if (mode == XCP_MODE_STOP)
+    {
+        atomic_store(&xcp_ptr->running, 0);
+    }
+    else if (mode == XCP_MODE_START)
+    {
+        atomic_fetch_or(&xcp_ptr->running, selected);
+    }
+    else
+    {
+        atomic_fetch_and(&xcp_ptr->running, ~selected);
+    }
+
+    return 1;
+}
+
+/**
+ * @brief       Sends one DTO frame for each ODT of a DAQ list
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   daq_ptr     DAQ list
+ */
+static void sample_daq(xcp_context_t* xcp_ptr, const xcp_daq_t* daq_ptr)
+{
+    for (uint32_t i = 0; i < daq_ptr->odts; i++)
+    {
+        const uint32_t odt_num = daq_ptr->first_odt + i;
+        const xcp_odt_t* odt_ptr = &xcp_ptr->odt[odt_num];
+
+        rtcan_msg_t msg = {.identifier = xcp_ptr->config_ptr->res_can_id,
+                           .extended = false};
+
+        msg.data[0] = odt_num;
+        msg.length = 1;
+
+        for (uint32_t j = 0; j < odt_ptr->entries; j++)
+        {
+            const xcp_odt_entry_t* entry_ptr
+                = &xcp_ptr->entries[odt_ptr->first_entry + j];
+
+            memcpy(&msg.data[msg.length],
+                   (const void*) entry_ptr->address,
+                   entry_ptr->size);
+
+            msg.length += entry_ptr->size;
+        }
+
+        if (rtcan_transmit(xcp_ptr->rtcan_s_ptr, &msg) != RTCAN_OK)
+        {
+            xcp_ptr->overloads++;
+        }
+    }
+}
+
+/**
+ * @brief       Checks if a block of memory can be read
+ *
+ * @details     Reads are limited to RAM and flash, as reading peripheral
+ *              registers can have side effects and unmapped addresses fault
+ *
+ * @param[in]   address     Start address
+ * @param[in]   size        Bytes
+ */
+static bool is_readable(uint32_t address, uint32_t size)
+{
+    const uint32_t end = address + size;
+
+    if (end < address)
+        return false;
+
+    return (address >= RAMDTCM_BASE && end <= SRAM2_BASE + 0x4000)
+           || (address >= FLASHAXI_BASE && end <= FLASH_END + 1);
+}
+
+/**
+ * @brief       Gets the number of bytes sampled by an ODT
+ *
+ * @param[in]   xcp_ptr     XCP context
+ * @param[in]   odt         ODT
+ */
+static uint32_t odt_size(const xcp_context_t* xcp_ptr, const xcp_odt_t* odt)
+{
+    uint32_t size = 0;
+
+    for (uint32_t i = 0; i < odt->entries; i++)
+    {
+        size += xcp_ptr->entries[odt->first_entry + i].size;
+    }
+
+    return size;
+}
+
+/**
+ * @brief       Builds an error response
+ *
+ * @param[out]  res     Response
+ * @param[in]   code    Error code
+ */
+static uint32_t error(uint8_t* res, uint8_t code)
+{
+    res[0] = XCP_PID_ERR;
+    res[1] = code;
+    return 2;
+}
+
+/**
+ * @brief       Reads a little endian 16 bit value
+ *
+ * @param[in]   data    First byte
+ */
+static uint16_t get_u16(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+/**
+ * @brief       Reads a little endian 32 bit value
+ *
+ * @param[in]   data    First byte
+ */
+static uint32_t get_u32(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16)
+           | ((uint32_t) data[3] << 24);
+}
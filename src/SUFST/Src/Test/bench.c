@@ -0,0 +1,300 @@
+/***************************************************************************
+ * @file   bench.c
+ * @brief  On-target benchmarks using the DWT cycle counter
+ ***************************************************************************/
+
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_TEST
+
+#include "Test/bench.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <tx_api.h>
+
+#include "irq_lock.h"
+#include "log.h"
+#include "mpsc_ring.h"
+#include "pm100.h"
+#include "str_format.h"
+
+// number of samples taken by each benchmark
+#define BENCH_ITERATIONS 256
+
+/***************************************************************************
+ * helpers
+ ***************************************************************************/
+
+/**
+ * @brief   Clears cycle count statistics
+ *
+ * @param   stats_ptr   Statistics
+ */
+void bench_stats_reset(bench_stats_t* stats_ptr)
+{
+    stats_ptr->min = UINT32_MAX;
+    stats_ptr->max = 0;
+    stats_ptr->total = 0;
+    stats_ptr->count = 0;
+}
+
+/**
+ * @brief   Adds a sample to cycle count statistics
+ *
+ * @param   stats_ptr   Statistics
+ * @param   cycles      Cycles taken by the sample
+ */
+void bench_stats_add(bench_stats_t* stats_ptr, uint32_t cycles)
+{
+    if (cycles < stats_ptr->min)
+        stats_ptr->min = cycles;
+
+    if (cycles > stats_ptr->max)
+        stats_ptr->max = cycles;
+
+    stats_ptr->total += cycles;
+    stats_ptr->count++;
+}
+
+/**
+ * @brief   Returns the mean cycle count
+ *
+ * @param   stats_ptr   Statistics
+ */
+uint32_t bench_stats_avg(const bench_stats_t* stats_ptr)
+{
+    return (stats_ptr->count > 0) ? stats_ptr->total / stats_ptr->count : 0;
+}
+
+/***************************************************************************
+ * log enqueue benchmark
+ ***************************************************************************/
+
+/*
+ * the previous log backend copied every message into a 64 byte TX_QUEUE slot,
+ * the ring only copies a short header and the characters which are used
+ */
+typedef struct
+{
+    uint32_t level;
+    ULONG timestamp;
+} bench_log_header_t;
+
+static TX_QUEUE bench_queue;
+static ULONG bench_queue_mem[16 * 4];
+static mpsc_ring_t bench_ring;
+static uint32_t bench_ring_mem[1024 / sizeof(uint32_t)];
+
+/**
+ * @brief   Compares the cost of queueing a log message with a TX_QUEUE and
+ *          with the lock-free message ring
+ *
+ * @details Both backends are private instances, so the logging service is
+ *          not disturbed. Only the enqueue is timed, each message is read
+ *          back out before the next sample.
+ */
+void bench_log_enqueue(void)
+{
+    static const char text[] = "PM100 broadcast timeout\n";
+
+    bench_stats_t queue_stats;
+    bench_stats_t ring_stats;
+    ULONG slot[16];
+
+    bench_stats_reset(&queue_stats);
+    bench_stats_reset(&ring_stats);
+
+    if (tx_queue_create(&bench_queue,
+                        NULL,
+                        TX_16_ULONG,
+                        bench_queue_mem,
+                        sizeof(bench_queue_mem))
+            != TX_SUCCESS
+        || !mpsc_ring_init(&bench_ring,
+                           bench_ring_mem,
+                           sizeof(bench_ring_mem)))
+    {
+        LOG_ERROR("Log enqueue benchmark failed to initialise\n");
+        return;
+    }
+
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        // TX_QUEUE: build the whole message then copy it into a slot
+        uint32_t start = bench_cycles();
+
+        bench_log_header_t* header_ptr = (bench_log_header_t*) slot;
+        header_ptr->level = LOG_LEVEL_WARN;
+        header_ptr->timestamp = tx_time_get();
+        memcpy(header_ptr + 1, text, sizeof(text));
+        tx_queue_send(&bench_queue, slot, TX_NO_WAIT);
+
+        bench_stats_add(&queue_stats, bench_cycles() - start);
+        tx_queue_receive(&bench_queue, slot, TX_NO_WAIT);
+
+        // ring: reserve only what is needed and write in place
+        start = bench_cycles();
+
+        header_ptr = mpsc_ring_reserve(&bench_ring,
+                                       sizeof(*header_ptr) + sizeof(text));
+
+        if (header_ptr != NULL)
+        {
+            header_ptr->level = LOG_LEVEL_WARN;
+            header_ptr->timestamp = tx_time_get();
+            memcpy(header_ptr + 1, text, sizeof(text));
+            mpsc_ring_commit(&bench_ring, header_ptr);
+        }
+
+        bench_stats_add(&ring_stats, bench_cycles() - start);
+
+        uint32_t len;
+        if (mpsc_ring_peek(&bench_ring, &len) != NULL)
+        {
+            mpsc_ring_release(&bench_ring);
+        }
+    }
+
+    tx_queue_delete(&bench_queue);
+
+    LOG_INFO("Log enqueue (cycles), TX_QUEUE: min %lu avg %lu max %lu\n",
+             queue_stats.min,
+             bench_stats_avg(&queue_stats),
+             queue_stats.max);
+
+    LOG_INFO("Log enqueue (cycles), ring: min %lu avg %lu max %lu\n",
+             ring_stats.min,
+             bench_stats_avg(&ring_stats),
+             ring_stats.max);
+}
+
+/***************************************************************************
+ * log format benchmark
+ ***************************************************************************/
+
+/**
+ * @brief   Formats a message the way the previous log backend did, with
+ *          interrupts disabled around vsnprintf()
+ */
+static void bench_format_locked(char* buf, uint32_t len, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    UINT last_interrupt_state = irq_lock();
+    vsnprintf(buf, len, fmt, args);
+    irq_unlock(last_interrupt_state);
+    va_end(args);
+}
+
+/**
+ * @brief   Compares formatting a log message with vsnprintf() behind an
+ *          interrupt lock and with the reentrant formatter
+ *
+ * @details The longest interrupt-disabled window is reported for each, the
+ *          reentrant formatter should leave it unchanged. The window seen
+ *          since start up is reported first, so regressions elsewhere in
+ *          the firmware also show up.
+ */
+void bench_log_format(void)
+{
+    static const char fmt[] = "%lu [%s]: APPS1 outside threshold (%d)\n";
+
+    bench_stats_t locked_stats;
+    bench_stats_t reentrant_stats;
+    char buf[64];
+
+    LOG_INFO("Interrupts disabled (cycles), since start up: max %lu\n",
+             irq_lock_max_cycles());
+
+    bench_stats_reset(&locked_stats);
+    bench_stats_reset(&reentrant_stats);
+
+    // vsnprintf with interrupts disabled
+    irq_lock_reset_max();
+
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        const uint32_t start = bench_cycles();
+        bench_format_locked(buf, sizeof(buf), fmt, i, "WARN", -1234);
+        bench_stats_add(&locked_stats, bench_cycles() - start);
+    }
+
+    const uint32_t locked_irq_max = irq_lock_max_cycles();
+
+    // reentrant formatter
+    irq_lock_reset_max();
+
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        const uint32_t start = bench_cycles();
+        str_format(buf, sizeof(buf), fmt, i, "WARN", -1234);
+        bench_stats_add(&reentrant_stats, bench_cycles() - start);
+    }
+
+    const uint32_t reentrant_irq_max = irq_lock_max_cycles();
+
+    LOG_INFO("Log format (cycles), locked vsnprintf: min %lu avg %lu max %lu, "
+             "irq off max %lu\n",
+             locked_stats.min,
+             bench_stats_avg(&locked_stats),
+             locked_stats.max,
+             locked_irq_max);
+
+    LOG_INFO("Log format (cycles), str_format: min %lu avg %lu max %lu, "
+             "irq off max %lu\n",
+             reentrant_stats.min,
+             bench_stats_avg(&reentrant_stats),
+             reentrant_stats.max,
+             reentrant_irq_max);
+}
+
+/***************************************************************************
+ * PM100 torque command benchmark
+ ***************************************************************************/
+
+// written every sample so the packing can't be optimised away
+static rtcan_msg_t bench_torque_msg;
+
+/**
+ * @brief   Compares packing the PM100 torque command with cantools on every
+ *          request and patching the torque into a pre-packed message
+ *
+ * @details Only the message building is timed, nothing is transmitted
+ */
+void bench_pm100_torque(void)
+{
+    bench_stats_t pack_stats;
+    bench_stats_t patch_stats;
+    rtcan_msg_t template_msg;
+
+    bench_stats_reset(&pack_stats);
+    bench_stats_reset(&patch_stats);
+    pm100_pack_torque_command(0, &template_msg);
+
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        const uint16_t torque = (uint16_t) (i * 7);
+
+        // full cantools pack
+        uint32_t start = bench_cycles();
+        pm100_pack_torque_command(torque, &bench_torque_msg);
+        bench_stats_add(&pack_stats, bench_cycles() - start);
+
+        // copy of the pre-packed message with only the torque patched
+        start = bench_cycles();
+        bench_torque_msg = template_msg;
+        pm100_patch_torque(&bench_torque_msg, torque);
+        bench_stats_add(&patch_stats, bench_cycles() - start);
+    }
+
+    LOG_INFO("Torque command (cycles), cantools: min %lu avg %lu max %lu\n",
+             pack_stats.min,
+             bench_stats_avg(&pack_stats),
+             pack_stats.max);
+
+    LOG_INFO("Torque command (cycles), patch: min %lu avg %lu max %lu\n",
+             patch_stats.min,
+             bench_stats_avg(&patch_stats),
+             patch_stats.max);
+}
@@ -1,5 +1,8 @@
 #include "config.h"
 
+#include <can_c.h>
+#include <can_s.h>
+
 /**
  * @brief   Convert seconds to ticks
  * 
@@ -9,6 +12,119 @@
  */
 #define SECONDS_TO_TICKS(x)  (TX_TIMER_TICKS_PER_SECOND * x)
 
+/**
+ * @brief   CAN broadcast table of the VCU's own frames
+ *
+ * @details Other services register their frames at init with
+ *          canbc_register(), e.g. the CAN load (canstats) and log statistics
+ *          at the broadcast periods and phases in their own configs. Phases
+ *          spread the frames out so that they are not all queued in the same
+ *          tick. Frames with a max age are checked every period but only sent
+ *          when they change or reach the max age.
+ */
+static const config_canbc_msg_t canbc_schedule[] = {
+    {
+        .frame_id = CAN_S_VCU_STATE_FRAME_ID,
+        .period_ticks = SECONDS_TO_TICKS(0.01),
+        .phase_ticks = 0,
+        .max_age_ticks = SECONDS_TO_TICKS(0.5),
+        .catch_up = false
+    },
+    {
+        .frame_id = CAN_S_VCU_SENSORS_FRAME_ID,
+        .period_ticks = SECONDS_TO_TICKS(0.01),
+        .phase_ticks = 5,
+        .max_age_ticks = 0,
+        .catch_up = true
+    },
+    {
+        .frame_id = CAN_S_VCU_ERROR_FRAME_ID,
+        .period_ticks = SECONDS_TO_TICKS(0.1),
+        .phase_ticks = 2,
+        .max_age_ticks = SECONDS_TO_TICKS(1),
+        .catch_up = false
+    },
+    {
+        .frame_id = CAN_S_VCU_PDM_FRAME_ID,
+        .period_ticks = SECONDS_TO_TICKS(0.1),
+        .phase_ticks = 7,
+        .max_age_ticks = SECONDS_TO_TICKS(1),
+        .catch_up = false
+    },
+    {
+        .frame_id = CAN_S_VCU_TEMPS_FRAME_ID,
+        .period_ticks = SECONDS_TO_TICKS(1),
+        .phase_ticks = 3,
+        .max_age_ticks = 0,
+        .catch_up = false
+    }
+};
+
+/**
+ * @brief   PM100 broadcast decoding
+ *
+ * @details Slowly changing values are decimated to keep the decode load down.
+ *          Max ages allow for a few missed frames at the PM100 broadcast rate
+ *          times the decimation. Fault codes can't be decimated.
+ */
+static const config_pm100_msg_t pm100_msgs[] = {
+    {
+        .frame_id = CAN_C_PM100_INTERNAL_STATES_FRAME_ID,
+        .decimation = 1,
+        .max_age_ticks = SECONDS_TO_TICKS(0.3)
+    },
+    {
+        .frame_id = CAN_C_PM100_FAULT_CODES_FRAME_ID,
+        .decimation = 1,
+        .max_age_ticks = SECONDS_TO_TICKS(0.3)
+    },
+    {
+        .frame_id = CAN_C_PM100_MOTOR_POSITION_INFO_FRAME_ID,
+        .decimation = 1,
+        .max_age_ticks = SECONDS_TO_TICKS(0.1)
+    },
+    {
+        .frame_id = CAN_C_PM100_CURRENT_INFO_FRAME_ID,
+        .decimation = 1,
+        .max_age_ticks = SECONDS_TO_TICKS(0.1)
+    },
+    {
+        .frame_id = CAN_C_PM100_VOLTAGE_INFO_FRAME_ID,
+        .decimation = 1,
+        .max_age_ticks = SECONDS_TO_TICKS(0.1)
+    },
+    {
+        .frame_id = CAN_C_PM100_TORQUE_AND_TIMER_INFO_FRAME_ID,
+        .decimation = 5,
+        .max_age_ticks = SECONDS_TO_TICKS(1)
+    },
+    {
+        .frame_id = CAN_C_PM100_TEMPERATURE_SET_1_FRAME_ID,
+        .decimation = 10,
+        .max_age_ticks = SECONDS_TO_TICKS(2)
+    },
+    {
+        .frame_id = CAN_C_PM100_TEMPERATURE_SET_2_FRAME_ID,
+        .decimation = 10,
+        .max_age_ticks = SECONDS_TO_TICKS(2)
+    },
+    {
+        .frame_id = CAN_C_PM100_TEMPERATURE_SET_3_FRAME_ID,
+        .decimation = 10,
+        .max_age_ticks = SECONDS_TO_TICKS(2)
+    },
+    {
+        .frame_id = CAN_C_PM100_FLUX_INFO_FRAME_ID,
+        .decimation = 10,
+        .max_age_ticks = SECONDS_TO_TICKS(2)
+    },
+    {
+        .frame_id = CAN_C_PM100_MODULATION_INDEX_AND_FLUX_WEAKENING_OUTPUT_INFO_FRAME_ID,
+        .decimation = 10,
+        .max_age_ticks = SECONDS_TO_TICKS(2)
+    }
+};
+
 /**
  * @brief   VCU configuration instance
  * 
@@ -120,8 +236,8 @@ static const config_t config_instance = {
             .stack_size = 1024
         },
         .broadcast_timeout_ticks = SECONDS_TO_TICKS(10),
-        .torque_request_timeout_ticks = SECONDS_TO_TICKS(0.1), // 100 ms
-        .precharge_timeout_ticks = SECONDS_TO_TICKS(1),
+        .msgs = pm100_msgs,
+        .msgs_len = sizeof(pm100_msgs) / sizeof(pm100_msgs[0]),
         .speed_mode = 0
     },
     .tick = {
@@ -149,7 +265,11 @@ static const config_t config_instance = {
             .priority = 4,
             .stack_size = 1024
         },
-        .broadcast_period_ticks = SECONDS_TO_TICKS(0.1)
+        .schedule = canbc_schedule,
+        .schedule_len = sizeof(canbc_schedule) / sizeof(canbc_schedule[0]),
+        .report_period_ticks = SECONDS_TO_TICKS(10),
+        .max_in_flight = 2,
+        .max_catch_up = 3
     },
     .heartbeat = {
         .thread = {
@@ -159,6 +279,42 @@ static const config_t config_instance = {
         },
         .blink_period_ticks = SECONDS_TO_TICKS(0.25)
     },
+    .canstats = {
+        .thread = {
+            .name = "CANSTATS",
+            .priority = 12,
+            .stack_size = 2048
+        },
+        .window_ticks = SECONDS_TO_TICKS(1),
+        .report_period_ticks = SECONDS_TO_TICKS(10),
+        .report_top_ids = 5,
+        .broadcast_period_ticks = SECONDS_TO_TICKS(1),
+        .broadcast_phase_ticks = 11,
+        .can_id = 0x6F4
+    },
+    .capture = {
+        .thread = {
+            .name = "CAPTURE",
+            .priority = 12,
+            .stack_size = 1024
+        },
+        .pre_trigger_samples = 100,
+        .post_trigger_samples = 400,
+        .drain_frames_per_sec = 200,
+        .drain_burst_frames = 4,
+        .idle_poll_ticks = SECONDS_TO_TICKS(0.1),
+        .can_id = 0x6F8,
+        .command_can_id = 0x6FA
+    },
+    .xcp = {
+        .thread = {
+            .name = "XCP",
+            .priority = 11,
+            .stack_size = 1024
+        },
+        .cmd_can_id = 0x6E0,
+        .res_can_id = 0x6E1
+    },
     .log = {
         .thread = {
             .name = "LOG",
@@ -166,7 +322,14 @@ static const config_t config_instance = {
             .stack_size = 1024,
         },
         .min_level = LOG_LEVEL_DEBUG,
-        .uart = &huart1
+        .uart = &huart1,
+        .msg_pool_size = 4096,
+        .stats_can_id = 0x6F0,
+        .stats_period_ticks = SECONDS_TO_TICKS(1),
+        .stats_phase_ticks = 13,
+        .stream_can_id = 0x7F0,
+        .stream_bytes_per_sec = 2048,
+        .stream_burst_bytes = 64
     },
     .rtos = {
         .rtcan_s_priority = 3,
@@ -178,7 +341,9 @@ static const config_t config_instance = {
     .testbenches = {
         .run_apps_testbench = false,
         .run_fault_state_testbench = false,
-        .apps_testbench_laps = 1
+        .apps_testbench_laps = 1,
+        .run_log_benchmark = false,
+        .run_torque_benchmark = false
     }
 };
 
@@ -6,6 +6,8 @@
  * @brief   Top level VCU implementation
  *****************************************************************************/
 
+#define LOG_MODULE_MIN_LEVEL LOG_MIN_LEVEL_VCU
+
 #include "vcu.h"
 
 #include <stdbool.h>
@@ -14,6 +16,8 @@
 #include "bps.h"
 #include "config.h"
 #include "dash.h"
+#include "irq_lock.h"
+#include "Test/bench.h"
 
 /**
  * @brief       Initialises the VCU and all system services
@@ -34,6 +38,9 @@ status_t vcu_init(vcu_context_t* vcu_ptr,
 
     status_t status = STATUS_OK;
 
+    // interrupt latency measurement (before anything can disable interrupts)
+    irq_lock_init();
+
     // logging services (first so we can log errors)
     if (status == STATUS_OK)
     {
@@ -41,6 +48,28 @@ status_t vcu_init(vcu_context_t* vcu_ptr,
             = log_init(&vcu_ptr->log, app_mem_pool, &vcu_ptr->config_ptr->log);
     }
 
+    // benchmarks
+    if (status == STATUS_OK && config_ptr->testbenches.run_log_benchmark)
+    {
+        bench_log_enqueue();
+        bench_log_format();
+    }
+
+    if (status == STATUS_OK && config_ptr->testbenches.run_torque_benchmark)
+    {
+        bench_pm100_torque();
+    }
+
+    // CAN bus statistics (before RTCAN enables the CAN interrupts)
+    if (status == STATUS_OK)
+    {
+        status = canstats_init(&vcu_ptr->canstats,
+                               can_c_h,
+                               can_s_h,
+                               app_mem_pool,
+                               &vcu_ptr->config_ptr->canstats);
+    }
+
     // RTCAN services
     rtcan_handle_t* rtcan_handles[] = {&vcu_ptr->rtcan_s, &vcu_ptr->rtcan_c};
     CAN_HandleTypeDef* can_handles[] = {can_s_h, can_c_h};
@@ -74,15 +103,48 @@ status_t vcu_init(vcu_context_t* vcu_ptr,
         }
     }
 
+    // XCP measurement, before the services which raise its events
+    if (status == STATUS_OK)
+    {
+        status = xcp_init(&vcu_ptr->xcp,
+                          &vcu_ptr->rtcan_s,
+                          app_mem_pool,
+                          &vcu_ptr->config_ptr->xcp);
+    }
+
     // CAN broadcast service
     if (status == STATUS_OK)
     {
         status = canbc_init(&vcu_ptr->canbc,
                             &vcu_ptr->rtcan_s,
+                            can_s_h,
+                            &vcu_ptr->xcp,
                             app_mem_pool,
                             &vcu_ptr->config_ptr->canbc);
     }
 
+    // log stream and statistics, CAN load broadcasts
+    if (status == STATUS_OK)
+    {
+        status = log_attach_can(&vcu_ptr->log,
+                                &vcu_ptr->rtcan_s,
+                                &vcu_ptr->canbc);
+    }
+
+    if (status == STATUS_OK)
+    {
+        status = canstats_attach_canbc(&vcu_ptr->canstats, &vcu_ptr->canbc);
+    }
+
+    // burst capture
+    if (status == STATUS_OK)
+    {
+        status = capture_init(&vcu_ptr->capture,
+                              &vcu_ptr->rtcan_s,
+                              app_mem_pool,
+                              &vcu_ptr->config_ptr->capture);
+    }
+
     // dash
     if (status == STATUS_OK)
     {
@@ -121,6 +183,8 @@ status_t vcu_init(vcu_context_t* vcu_ptr,
                            &vcu_ptr->tick,
                            &vcu_ptr->remote_ctrl,
                            &vcu_ptr->canbc,
+                           &vcu_ptr->capture,
+                           &vcu_ptr->xcp,
                            app_mem_pool,
                            &vcu_ptr->config_ptr->ctrl,
                            &vcu_ptr->config_ptr->rtds,
@@ -184,6 +248,25 @@ status_t vcu_handle_can_tx_mailbox_callback(vcu_context_t* vcu_ptr,
                       // STATUS_OK
 }
 
+/**
+ * @brief       Handles CAN transmit complete callbacks
+ *
+ * @details     Records the frame in the bus statistics while it is still in
+ *              the mailbox, then hands over to RTCAN
+ *
+ * @param[in]   vcu_ptr     VCU instance
+ * @param[in]   can_h       CAN handle from callback
+ * @param[in]   mailbox     TX mailbox number (0 to 2)
+ */
+status_t vcu_handle_can_tx_cplt(vcu_context_t* vcu_ptr,
+                                CAN_HandleTypeDef* can_h,
+                                uint32_t mailbox)
+{
+    canstats_record_tx(&vcu_ptr->canstats, can_h, mailbox);
+
+    return vcu_handle_can_tx_mailbox_callback(vcu_ptr, can_h);
+}
+
 /**
  * @brief       Handles CAN receive interrupt
  *
@@ -197,6 +280,9 @@ status_t vcu_handle_can_rx_it(vcu_context_t* vcu_ptr,
 {
     rtcan_status_t status;
 
+    // must be before RTCAN reads the frame out of the FIFO
+    canstats_record_rx(&vcu_ptr->canstats, can_h, rx_fifo);
+
     if (vcu_ptr->rtcan_c.hcan == can_h)
     {
         status = rtcan_handle_rx_it(&vcu_ptr->rtcan_c, can_h, rx_fifo);
@@ -243,3 +329,30 @@ status_t vcu_handle_can_err(vcu_context_t* vcu_ptr, CAN_HandleTypeDef* can_h)
 
     return STATUS_OK;
 }
+
+/**
+ * @brief       Handles UART transmit complete callbacks
+ *
+ * @param[in]   vcu_ptr     VCU instance
+ * @param[in]   uart_h      UART handle
+ */
+status_t vcu_handle_uart_tx_cplt(vcu_context_t* vcu_ptr,
+                                 UART_HandleTypeDef* uart_h)
+{
+    log_handle_uart_tx_cplt(&vcu_ptr->log, uart_h);
+
+    return STATUS_OK;
+}
+
+/**
+ * @brief       Handles UART errors
+ *
+ * @param[in]   vcu_ptr     VCU instance
+ * @param[in]   uart_h      UART handle
+ */
+status_t vcu_handle_uart_err(vcu_context_t* vcu_ptr, UART_HandleTypeDef* uart_h)
+{
+    log_handle_uart_err(&vcu_ptr->log, uart_h);
+
+    return STATUS_OK;
+}